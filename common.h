@@ -1,13 +1,14 @@
 #ifndef JML_COMMON_H
 #define JML_COMMON_H
 
+#include <stdint.h>
+
 void die(char *errmsg) {
   printf("%s\n",errmsg);
   exit(-1);
 }
 
-void select_endpoint_voice(int endpoint, int voice, int bank, int volume_delta,
-                           int manual_volume, bool pan);
+void forget_sent_controllers();
 
 #define CHANNEL_DRUM 9
 
@@ -28,11 +29,18 @@ void select_endpoint_voice(int endpoint, int voice, int bank, int volume_delta,
 #define N_ENDPOINTS (ENDPOINT_DRUM+1)
 #define N_DRONE_ENDPOINTS (ENDPOINT_DRONE_CHORD+1)
 
+const char* endpoint_names[N_ENDPOINTS] = {
+  "jawharp", "drone-bass", "drone-chord", "footbass", "arp", "flex", "low",
+  "hi", "overlay", "drum"};
+
 /* midi values */
 #define MIDI_OFF 0x80
 #define MIDI_ON 0x90
 #define MIDI_CC 0xb0
+#define MIDI_PROGRAM 0xc0
 #define MIDI_PITCH_BEND 0xe0
+// Not a MIDI message: drop everything scheduled that hasn't gone out yet.
+#define MIDI_CANCEL_SCHEDULED 0x01
 
 #define CC_BANK_SELECT 0x00
 #define CC_MOD 0x01
@@ -42,4 +50,28 @@ void select_endpoint_voice(int endpoint, int voice, int bank, int volume_delta,
 #define CC_PAN 0x0a
 #define CC_11 0x0b
 
+// Which kind of device an input came from.
+#define SOURCE_NONE 0
+#define SOURCE_FEET 1
+#define SOURCE_KEYBOARD 2
+#define SOURCE_BREATH 3
+#define SOURCE_KEYPAD 4
+#define N_SOURCES 5
+
+const char* source_names[N_SOURCES] = {
+  "none", "feet", "keyboard", "breath", "keypad"};
+
+// A MIDI message on its way between threads.
+struct MidiRecord {
+  uint64_t ns;      // when it arrived, or when to send it (0 for right away)
+  uint64_t cause_ns;  // for output, when the input it's a response to arrived
+  int16_t client;   // which client it came from, for input
+  uint8_t source;   // SOURCE_*: for input where it came from, and for output
+                    // what kind of input it's a response to
+  uint8_t action;   // MIDI_ON, MIDI_OFF, MIDI_CC, MIDI_PROGRAM, ...
+  uint8_t channel;
+  uint8_t note;     // or controller, or program
+  uint8_t value;    // velocity, or controller value
+};
+
 #endif
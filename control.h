@@ -0,0 +1,355 @@
+#ifndef JML_CONTROL_H
+#define JML_CONTROL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// A Unix domain socket, only if --control-socket asks for one, for other
+// programs run by the same user to change jammer's configuration, one
+// command per line:
+//
+//   scene N                   switch to scene N, like ctrl+N
+//   voice ENDPOINT VOICE      e.g. "voice arp 81"
+//   volume ENDPOINT DELTA     turn an endpoint up or down, like the keypad,
+//   octave ENDPOINT DELTA     staying within MAX_*_DELTA
+//   set ENDPOINT FLAG on|off  e.g. "set footbass doubled on"
+//   state                     what's on and how it's set up
+//
+// Each command is answered with "ok" or "error: ...", after any lines it
+// printed.  So `echo state | nc -U -q1 PATH` is a quick look.
+//
+// The commands run on a thread of their own, which asks the engine for a
+// copy of its configuration, changes the copy, and hands the engine a
+// pointer to it.  The engine makes the copy between inputs, so it's never
+// read while it's half changed.  It takes the changed copy between inputs
+// too and, if nothing changed its configuration since the copy
+// (config_generation, in jammermidilib.h), sends what's different and takes
+// the copy's settings.  Otherwise the thread starts over from a new copy.
+// Nothing is locked: the engine never waits for the thread, only the other
+// way around.  Include this after
+// jammermidilib.h and linuxapi.h.
+
+#define CONTROL_WAITING 0
+#define CONTROL_APPLIED 1
+#define CONTROL_STALE 2
+#define CONTROL_COPIED 3
+
+// A stale copy means a key was pressed while we were making it, so a few
+// tries is plenty.
+#define CONTROL_TRIES 10
+
+struct ControlChange {
+  bool copy;  // just copy the engine's configuration into config
+  int scene;  // switch to this scene instead, or -1
+  uint32_t generation;  // the config_generation config was copied at
+  struct Configuration config;
+  int result;  // CONTROL_*, set by the engine
+};
+
+struct ControlChange* pending_control = NULL;
+int control_request_fd = -1;  // wakes the engine
+int control_result_fd = -1;   // wakes the control thread
+int control_server_fd = -1;
+
+// Flags "set" can change, all bool[N_ENDPOINTS] in struct Configuration.
+struct ControlFlag {
+  const char* name;
+  size_t offset;
+};
+
+#define CONTROL_FLAG(name, field) {name, offsetof(struct Configuration, field)}
+#define N_CONTROL_FLAGS 13
+const struct ControlFlag control_flags[N_CONTROL_FLAGS] = {
+  CONTROL_FLAG("on", on),
+  CONTROL_FLAG("downbeat", downbeat),
+  CONTROL_FLAG("upbeat", upbeat),
+  CONTROL_FLAG("upbeat-high", upbeat_high),
+  CONTROL_FLAG("doubled", doubled),
+  CONTROL_FLAG("shortish", shortish),
+  CONTROL_FLAG("shorter", shorter),
+  CONTROL_FLAG("pre-unique", pre_unique),
+  CONTROL_FLAG("chord", chord),
+  CONTROL_FLAG("vel", vel),
+  CONTROL_FLAG("pan", pans),
+  CONTROL_FLAG("ducked", ducked),
+  CONTROL_FLAG("follows-air", follows_air),
+};
+
+bool* control_flag(struct Configuration* config, int flag) {
+  return (bool*)((char*)config + control_flags[flag].offset);
+}
+
+// Engine thread: take the pending change, if there is one.
+void apply_control() {
+  struct ControlChange* change =
+    __atomic_exchange_n(&pending_control, NULL, __ATOMIC_ACQUIRE);
+  if (change == NULL) return;
+
+  int result = CONTROL_APPLIED;
+  if (change->copy) {
+    change->generation = config_generation;
+    memcpy(&change->config, c, sizeof(change->config));
+    result = CONTROL_COPIED;
+  } else if (change->scene >= 0) {
+    switch_scene(change->scene);
+  } else if (change->generation != config_generation) {
+    result = CONTROL_STALE;
+  } else {
+    // c has to stay pointing into scenes[], so take the copy's settings
+    // instead of the copy.
+    struct ConfigurationChange followups =
+      begin_configuration_change(c, &change->config);
+    *c = change->config;
+    finish_configuration_change(followups);
+    check_end_notes_soon();
+  }
+  if (result == CONTROL_APPLIED) {
+    __atomic_store_n(&config_generation, config_generation + 1,
+                     __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&change->result, result, __ATOMIC_RELEASE);
+  wake_fd(control_result_fd);
+}
+
+// Control thread: hand change to the engine and wait for it.
+int submit_control(struct ControlChange* change) {
+  change->result = CONTROL_WAITING;
+  __atomic_store_n(&pending_control, change, __ATOMIC_RELEASE);
+  wake_fd(control_request_fd);
+  while (__atomic_load_n(&change->result, __ATOMIC_ACQUIRE) ==
+         CONTROL_WAITING) {
+    wait_fd(control_result_fd);
+  }
+  return change->result;
+}
+
+// Control thread: have the engine copy the configuration it's playing into
+// change, and note the config_generation it was at.
+void copy_configuration(struct ControlChange* change) {
+  change->copy = true;
+  submit_control(change);
+  change->copy = false;
+}
+
+// What a command does to a configuration, so it can be done again to a new
+// copy if the engine turns the first one down.
+struct ControlEdit {
+  char command;  // 'v'oice, v'o'lume, o'c'tave, 's'et
+  int endpoint;
+  int flag;
+  int value;
+};
+
+void apply_edit(struct Configuration* config, const struct ControlEdit* edit) {
+  switch (edit->command) {
+  case 'v':
+    config->voices[edit->endpoint] = edit->value;
+    break;
+  case 'o':
+    config->volume_deltas[edit->endpoint] = move_delta(
+      config->volume_deltas[edit->endpoint], edit->value, MAX_VOLUME_DELTA);
+    break;
+  case 'c':
+    config->octave_deltas[edit->endpoint] = move_delta(
+      config->octave_deltas[edit->endpoint], edit->value, MAX_OCTAVE_DELTA);
+    break;
+  case 's':
+    control_flag(config, edit->flag)[edit->endpoint] = edit->value;
+    break;
+  }
+}
+
+bool parse_int(const char* s, int* value) {
+  if (s == NULL) return false;
+  char* end;
+  long parsed = strtol(s, &end, 10);
+  if (end == s || *end != '\0') return false;
+  *value = parsed;
+  return true;
+}
+
+void print_control_state(FILE* out) {
+  static struct ControlChange copy;
+  copy_configuration(&copy);
+  struct Configuration* config = &copy.config;
+
+  // Only for looking at, so no need to be exact about these.
+  fprintf(out, "scene %d\n", __atomic_load_n(&current_scene, __ATOMIC_RELAXED));
+  int mode = __atomic_load_n(&musical_mode, __ATOMIC_RELAXED);
+  fprintf(out, "mode %s\n",
+          mode > 0 && mode < N_MODE_NAMES ? mode_names[mode] : "?");
+  fprintf(out, "root %d\n", __atomic_load_n(&root_note, __ATOMIC_RELAXED));
+  fprintf(out, "tempo %.1f\n", last_tempo_bpm);
+  fprintf(out, "selected %s\n", endpoint_names[config->selected_endpoint]);
+
+  for (int endpoint = 0; endpoint < N_ENDPOINTS; endpoint++) {
+    fprintf(out, "%s voice %d volume %d octave %d", endpoint_names[endpoint],
+            config->voices[endpoint], config->volume_deltas[endpoint],
+            config->octave_deltas[endpoint]);
+    for (int flag = 0; flag < N_CONTROL_FLAGS; flag++) {
+      if (control_flag(config, flag)[endpoint]) {
+        fprintf(out, " %s", control_flags[flag].name);
+      }
+    }
+    fprintf(out, "\n");
+  }
+}
+
+// Run one line's command, answering on out.
+void run_control_command(char* line, FILE* out) {
+  char* words[5];
+  int n = 0;
+  for (char* word = strtok(line, " \t\r\n"); word != NULL && n < 5;
+       word = strtok(NULL, " \t\r\n")) {
+    words[n++] = word;
+  }
+  if (n == 0) return;
+
+  static struct ControlChange change;
+  change.scene = -1;
+  struct ControlEdit edit = {0, -1, -1, 0};
+  const char* command = words[0];
+
+  if (strcmp(command, "state") == 0 && n == 1) {
+    print_control_state(out);
+    fprintf(out, "ok\n");
+    return;
+  }
+
+  if (strcmp(command, "scene") == 0 && n == 2) {
+    if (!parse_int(words[1], &change.scene) ||
+        change.scene < 0 || change.scene >= N_SCENES) {
+      fprintf(out, "error: scenes are 0 through %d\n", N_SCENES - 1);
+      return;
+    }
+    submit_control(&change);
+    fprintf(out, "ok\n");
+    return;
+  }
+
+  if (n >= 2) {
+    edit.endpoint = find_name(words[1], endpoint_names, N_ENDPOINTS);
+  }
+  if (strcmp(command, "voice") == 0 && n == 3) {
+    edit.command = 'v';
+    if (!parse_int(words[2], &edit.value) ||
+        edit.value < 0 || edit.value >= 128*9) {
+      fprintf(out, "error: bad voice %s\n", words[2]);
+      return;
+    }
+  } else if ((strcmp(command, "volume") == 0 ||
+              strcmp(command, "octave") == 0) && n == 3) {
+    edit.command = command[0] == 'v' ? 'o' : 'c';
+    // Deltas end up within these either way, like with the keypad.
+    int max = edit.command == 'o' ? 2*MAX_VOLUME_DELTA : 2*MAX_OCTAVE_DELTA;
+    if (!parse_int(words[2], &edit.value) ||
+        edit.value < -max || edit.value > max) {
+      fprintf(out, "error: %s deltas are -%d to %d\n", command, max, max);
+      return;
+    }
+  } else if (strcmp(command, "set") == 0 && n == 4) {
+    edit.command = 's';
+    for (int flag = 0; flag < N_CONTROL_FLAGS; flag++) {
+      if (strcmp(words[2], control_flags[flag].name) == 0) {
+        edit.flag = flag;
+      }
+    }
+    if (edit.flag == -1) {
+      fprintf(out, "error: unknown flag %s\n", words[2]);
+      return;
+    }
+    if (strcmp(words[3], "on") == 0) {
+      edit.value = true;
+    } else if (strcmp(words[3], "off") == 0) {
+      edit.value = false;
+    } else {
+      fprintf(out, "error: expected on or off, not %s\n", words[3]);
+      return;
+    }
+  } else {
+    fprintf(out, "error: unknown command\n");
+    return;
+  }
+  if (edit.endpoint == -1) {
+    fprintf(out, "error: unknown endpoint %s\n", words[1]);
+    return;
+  }
+
+  for (int i = 0; i < CONTROL_TRIES; i++) {
+    copy_configuration(&change);
+    apply_edit(&change.config, &edit);
+    if (submit_control(&change) == CONTROL_APPLIED) {
+      fprintf(out, "ok\n");
+      return;
+    }
+  }
+  fprintf(out, "error: configuration kept changing, try again\n");
+}
+
+void* control_thread(void* unused) {
+  while (true) {
+    int client = accept(control_server_fd, NULL, NULL);
+    if (client < 0) continue;
+    FILE* in = fdopen(client, "r");
+    FILE* out = fdopen(dup(client), "w");
+    if (in != NULL && out != NULL) {
+      char line[256];
+      while (fgets(line, sizeof(line), in) != NULL) {
+        run_control_command(line, out);
+        fflush(out);
+      }
+    }
+    if (in != NULL) fclose(in); else close(client);
+    if (out != NULL) fclose(out);
+  }
+  return NULL;
+}
+
+// Listen on path.  Like the stats file, if we can't we carry on without.
+// Returns whether we're listening.
+bool start_control_thread(const char* path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "%s: control socket path too long\n", path);
+    return false;
+  }
+  strcpy(address.sun_path, path);
+
+  // A socket here is left over from a jammer that didn't get to clean up.
+  // Anything else is a typo we shouldn't delete, and bind() will refuse it.
+  struct stat existing;
+  if (lstat(path, &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+    unlink(path);
+  }
+  // Anyone who can connect can change what we're playing, so only us.
+  control_server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (control_server_fd < 0 ||
+      bind(control_server_fd, (struct sockaddr*)&address,
+           sizeof(address)) < 0 ||
+      chmod(path, 0600) < 0 ||
+      listen(control_server_fd, 4) < 0) {
+    perror(path);
+    if (control_server_fd >= 0) close(control_server_fd);
+    control_server_fd = -1;
+    return false;
+  }
+
+  control_request_fd = attempt(eventfd(0, EFD_NONBLOCK),
+                               "create control request eventfd");
+  control_result_fd = attempt(eventfd(0, 0), "create control result eventfd");
+  start_thread(control_thread, /*realtime=*/false, "start control thread");
+  return true;
+}
+
+#endif
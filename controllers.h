@@ -0,0 +1,126 @@
+#ifndef JML_CONTROLLERS_H
+#define JML_CONTROLLERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "common.h"
+
+// Shadow copy of the controllers we've set on each channel.  Several parts of
+// the engine write CC 11 to the same channel in a single tick, and voice
+// selection resends volume, pan, and balance whether or not they changed, so
+// send_midi() holds controller changes here until something else needs to go
+// out on that channel (or the batch ends) and then sends only the last value,
+// and only if it differs from what the synth already has.
+//
+// Values are stored plus one, so 0 means we don't know.
+//
+// Shared by jammer and jammer-sim, so the sim's log has what jammer would
+// really send.
+#define N_CHANNELS 16
+
+// Up to the platform, linuxapi.h or simapi.h.
+extern uint64_t send_at_ns;
+extern int cause_source;
+extern uint64_t cause_ns;
+void emit_controller(int channel, int controller, int value);
+
+uint8_t sent_controllers[N_CHANNELS][128];
+uint8_t pending_controllers[N_CHANNELS][128];
+uint8_t pending_controller_list[N_CHANNELS][128];
+// What caused the first of the writes we're holding, for record_latency().
+uint8_t pending_controller_sources[N_CHANNELS][128];
+uint64_t pending_controller_causes[N_CHANNELS][128];
+int n_pending_controllers[N_CHANNELS];
+
+uint64_t n_controller_writes = 0;
+uint64_t n_controller_writes_sent = 0;
+uint64_t n_controller_writes_redundant = 0;
+uint64_t n_controller_writes_merged = 0;
+
+// Bank select only means something right before a program change, and channel
+// mode messages (all notes off etc) are commands rather than state.
+bool caches_controller(int controller) {
+  return controller != CC_BANK_SELECT && controller < 120;
+}
+
+void flush_channel_controllers(int channel) {
+  for (int i = 0; i < n_pending_controllers[channel]; i++) {
+    int controller = pending_controller_list[channel][i];
+    uint8_t pending = pending_controllers[channel][controller];
+    pending_controllers[channel][controller] = 0;
+    if (pending == sent_controllers[channel][controller]) {
+      // Changed and then changed back.
+      n_controller_writes_redundant++;
+      continue;
+    }
+    sent_controllers[channel][controller] = pending;
+    n_controller_writes_sent++;
+    emit_controller(channel, controller, pending - 1);
+  }
+  n_pending_controllers[channel] = 0;
+}
+
+void flush_controllers() {
+  for (int channel = 0; channel < N_CHANNELS; channel++) {
+    flush_channel_controllers(channel);
+  }
+}
+
+// Send everything from scratch next time, for when the synth may have been
+// restarted or reset behind our back.
+void forget_sent_controllers() {
+  flush_controllers();
+  memset(sent_controllers, 0, sizeof(sent_controllers));
+}
+
+void set_controller(int channel, int controller, int value) {
+  n_controller_writes++;
+  if (pending_controllers[channel][controller]) {
+    n_controller_writes_merged++;
+    if (pending_controller_causes[channel][controller] == 0) {
+      pending_controller_sources[channel][controller] = cause_source;
+      pending_controller_causes[channel][controller] = cause_ns;
+    }
+  } else if (sent_controllers[channel][controller] == value + 1) {
+    n_controller_writes_redundant++;
+    return;
+  } else {
+    pending_controller_list[channel][n_pending_controllers[channel]++] =
+      controller;
+    pending_controller_sources[channel][controller] = cause_source;
+    pending_controller_causes[channel][controller] = cause_ns;
+  }
+  pending_controllers[channel][controller] = value + 1;
+}
+
+void print_controller_stats() {
+  printf("controllers: %" PRIu64 " writes, %" PRIu64 " sent, %" PRIu64
+         " redundant, %" PRIu64 " merged\n",
+         n_controller_writes, n_controller_writes_sent,
+         n_controller_writes_redundant, n_controller_writes_merged);
+}
+
+// send_midi() calls this first: if it's a controller change we can hold,
+// hold it and return true.  Otherwise send what's held for the channel, so
+// it goes out ahead of this.
+bool hold_controller(int action, int channel, int note, int value) {
+  if (action == MIDI_CC && caches_controller(note)) {
+    if (send_at_ns == 0) {
+      set_controller(channel, note, value);
+      return true;
+    }
+    // We don't know what the channel will have between now and when this
+    // goes out.
+    flush_channel_controllers(channel);
+    sent_controllers[channel][note] = 0;
+    return false;
+  }
+  // Keep controller changes ahead of whatever was sent after them.
+  flush_channel_controllers(channel);
+  return false;
+}
+
+#endif
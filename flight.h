@@ -0,0 +1,288 @@
+#ifndef JML_FLIGHT_H
+#define JML_FLIGHT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "common.h"
+
+// A flight recorder for input.  Every input record the engine handles goes
+// into a ring in a memory-mapped file, by default /dev/shm/jammer-flight, so
+// after something goes wrong on stage the last few minutes of what we played
+// are there to look at, even if jammer crashed.  Optionally a background
+// thread also copies everything to a capture file for the whole session.
+//
+// Both files are a FlightHeader followed by FlightRecords.  In the ring file
+// the records wrap around, and n_written says where the newest one is; in a
+// capture they're just in order.  read_flight() handles either, and
+// jammer-sim --capture and jammer --replay play them back.
+
+#define FLIGHT_MAGIC 0x52464d4a  // "JMFR"
+#define FLIGHT_VERSION 1
+
+struct FlightHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size;
+  // Records in the ring, or 0 for a capture.
+  uint64_t capacity;
+  // How many records have ever been written.  Only the engine thread writes
+  // this, after the record it counts.
+  uint64_t n_written;
+  uint64_t unused[5];  // pad to 64 bytes
+};
+
+struct FlightRecord {
+  uint64_t ns;      // when it arrived, on the now() clock
+  uint8_t source;   // SOURCE_*
+  uint8_t action;   // MIDI_ON, MIDI_OFF, or MIDI_CC
+  uint8_t channel;
+  uint8_t note;     // or controller
+  uint8_t value;    // velocity, or controller value
+  uint8_t unused[3];
+};
+
+// The ring is sized for this many inputs a second, which is more than a
+// breath controller and everything else together send.
+#define FLIGHT_RECORDS_PER_SEC 1000
+
+struct FlightHeader* flight = NULL;
+struct FlightRecord* flight_records = NULL;
+
+void init_flight_header(struct FlightHeader* header, uint64_t capacity) {
+  memset(header, 0, sizeof(*header));
+  header->magic = FLIGHT_MAGIC;
+  header->version = FLIGHT_VERSION;
+  header->record_size = sizeof(struct FlightRecord);
+  header->capacity = capacity;
+}
+
+// If fname holds a recording with anything in it, move it to fname.prev,
+// so starting over doesn't wipe out what led up to a crash.  A recording
+// that's empty, like one from a jammer that crashed before any input, leaves
+// the one already there alone.
+void keep_previous_flight(const char* fname) {
+  FILE* file = fopen(fname, "r");
+  if (file == NULL) return;
+  struct FlightHeader header;
+  bool recorded = fread(&header, sizeof(header), 1, file) == 1 &&
+    header.magic == FLIGHT_MAGIC && header.n_written > 0;
+  fclose(file);
+  if (!recorded) return;
+
+  char prev_fname[4096];
+  snprintf(prev_fname, sizeof(prev_fname), "%s.prev", fname);
+  if (rename(fname, prev_fname) < 0) {
+    perror(prev_fname);
+    return;
+  }
+  printf("kept the previous recording as %s\n", prev_fname);
+}
+
+// Map a ring big enough for minutes of input at fname, starting it over
+// after keeping the last one.  Call before go_realtime(), so mlockall()
+// covers it.
+void start_flight_recorder(const char* fname, int minutes) {
+  uint64_t capacity = (uint64_t) minutes * 60 * FLIGHT_RECORDS_PER_SEC;
+  size_t size = sizeof(struct FlightHeader) +
+    capacity * sizeof(struct FlightRecord);
+
+  keep_previous_flight(fname);
+  int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(fname);
+    die("open flight recorder");
+  }
+  if (ftruncate(fd, size) < 0) {
+    perror(fname);
+    die("size flight recorder");
+  }
+  void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    perror(fname);
+    die("map flight recorder");
+  }
+  close(fd);
+
+  // Touching every page now means recording never faults.
+  memset(mapped, 0, size);
+  flight = mapped;
+  flight_records = (struct FlightRecord*) (flight + 1);
+  init_flight_header(flight, capacity);
+  printf("recording the last %d minutes of input to %s\n", minutes, fname);
+}
+
+// Engine thread only.  No syscalls, just a copy into the mapping.
+void flight_record(const struct MidiRecord* record) {
+  if (flight == NULL) return;
+
+  uint64_t n = flight->n_written;
+  struct FlightRecord* out = &flight_records[n % flight->capacity];
+  out->ns = record->ns;
+  out->source = record->source;
+  out->action = record->action;
+  out->channel = record->channel;
+  out->note = record->note;
+  out->value = record->value;
+  __atomic_store_n(&flight->n_written, n + 1, __ATOMIC_RELEASE);
+}
+
+// With --capture, a background thread follows the ring and appends to a
+// file.  It wakes a few times a second, so it only loses records if input
+// outruns the whole ring in that time.
+#define CAPTURE_INTERVAL_US 100000
+
+const char* capture_fname = NULL;
+FILE* capture_file = NULL;
+uint64_t capture_next = 0;  // the next record to copy, counting as n_written
+uint64_t n_captured = 0;
+uint64_t n_capture_lost = 0;
+volatile bool capture_running = false;
+pthread_t capture_thread_id;
+
+void capture_pending() {
+  uint64_t n_written = __atomic_load_n(&flight->n_written, __ATOMIC_ACQUIRE);
+  if (n_written - capture_next > flight->capacity) {
+    n_capture_lost += n_written - capture_next - flight->capacity;
+    capture_next = n_written - flight->capacity;
+  }
+  while (capture_next < n_written) {
+    // Up to the end of the ring at most, then go around again.
+    uint64_t index = capture_next % flight->capacity;
+    uint64_t n = n_written - capture_next;
+    if (n > flight->capacity - index) {
+      n = flight->capacity - index;
+    }
+    if (fwrite(&flight_records[index], sizeof(struct FlightRecord), n,
+               capture_file) != n) {
+      perror("write capture");
+      return;
+    }
+    n_captured += n;
+    capture_next += n;
+  }
+  fflush(capture_file);
+}
+
+void* capture_thread(void* unused) {
+  while (capture_running) {
+    capture_pending();
+    usleep(CAPTURE_INTERVAL_US);
+  }
+  capture_pending();
+  return NULL;
+}
+
+// Like the logger, the capture thread is never real-time or on the
+// engine's core.
+void start_capture(const char* fname) {
+  if (flight == NULL) {
+    die("--capture needs the flight recorder");
+  }
+  capture_fname = fname;
+  capture_file = fopen(fname, "w");
+  if (capture_file == NULL) {
+    perror(fname);
+    die("open capture");
+  }
+  struct FlightHeader header;
+  init_flight_header(&header, 0);
+  capture_next = flight->n_written;
+  fwrite(&header, sizeof(header), 1, capture_file);
+
+  capture_running = true;
+  capture_thread_id =
+    start_thread(capture_thread, /*realtime=*/false, "start capture thread");
+  printf("capturing input to %s\n", fname);
+}
+
+// Write out the rest and close the capture.
+void stop_capture() {
+  if (!capture_running) return;
+  capture_running = false;
+  pthread_join(capture_thread_id, NULL);
+  fclose(capture_file);
+  capture_file = NULL;
+}
+
+void print_flight_stats() {
+  if (flight == NULL) return;
+  printf("flight recorder: %" PRIu64 " inputs recorded", flight->n_written);
+  if (capture_fname != NULL) {
+    printf(", %" PRIu64 " captured to %s, %" PRIu64 " lost", n_captured,
+           capture_fname, n_capture_lost);
+  }
+  printf("\n");
+}
+
+// Read a ring or a capture into an array of records in the order they
+// arrived, and set *n to how many.  Exits if fname isn't one.
+struct FlightRecord* read_flight(const char* fname, uint64_t* n) {
+  FILE* file = fopen(fname, "r");
+  if (file == NULL) {
+    perror(fname);
+    exit(1);
+  }
+  struct FlightHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      header.magic != FLIGHT_MAGIC) {
+    fprintf(stderr, "%s: not a flight recording\n", fname);
+    exit(1);
+  }
+  if (header.version != FLIGHT_VERSION ||
+      header.record_size != sizeof(struct FlightRecord)) {
+    fprintf(stderr, "%s: flight recording version %d, expected %d\n",
+            fname, header.version, FLIGHT_VERSION);
+    exit(1);
+  }
+
+  // A capture is as long as the file; a crash can leave a partial record on
+  // the end, which we drop.
+  fseek(file, 0, SEEK_END);
+  uint64_t n_stored =
+    (ftell(file) - sizeof(header)) / sizeof(struct FlightRecord);
+  fseek(file, sizeof(header), SEEK_SET);
+  if (header.capacity != 0 && n_stored > header.capacity) {
+    n_stored = header.capacity;
+  }
+
+  struct FlightRecord* stored =
+    malloc((n_stored + 1) * sizeof(struct FlightRecord));
+  if (stored == NULL) {
+    die("alloc flight records");
+  }
+  n_stored = fread(stored, sizeof(struct FlightRecord), n_stored, file);
+  fclose(file);
+
+  if (header.capacity == 0) {
+    *n = n_stored;
+    return stored;
+  }
+
+  // Unroll the ring, oldest first.
+  uint64_t first = header.n_written > header.capacity ?
+    header.n_written - header.capacity : 0;
+  *n = header.n_written - first;
+  if (*n > n_stored) {
+    *n = n_stored;
+  }
+  struct FlightRecord* records =
+    malloc((*n + 1) * sizeof(struct FlightRecord));
+  if (records == NULL) {
+    die("alloc flight records");
+  }
+  for (uint64_t i = 0; i < *n; i++) {
+    records[i] = stored[(first + i) % header.capacity];
+  }
+  free(stored);
+  return records;
+}
+
+#endif
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "simapi.h"
+#include "jammermidilib.h"
+
+// Microbenchmarks for the engine's hot functions, run against simapi.h with
+// the MIDI sink discarding everything.  Prints JSON to stdout, one entry per
+// benchmark, so runs from different builds can be compared.  midi_per_op is
+// how many messages each op sent, as a check that the benchmark is really
+// exercising what it says it is.
+
+// How long to spend measuring each benchmark, after warming up.
+#define BENCH_NS (NS_PER_SEC / 2)
+
+uint64_t wall_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}
+
+// Fresh engine state at a fixed virtual time, so each benchmark starts from
+// the same place.
+void bench_reset() {
+  sim_ns = 1000 * NS_PER_SEC;
+  full_reset();
+  wheel_init(&wheel);
+  cancel_subbeats();
+  end_notes_event = WHEEL_NONE;
+  fade_event = WHEEL_NONE;
+  duck_event = WHEEL_NONE;
+  last_tick_ns = 0;
+  tick_n = 0;
+  air = 0;
+  breath = 0;
+  jml_tick(sim_ns);
+}
+
+// Kicks and snares at 120bpm, with a little jitter, filling both buffers.
+void fill_hits() {
+  uint64_t beat_ns = NS_PER_SEC / 2;
+  for (int i = 0; i < KICK_TIMES_LENGTH; i++) {
+    kick_times[i] = sim_ns - (KICK_TIMES_LENGTH - i) * beat_ns +
+      (i % 3) * 1000000;
+  }
+  kick_times_index = 0;
+  for (int i = 0; i < SNARE_TIMES_LENGTH; i++) {
+    snare_times[i] = sim_ns - (SNARE_TIMES_LENGTH - i) * beat_ns +
+      beat_ns / 2 + (i % 2) * 2000000;
+  }
+  snare_times_index = 0;
+}
+
+void turn_on_everything() {
+  for (int endpoint = 0; endpoint < N_ENDPOINTS; endpoint++) {
+    c->on[endpoint] = true;
+  }
+  c->chord[ENDPOINT_ARP] = true;
+}
+
+void setup_tempo() {
+  bench_reset();
+  turn_on_everything();
+  fill_hits();
+}
+
+void bench_estimate_tempo_helper() {
+  estimate_tempo_helper(sim_ns, /*consider_high=*/false,
+                        TEMPO_DEFAULT_WINDOW_BPM, /*slower=*/true);
+}
+
+void bench_estimate_tempo_helper_high() {
+  estimate_tempo_helper(sim_ns, /*consider_high=*/true,
+                        TEMPO_DEFAULT_WINDOW_BPM, /*slower=*/true);
+}
+
+int bench_counter = 0;
+
+// One kick or snare at 120bpm through the incremental estimator, which is
+// what estimate_tempo() does per hit with --incremental-tempo.
+void setup_tempo_tracker() {
+  bench_reset();
+  tempo_tracker_clear(&low_tempo);
+}
+
+void bench_tempo_tracker_hit() {
+  sim_ns += NS_PER_SEC / 4 + (bench_counter++ % 5) * 1000000;
+  tempo_tracker_hit(&low_tempo, sim_ns, /*insert=*/true,
+                    TEMPO_DEFAULT_WINDOW_BPM,
+                    /*slower=*/true);
+}
+
+void bench_arpeggiate_bar() {
+  for (int subbeat = 0; subbeat < N_SUBBEATS; subbeat++) {
+    arpeggiate(subbeat, sim_ns + subbeat * 7000000, /*drone=*/false,
+               /*running=*/true);
+  }
+}
+
+void setup_update_bass() {
+  bench_reset();
+  turn_on_everything();
+  breath = 90;
+}
+
+void bench_update_bass() {
+  root_note = to_root(24 + bench_counter++ % 12);
+  update_bass(/*force_refresh=*/false);
+}
+
+// One breath reading and the tick after it, 1ms apart.
+void bench_breath_1khz() {
+  sim_ns += TICK_NS;
+  handle_cc(CC_BREATH, 64 + 63 * sin(bench_counter++ / 100.0));
+  jml_tick(sim_ns);
+}
+
+void setup_piano() {
+  bench_reset();
+  turn_on_everything();
+}
+
+// Press and release a six note chord.
+void bench_piano_chord() {
+  int base = 48 + bench_counter++ % 12;
+  int offsets[] = {0, 4, 7, 12, 16, 19};
+  for (int i = 0; i < 6; i++) {
+    handle_piano(MIDI_ON, base + offsets[i], 90);
+  }
+  for (int i = 0; i < 6; i++) {
+    handle_piano(MIDI_OFF, base + offsets[i], 0);
+  }
+}
+
+void setup_drum_pedal_note() {
+  bench_reset();
+  drum_chooses_notes = true;
+}
+
+void bench_update_drum_pedal_note() {
+  int pedals[] = {MIDI_PEDAL_1, MIDI_PEDAL_2, MIDI_PEDAL_3, MIDI_PEDAL_4,
+                  MIDI_PEDAL_12, MIDI_PEDAL_13, MIDI_PEDAL_23, MIDI_PEDAL_24,
+                  MIDI_PEDAL_34, MIDI_PEDAL_41};
+  most_recent_drum_pedal = pedals[bench_counter++ % 10];
+  musical_mode = MODE_MAJOR + bench_counter / 10 % 4;
+  update_drum_pedal_note();
+}
+
+// A running bar with everything on, ducking, and breath: kick on every beat
+// so the wheel always has a bar of subbeats, and tick every 1ms.
+void setup_jml_tick() {
+  bench_reset();
+  turn_on_everything();
+  c->ducked[ENDPOINT_ARP] = true;
+  breath = 90;
+  bench_counter = 0;
+}
+
+void bench_jml_tick() {
+  sim_ns += TICK_NS;
+  if (bench_counter++ % 500 == 0) {
+    handle_feet(MIDI_ON, MIDI_DRUM_IN_KICK, 100, sim_ns);
+  }
+  jml_tick(sim_ns);
+}
+
+void ignore_event(int arg, uint64_t current_time) {
+}
+
+// A thousand events due within one 1ms wheel slot, scheduled and then run.
+void bench_wheel_burst() {
+  uint64_t slot_ns = ((sim_ns >> WHEEL_SLOT_BITS) + 1) << WHEEL_SLOT_BITS;
+  for (int i = 0; i < 1000; i++) {
+    wheel_schedule(&wheel, slot_ns + i * 1000, ignore_event, i);
+  }
+  sim_ns = slot_ns + (1 << WHEEL_SLOT_BITS) - 1;
+  wheel_run(&wheel, sim_ns);
+}
+
+struct Benchmark {
+  const char* name;
+  void (*setup)();
+  void (*run)();
+};
+
+struct Benchmark benchmarks[] = {
+  {"estimate_tempo_helper", setup_tempo, bench_estimate_tempo_helper},
+  {"estimate_tempo_helper_high", setup_tempo,
+   bench_estimate_tempo_helper_high},
+  {"tempo_tracker_hit", setup_tempo_tracker, bench_tempo_tracker_hit},
+  {"arpeggiate_bar", setup_tempo, bench_arpeggiate_bar},
+  {"update_bass", setup_update_bass, bench_update_bass},
+  {"breath_1khz", setup_update_bass, bench_breath_1khz},
+  {"piano_chord", setup_piano, bench_piano_chord},
+  {"update_drum_pedal_note", setup_drum_pedal_note,
+   bench_update_drum_pedal_note},
+  {"jml_tick", setup_jml_tick, bench_jml_tick},
+  {"wheel_burst", bench_reset, bench_wheel_burst},
+};
+
+#define N_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int main(int argc, char** argv) {
+  // The JSON gets stdout to itself: anything the engine prints goes to
+  // stderr.
+  FILE* results = fdopen(dup(STDOUT_FILENO), "w");
+  if (results == NULL) {
+    die("open results");
+  }
+  dup2(STDERR_FILENO, STDOUT_FILENO);
+
+  // Keep jlog()'s printing out of the measurements.
+  log_level = -1;
+  srand(1);
+  sim_ns = 1000 * NS_PER_SEC;
+  init_rig(NULL);
+  jml_setup();
+
+  fprintf(results, "{\n  \"compiler\": \"%s\",\n  \"benchmarks\": [\n",
+          __VERSION__);
+  for (int b = 0; b < N_BENCHMARKS; b++) {
+    struct Benchmark* benchmark = &benchmarks[b];
+    benchmark->setup();
+    bench_counter = 0;
+
+    // Warm up, and find a batch size that takes at least a millisecond so
+    // reading the clock doesn't dominate.  Each op ends with jammer's
+    // controller flush, like each batch of work does there.
+    uint64_t batch = 1;
+    while (true) {
+      uint64_t start = wall_ns();
+      for (uint64_t i = 0; i < batch; i++) {
+        benchmark->run();
+        flush_controllers();
+      }
+      if (wall_ns() - start > 1000000) break;
+      batch *= 2;
+    }
+
+    uint64_t iterations = 0;
+    uint64_t events_before = n_sim_events;
+    uint64_t start = wall_ns();
+    uint64_t elapsed;
+    do {
+      for (uint64_t i = 0; i < batch; i++) {
+        benchmark->run();
+        flush_controllers();
+      }
+      iterations += batch;
+      elapsed = wall_ns() - start;
+    } while (elapsed < BENCH_NS);
+
+    double ns_per_op = (double) elapsed / iterations;
+    fprintf(results,
+            "    {\"name\": \"%s\", \"iterations\": %" PRIu64
+            ", \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f"
+            ", \"midi_per_op\": %.2f}%s\n",
+            benchmark->name, iterations, ns_per_op, NS_PER_SEC / ns_per_op,
+            (double) (n_sim_events - events_before) / iterations,
+            b + 1 < N_BENCHMARKS ? "," : "");
+  }
+  fprintf(results, "  ]\n}\n");
+  fclose(results);
+  return 0;
+}
@@ -0,0 +1,636 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "simapi.h"
+#include "jammermidilib.h"
+#include "flight.h"
+#include "snapshot.h"
+
+// Runs the engine against a virtual clock, as fast as it will go, with input
+// from a script and output written to a log.  See "Simulation" in the README
+// for the formats.
+
+struct SimInput {
+  uint64_t ns;
+  int source;  // SOURCE_*
+  int action;
+  int note;
+  int value;
+  // Only for --drummer: the tempo the drummer is playing, and whether this
+  // hit is on a downbeat.
+  float bpm;
+  bool downbeat;
+};
+
+struct SimInput* inputs = NULL;
+int n_inputs = 0;
+
+// Script times are relative to this, so that the clock never reads 0, which
+// the engine takes to mean it hasn't started.
+#define SIM_START_NS NS_PER_SEC
+
+int parse_source(const char* name) {
+  for (int i = 0; i < N_SOURCES; i++) {
+    if (strcmp(name, source_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int parse_action(const char* name) {
+  if (strcmp(name, "on") == 0) return MIDI_ON;
+  if (strcmp(name, "off") == 0) return MIDI_OFF;
+  if (strcmp(name, "cc") == 0) return MIDI_CC;
+  return -1;
+}
+
+// Notes are numbers, or a single character for keypad keys.
+int parse_note(const char* text) {
+  if (text[0] != '\0' && text[1] == '\0' &&
+      (text[0] < '0' || text[0] > '9')) {
+    return (unsigned char) text[0];
+  }
+  return atoi(text);
+}
+
+int inputs_capacity = 0;
+
+void add_input(const struct SimInput* input) {
+  if (n_inputs == inputs_capacity) {
+    inputs_capacity = inputs_capacity == 0 ? 1024 : inputs_capacity * 2;
+    inputs = realloc(inputs, inputs_capacity * sizeof(struct SimInput));
+    if (inputs == NULL) {
+      die("alloc inputs");
+    }
+  }
+  inputs[n_inputs++] = *input;
+}
+
+void read_inputs(FILE* file, const char* fname) {
+  char line[256];
+  int line_n = 0;
+  while (fgets(line, sizeof(line), file)) {
+    line_n++;
+    char* hash = strchr(line, '#');
+    if (hash) *hash = '\0';
+
+    double seconds;
+    char source[32], action[32], note[32];
+    int value;
+    int n = sscanf(line, "%lf %31s %31s %31s %d",
+                   &seconds, source, action, note, &value);
+    if (n <= 0) continue;  // blank or comment
+
+    struct SimInput input = {0};
+    input.ns = SIM_START_NS + llround(seconds * NS_PER_SEC);
+    input.source = parse_source(source);
+    input.action = parse_action(action);
+    input.note = n == 5 ? parse_note(note) : -1;
+    input.value = value;
+    if (n != 5 || seconds < 0 || input.source < 0 || input.action < 0) {
+      fprintf(stderr, "%s:%d: expected: seconds source action note value\n",
+              fname, line_n);
+      exit(1);
+    }
+    if (n_inputs > 0 && input.ns < inputs[n_inputs - 1].ns) {
+      fprintf(stderr, "%s:%d: inputs must be in time order\n", fname, line_n);
+      exit(1);
+    }
+
+    add_input(&input);
+  }
+}
+
+// Inputs from a flight recording, timed from its first one.
+void read_capture(const char* fname) {
+  uint64_t n;
+  struct FlightRecord* records = read_flight(fname, &n);
+  for (uint64_t i = 0; i < n; i++) {
+    struct SimInput input = {0};
+    input.ns = SIM_START_NS + (records[i].ns - records[0].ns);
+    input.source = records[i].source < N_SOURCES ?
+      records[i].source : SOURCE_NONE;
+    input.action = records[i].action;
+    input.note = records[i].note;
+    input.value = records[i].value;
+    add_input(&input);
+  }
+  free(records);
+}
+
+// Write the inputs out as a script, to read or edit.
+void print_inputs() {
+  for (int i = 0; i < n_inputs; i++) {
+    const struct SimInput* input = &inputs[i];
+    printf("%.6f %s %s %d %d\n",
+           (input->ns - SIM_START_NS) / (double) NS_PER_SEC,
+           source_names[input->source],
+           input->action == MIDI_ON ? "on" :
+           input->action == MIDI_OFF ? "off" : "cc",
+           input->note, input->value);
+  }
+}
+
+// --drummer SPEC plays a made-up drummer instead of a script, so we can see
+// how closely the engine follows someone whose tempo we know.  SPEC is
+// comma-separated key=value pairs; see "Simulation" in the README.
+struct Drummer {
+  float bpm;  // 0 for a random tempo each run
+  int bars;
+  int runs;
+  bool snare;  // a snare halfway through each bar, as well as the kick
+  double jitter_ms;
+  double drift_percent;
+  double skip;
+  double extra;
+  unsigned int seed;
+};
+
+// The drummer has its own random numbers, so the engine's choices are the
+// same as with a script.
+unsigned int drummer_random_state;
+
+double drummer_random() {
+  return rand_r(&drummer_random_state) / (RAND_MAX + 1.0);
+}
+
+double drummer_gaussian() {
+  return sqrt(-2 * log(1 - drummer_random())) *
+    cos(2 * M_PI * drummer_random());
+}
+
+void parse_drummer(struct Drummer* drummer, char* spec) {
+  drummer->bpm = 0;
+  drummer->bars = 64;
+  drummer->runs = 1;
+  drummer->snare = false;
+  drummer->jitter_ms = 0;
+  drummer->drift_percent = 0;
+  drummer->skip = 0;
+  drummer->extra = 0;
+  drummer->seed = 1;
+
+  for (char* pair = strtok(spec, ","); pair != NULL;
+       pair = strtok(NULL, ",")) {
+    char* value = strchr(pair, '=');
+    if (value == NULL) {
+      fprintf(stderr, "--drummer: expected key=value, not %s\n", pair);
+      exit(1);
+    }
+    *value++ = '\0';
+    if (strcmp(pair, "bpm") == 0) {
+      drummer->bpm = atof(value);
+    } else if (strcmp(pair, "bars") == 0) {
+      drummer->bars = atoi(value);
+    } else if (strcmp(pair, "runs") == 0) {
+      drummer->runs = atoi(value);
+    } else if (strcmp(pair, "pattern") == 0 &&
+               (strcmp(value, "kick") == 0 ||
+                strcmp(value, "kick-snare") == 0)) {
+      drummer->snare = strcmp(value, "kick-snare") == 0;
+    } else if (strcmp(pair, "jitter") == 0) {
+      drummer->jitter_ms = atof(value);
+    } else if (strcmp(pair, "drift") == 0) {
+      drummer->drift_percent = atof(value);
+    } else if (strcmp(pair, "skip") == 0) {
+      drummer->skip = atof(value);
+    } else if (strcmp(pair, "extra") == 0) {
+      drummer->extra = atof(value);
+    } else if (strcmp(pair, "seed") == 0) {
+      drummer->seed = atoi(value);
+    } else {
+      fprintf(stderr, "--drummer: bad %s=%s\n", pair, value);
+      exit(1);
+    }
+  }
+}
+
+void add_hit(double seconds, int note, float bpm, bool downbeat,
+             const struct Drummer* drummer) {
+  struct SimInput input = {0};
+  seconds += drummer->jitter_ms / 1000 * drummer_gaussian();
+  input.ns = SIM_START_NS + llround(seconds * NS_PER_SEC);
+  input.source = SOURCE_FEET;
+  input.action = MIDI_ON;
+  input.note = note;
+  input.value = 100;
+  input.bpm = bpm;
+  input.downbeat = downbeat;
+  add_input(&input);
+}
+
+int compare_inputs(const void* a, const void* b) {
+  uint64_t a_ns = ((const struct SimInput*) a)->ns;
+  uint64_t b_ns = ((const struct SimInput*) b)->ns;
+  return a_ns < b_ns ? -1 : a_ns > b_ns;
+}
+
+// How the engine did against the drummer.  For each downbeat, how far it is
+// from where the engine expected the bar before it to end, and for each
+// tempo the engine picks, whether it's the drummer's.
+#define DRUMMER_RIGHT_TEMPO 0.03
+uint64_t* drummer_bar_errors;
+int drummer_n_downbeats = 0;
+int drummer_n_bar_errors = 0;
+int drummer_n_tempos = 0;
+int drummer_n_right_tempos = 0;
+double drummer_right_tempo_error = 0;
+
+// Runs are far enough apart that none of one is left in the hit history
+// when the next starts.
+#define DRUMMER_GAP_SECONDS 30
+
+void generate_drummer(const struct Drummer* drummer) {
+  drummer_random_state = drummer->seed;
+
+  // Footbass on, so there's something to listen to.
+  struct SimInput footbass = {0};
+  footbass.ns = SIM_START_NS + NS_PER_SEC / 2;
+  footbass.source = SOURCE_KEYPAD;
+  footbass.action = MIDI_ON;
+  footbass.note = 'W';
+  footbass.value = 100;
+  add_input(&footbass);
+
+  double start = 1;
+  for (int run = 0; run < drummer->runs; run++) {
+    double bpm = drummer->bpm > 0 ? drummer->bpm : 70 + 70 * drummer_random();
+    double downbeat = start;
+    for (int bar = 0; bar < drummer->bars; bar++) {
+      double bar_seconds = 60 / bpm;
+      // Never skip the first few, so there's a tempo to follow.
+      if (bar < TEMPO_DOWNBEATS + 1 || drummer_random() >= drummer->skip) {
+        add_hit(downbeat, MIDI_DRUM_IN_KICK, bpm, true, drummer);
+      }
+      if (drummer->snare) {
+        add_hit(downbeat + bar_seconds / 2, MIDI_DRUM_IN_SNARE, bpm, false,
+                drummer);
+      }
+      if (drummer_random() < drummer->extra) {
+        add_hit(downbeat + bar_seconds * (0.1 + 0.8 * drummer_random()),
+                MIDI_DRUM_IN_KICK, bpm, false, drummer);
+      }
+      downbeat += bar_seconds;
+      bpm *= 1 + drummer->drift_percent / 100 * drummer_gaussian();
+    }
+    start = downbeat + DRUMMER_GAP_SECONDS;
+  }
+  qsort(inputs, n_inputs, sizeof(struct SimInput), compare_inputs);
+
+  drummer_bar_errors = malloc(n_inputs * sizeof(uint64_t));
+  if (drummer_bar_errors == NULL) {
+    die("alloc bar errors");
+  }
+}
+
+void before_drummer_input(const struct SimInput* input) {
+  if (!input->downbeat) return;
+  drummer_n_downbeats++;
+  if (beat_period_ns == 0) return;
+
+  // If the engine's bar ended a while ago, compare to where the bar after
+  // it, or after that, would have ended, as long as it wouldn't have given
+  // up by then.
+  uint64_t bar_end_ns = predicted_downbeat_ns;
+  for (int skipped = 0; input->ns > bar_end_ns + beat_period_ns / 2;
+       skipped++) {
+    if (skipped == BEAT_MAX_SKIPPED) return;
+    bar_end_ns += beat_period_ns;
+  }
+  drummer_bar_errors[drummer_n_bar_errors++] = input->ns > bar_end_ns ?
+    input->ns - bar_end_ns : bar_end_ns - input->ns;
+}
+
+void after_drummer_input(const struct SimInput* input) {
+  if (input->bpm == 0 || last_tempo_ns != input->ns) return;
+  drummer_n_tempos++;
+  double error = fabs(last_tempo_bpm - input->bpm) / input->bpm;
+  if (error < DRUMMER_RIGHT_TEMPO) {
+    drummer_n_right_tempos++;
+    drummer_right_tempo_error += error;
+  }
+}
+
+int compare_errors(const void* a, const void* b) {
+  uint64_t a_ns = *(const uint64_t*) a;
+  uint64_t b_ns = *(const uint64_t*) b;
+  return a_ns < b_ns ? -1 : a_ns > b_ns;
+}
+
+void print_drummer_stats() {
+  qsort(drummer_bar_errors, drummer_n_bar_errors, sizeof(uint64_t),
+        compare_errors);
+  int n = drummer_n_bar_errors;
+  printf("drummer: %d downbeats, %d with a bar to end, bar end error "
+         "p50 %.1fms, p90 %.1fms\n",
+         drummer_n_downbeats, n,
+         n == 0 ? 0 : drummer_bar_errors[n / 2] / 1000000.0,
+         n == 0 ? 0 : drummer_bar_errors[n * 9 / 10] / 1000000.0);
+  printf("drummer: %d tempos, %d within %.0f%% (mean error %.2f%%)\n",
+         drummer_n_tempos, drummer_n_right_tempos, DRUMMER_RIGHT_TEMPO * 100,
+         drummer_n_right_tempos == 0 ? 0 :
+             100 * drummer_right_tempo_error / drummer_n_right_tempos);
+}
+
+// Same as handle_record() in jammer.c.
+void dispatch_input(const struct SimInput* input) {
+  if (input->source == SOURCE_BREATH) {
+    if (input->action == MIDI_CC) {
+      handle_cc(input->note, input->value);
+    }
+    return;
+  }
+
+  int action = input->action;
+  if (action != MIDI_ON && action != MIDI_OFF) {
+    jlog(LOG_WARN, "unknown input action %d\n", action);
+    return;
+  }
+  if (action == MIDI_ON && input->value == 0) {
+    action = MIDI_OFF;
+  }
+
+  if (input->source == SOURCE_KEYBOARD) {
+    handle_piano(action, input->note, input->value);
+  } else if (input->source == SOURCE_FEET) {
+    handle_feet(action, input->note, input->value, input->ns);
+  } else if (input->source == SOURCE_KEYPAD) {
+    handle_keypad(action, input->note, input->value);
+  }
+}
+
+// With --tempo-delay-us, tempo estimates are handed off like jammer
+// --tempo-thread does, to a pretend thread that takes this long to get
+// back to us.
+uint64_t tempo_delay_ns = 0;
+#define SIM_TEMPO_REQUESTS 64
+struct TempoRequest tempo_requests[SIM_TEMPO_REQUESTS];
+uint64_t tempo_requests_head = 0;
+uint64_t tempo_requests_tail = 0;
+
+bool sim_hand_off_tempo(const struct TempoRequest* request) {
+  if (tempo_requests_head - tempo_requests_tail == SIM_TEMPO_REQUESTS) {
+    return false;
+  }
+  tempo_requests[tempo_requests_head++ % SIM_TEMPO_REQUESTS] = *request;
+  return true;
+}
+
+// When the next estimate is due back, or 0 if we're not waiting for one.
+uint64_t next_tempo_ns() {
+  if (tempo_requests_tail == tempo_requests_head) return 0;
+  return tempo_requests[tempo_requests_tail % SIM_TEMPO_REQUESTS]
+    .submitted_ns + tempo_delay_ns;
+}
+
+void tempo_due() {
+  while (tempo_requests_tail != tempo_requests_head &&
+         next_tempo_ns() <= sim_ns) {
+    struct TempoResult result = compute_tempo(
+        &tempo_requests[tempo_requests_tail++ % SIM_TEMPO_REQUESTS]);
+    apply_tempo(&result);
+  }
+}
+
+void usage(char* argv0) {
+  fprintf(stderr,
+          "usage: %s [--queue] [--tick-loop] [--until SECONDS] [--seed N]\n"
+          "       [--incremental-tempo] [--snap-to-hits] [--tempo-delay-us N]\n"
+          "       [--steps FILE] [--config FILE] [--print-config]\n"
+          "       [--log-level error|warn|info|debug]\n"
+          "       [script | --capture FILE [--print-capture] |\n"
+          "        --drummer SPEC [--print-capture] | --verify-patterns]\n",
+          argv0);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  bool tick_loop = false;
+  double until_seconds = -1;
+  unsigned int seed = 1;
+  const char* capture_fname = NULL;
+  bool drumming = false;
+  struct Drummer drummer;
+  bool print_capture = false;
+  bool check_patterns = false;
+  const char* config_fname = NULL;
+  bool print_config = false;
+
+  static struct option long_options[] = {
+    {"queue", no_argument, NULL, 'q'},
+    {"tick-loop", no_argument, NULL, 't'},
+    {"until", required_argument, NULL, 'u'},
+    {"seed", required_argument, NULL, 's'},
+    {"log-level", required_argument, NULL, 'L'},
+    {"capture", required_argument, NULL, 'c'},
+    {"print-capture", no_argument, NULL, 'p'},
+    {"drummer", required_argument, NULL, 'd'},
+    {"incremental-tempo", no_argument, NULL, 'I'},
+    {"snap-to-hits", no_argument, NULL, 'S'},
+    {"tempo-delay-us", required_argument, NULL, 'e'},
+    {"verify-patterns", no_argument, NULL, 'V'},
+    {"steps", required_argument, NULL, 'P'},
+    {"config", required_argument, NULL, 'k'},
+    {"print-config", no_argument, NULL, 'K'},
+    {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'q':
+      schedule_bars = true;
+      break;
+    case 't':
+      tick_loop = true;
+      break;
+    case 'u':
+      until_seconds = atof(optarg);
+      break;
+    case 's':
+      seed = atoi(optarg);
+      break;
+    case 'L':
+      log_level = -1;
+      for (int level = 0; level < N_LOG_LEVELS; level++) {
+        if (strcmp(optarg, log_level_names[level]) == 0) {
+          log_level = level;
+        }
+      }
+      if (log_level < 0) {
+        usage(argv[0]);
+      }
+      break;
+    case 'c':
+      capture_fname = optarg;
+      break;
+    case 'p':
+      print_capture = true;
+      break;
+    case 'd':
+      drumming = true;
+      parse_drummer(&drummer, optarg);
+      break;
+    case 'I':
+      incremental_tempo = true;
+      break;
+    case 'S':
+      snap_to_hits = true;
+      break;
+    case 'e':
+      tempo_delay_ns = atoll(optarg) * 1000;
+      hand_off_tempo = sim_hand_off_tempo;
+      break;
+    case 'V':
+      check_patterns = true;
+      break;
+    case 'P':
+      load_steps(&user_steps, optarg);
+      break;
+    case 'k':
+      config_fname = optarg;
+      break;
+    case 'K':
+      print_config = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  bool generated = capture_fname != NULL || drumming;
+  if (argc - optind > (generated ? 0 : 1) ||
+      (print_capture && !generated)) {
+    usage(argv[0]);
+  }
+
+  init_rig(config_fname);
+  if (print_config) {
+    print_rig(stdout, rig);
+    return 0;
+  }
+
+  if (check_patterns) {
+    int n_wrong = verify_patterns();
+    printf("patterns: %d differences from select_note()\n", n_wrong);
+    return n_wrong == 0 ? 0 : 1;
+  }
+
+  if (generated) {
+    if (drumming) {
+      generate_drummer(&drummer);
+    } else {
+      read_capture(capture_fname);
+    }
+    if (print_capture) {
+      print_inputs();
+      return 0;
+    }
+  } else {
+    const char* fname = "-";
+    FILE* script = stdin;
+    if (argc - optind == 1 && strcmp(argv[optind], "-") != 0) {
+      fname = argv[optind];
+      script = fopen(fname, "r");
+      if (script == NULL) {
+        perror(fname);
+        exit(1);
+      }
+    }
+    read_inputs(script, fname);
+  }
+
+  // The event log gets stdout to itself: anything the engine prints goes to
+  // stderr.
+  sim_events = fdopen(dup(STDOUT_FILENO), "w");
+  if (sim_events == NULL) {
+    die("open event log");
+  }
+  dup2(STDERR_FILENO, STDOUT_FILENO);
+
+  srand(seed);
+
+  // By default run until ten seconds after the last input, or until the
+  // engine has nothing left to do.
+  uint64_t end_ns;
+  if (until_seconds >= 0) {
+    end_ns = SIM_START_NS + llround(until_seconds * NS_PER_SEC);
+  } else {
+    end_ns = (n_inputs > 0 ? inputs[n_inputs - 1].ns : SIM_START_NS) +
+      10 * NS_PER_SEC;
+  }
+
+  sim_ns = SIM_START_NS;
+  jml_setup();
+
+  // Snapshots like jammer's, but only in memory, for the stats.
+  static struct SnapshotFile sim_snapshot;
+  char no_boot_id[SNAPSHOT_BOOT_ID_SIZE] = "";
+  init_snapshot(&sim_snapshot, no_boot_id);
+  snapshot = &sim_snapshot;
+
+  int next_input = 0;
+  uint64_t n_wakes = 0;
+  int n_stuck = 0;
+  while (true) {
+    jml_tick(sim_ns);
+    tempo_due();
+    while (next_input < n_inputs && inputs[next_input].ns <= sim_ns) {
+      const struct SimInput* input = &inputs[next_input++];
+      if (drumming) before_drummer_input(input);
+      dispatch_input(input);
+      if (drumming) after_drummer_input(input);
+    }
+    // Like jammer's flush_midi() after each batch of work.
+    flush_controllers();
+    maybe_save_snapshot(sim_ns);
+    n_wakes++;
+
+    // Wake for whichever comes first, the engine or the next input.
+    uint64_t wake_ns = tick_loop ? sim_ns + TICK_NS : jml_next_deadline(sim_ns);
+    if (next_input < n_inputs &&
+        (wake_ns == 0 || inputs[next_input].ns < wake_ns)) {
+      wake_ns = inputs[next_input].ns;
+    }
+    uint64_t tempo_ns = next_tempo_ns();
+    if (tempo_ns != 0 && (wake_ns == 0 || tempo_ns < wake_ns)) {
+      wake_ns = tempo_ns;
+    }
+    if (wake_ns == 0 || wake_ns > end_ns) break;
+
+    if (wake_ns <= sim_ns) {
+      if (++n_stuck > 1000) {
+        die("engine keeps asking to run again without time passing");
+      }
+    } else {
+      n_stuck = 0;
+      sim_ns = wake_ns;
+    }
+  }
+
+  if (until_seconds >= 0 && sim_ns < end_ns) {
+    sim_ns = end_ns;
+  }
+  if (schedule_bars) {
+    cancel_scheduled_midi();
+  }
+  all_notes_off();
+  flush_controllers();
+  fflush(sim_events);
+
+  printf("sim: %d inputs, %" PRIu64 " wakes, %" PRIu64 " events, "
+         "ran to %.3fs\n",
+         n_inputs, n_wakes, n_sim_events,
+         (sim_ns - SIM_START_NS) / (double) NS_PER_SEC);
+  jml_print_stats();
+  print_controller_stats();
+  print_snapshot_stats();
+  if (drumming) {
+    print_drummer_stats();
+  }
+  return 0;
+}
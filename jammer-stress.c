@@ -0,0 +1,461 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <alsa/asoundlib.h>
+#include "common.h"
+#include "latency.h"
+#include "stats.h"
+
+// Finds where jammer breaks.  We pose as the feet, keyboard, breath
+// controller, and keypad (one ALSA client each, since jammer tells inputs
+// apart by client) and as fluidsynth, wait for jammer to connect, and then
+// play at rising rates.  After each level we report what we managed to send,
+// what the synth got back, and from jammer's published stats (stats.h) how
+// many events it handled, dropped, and how late it was.
+//
+// Start this first, then jammer, which only looks for devices at startup.
+
+// These have to match what setup_ports() in jammer.c looks for.
+const char* stress_port_names[N_SOURCES] = {
+  NULL,
+  "mio MIDI 1",                         // feet
+  "Piano (jammer-stress)",              // keyboard
+  "Breath Controller (jammer-stress)",  // breath
+  "mido-keypad",                        // keypad
+};
+#define SYNTH_PORT_NAME "Synth input port (jammer-stress)"
+
+// As in jammermidilib.h.
+#define STRESS_KICK 38
+#define STRESS_SNARE 46
+
+#define MAX_CHORD 16
+
+snd_seq_t* source_seqs[N_SOURCES];
+int source_ports[N_SOURCES];
+
+snd_seq_t* synth_seq;
+int synth_port;
+// What the synth thread has received, by type.
+volatile uint64_t n_synth_notes = 0;
+volatile uint64_t n_synth_controllers = 0;
+volatile uint64_t n_synth_other = 0;
+
+int attempt(int result, char* errmsg) {
+  if (result < 0) {
+    fprintf(stderr, "%s: %s\n", errmsg, snd_strerror(result));
+    exit(1);
+  }
+  return result;
+}
+
+uint64_t now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}
+
+void sleep_until(uint64_t ns) {
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000LL;
+  ts.tv_nsec = ns % 1000000000LL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+  }
+}
+
+void open_source(int source) {
+  char client_name[64];
+  snprintf(client_name, sizeof(client_name), "jammer-stress %s",
+           source_names[source]);
+  attempt(snd_seq_open(&source_seqs[source], "default", SND_SEQ_OPEN_OUTPUT,
+                       0), "open seq");
+  attempt(snd_seq_set_client_name(source_seqs[source], client_name),
+          "set client name");
+  source_ports[source] = attempt(
+      snd_seq_create_simple_port(
+          source_seqs[source], stress_port_names[source],
+          SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+          SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION),
+      "create port");
+  // If jammer can't keep up we want to count that, not wait for it.
+  attempt(snd_seq_nonblock(source_seqs[source], 1), "set nonblocking");
+}
+
+void open_synth() {
+  attempt(snd_seq_open(&synth_seq, "default", SND_SEQ_OPEN_INPUT, 0),
+          "open seq");
+  attempt(snd_seq_set_client_name(synth_seq, "jammer-stress synth"),
+          "set client name");
+  synth_port = attempt(
+      snd_seq_create_simple_port(
+          synth_seq, SYNTH_PORT_NAME,
+          SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+          SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION),
+      "create port");
+}
+
+void* synth_thread(void* unused) {
+  while (true) {
+    snd_seq_event_t* event;
+    if (snd_seq_event_input(synth_seq, &event) < 0) {
+      continue;
+    }
+    if (event->type == SND_SEQ_EVENT_NOTEON ||
+        event->type == SND_SEQ_EVENT_NOTEOFF) {
+      __atomic_add_fetch(&n_synth_notes, 1, __ATOMIC_RELAXED);
+    } else if (event->type == SND_SEQ_EVENT_CONTROLLER) {
+      __atomic_add_fetch(&n_synth_controllers, 1, __ATOMIC_RELAXED);
+    } else {
+      __atomic_add_fetch(&n_synth_other, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return NULL;
+}
+
+uint64_t n_synth_received() {
+  return __atomic_load_n(&n_synth_notes, __ATOMIC_RELAXED) +
+    __atomic_load_n(&n_synth_controllers, __ATOMIC_RELAXED) +
+    __atomic_load_n(&n_synth_other, __ATOMIC_RELAXED);
+}
+
+bool subscribed(int source) {
+  snd_seq_port_info_t* port_info;
+  snd_seq_port_info_alloca(&port_info);
+  if (snd_seq_get_port_info(source_seqs[source], source_ports[source],
+                            port_info) < 0) {
+    return false;
+  }
+  return snd_seq_port_info_get_read_use(port_info) > 0;
+}
+
+void wait_for_jammer() {
+  for (int iterations = 0; true; iterations++) {
+    bool all = true;
+    for (int source = 1; source < N_SOURCES; source++) {
+      all = all && subscribed(source);
+    }
+    if (all) break;
+    if (iterations % 50 == 0) {
+      printf("waiting for jammer to connect to");
+      for (int source = 1; source < N_SOURCES; source++) {
+        if (!subscribed(source)) {
+          printf(" \"%s\"", stress_port_names[source]);
+        }
+      }
+      printf("...\n");
+    }
+    usleep(100000);
+  }
+  // jammer waits a second after connecting and then plays its startup chime.
+  printf("jammer connected\n");
+  sleep(3);
+}
+
+// Refused by ALSA because jammer's input pool was full.
+uint64_t n_refused = 0;
+
+void send_event(int source, snd_seq_event_t* ev) {
+  snd_seq_ev_set_source(ev, source_ports[source]);
+  snd_seq_ev_set_subs(ev);
+  snd_seq_ev_set_direct(ev);
+  if (snd_seq_event_output_direct(source_seqs[source], ev) < 0) {
+    n_refused++;
+  }
+}
+
+void send_note(int source, int action, int note, int velocity) {
+  snd_seq_event_t ev;
+  snd_seq_ev_clear(&ev);
+  if (action == MIDI_ON) {
+    snd_seq_ev_set_noteon(&ev, 0, note, velocity);
+  } else {
+    snd_seq_ev_set_noteoff(&ev, 0, note, velocity);
+  }
+  send_event(source, &ev);
+}
+
+void send_cc(int source, int controller, int value) {
+  snd_seq_event_t ev;
+  snd_seq_ev_clear(&ev);
+  snd_seq_ev_set_controller(&ev, 0, controller, value);
+  send_event(source, &ev);
+}
+
+void press_key(char key) {
+  send_note(SOURCE_KEYPAD, MIDI_ON, key, 100);
+  send_note(SOURCE_KEYPAD, MIDI_OFF, key, 0);
+}
+
+// One stream of input at a fixed rate.  Each "event" may be several MIDI
+// messages: a chord, or a pedal press and release.
+struct Stream {
+  int source;
+  double rate;  // per second, at level 0
+  uint64_t interval_ns;
+  uint64_t next_ns;
+  uint64_t n;
+};
+
+int chord_size = 4;
+int held_chord[MAX_CHORD];
+bool chord_held = false;
+uint64_t n_messages = 0;
+
+void play(struct Stream* stream) {
+  uint64_t n = stream->n++;
+  switch (stream->source) {
+  case SOURCE_BREATH:
+    // A swell a second, whatever the rate.
+    send_cc(SOURCE_BREATH, CC_BREATH,
+            64 + 63 * sin(2 * M_PI * stream->next_ns / 1e9));
+    n_messages++;
+    break;
+  case SOURCE_KEYBOARD:
+    for (int i = 0; chord_held && i < chord_size; i++) {
+      send_note(SOURCE_KEYBOARD, MIDI_OFF, held_chord[i], 0);
+      n_messages++;
+    }
+    for (int i = 0; i < chord_size; i++) {
+      held_chord[i] = 48 + rand() % 36;
+      send_note(SOURCE_KEYBOARD, MIDI_ON, held_chord[i], 90);
+      n_messages++;
+    }
+    chord_held = true;
+    break;
+  case SOURCE_FEET: {
+    int pedal = n % 2 == 0 ? STRESS_KICK : STRESS_SNARE;
+    send_note(SOURCE_FEET, MIDI_ON, pedal, 100);
+    send_note(SOURCE_FEET, MIDI_OFF, pedal, 0);
+    n_messages += 2;
+    break;
+  }
+  case SOURCE_KEYPAD:
+    // Footbass and arp, each toggled off and back on.
+    press_key("WWEE"[n % 4]);
+    n_messages += 2;
+    break;
+  }
+}
+
+// jammer's stats as of the start of a level, to diff against at the end.
+struct JammerStats level_start_stats;
+
+void print_latency(const char* name, struct Histogram* start,
+                   const struct Histogram* end) {
+  struct Histogram diff;
+  memset(&diff, 0, sizeof(diff));
+  diff.n = end->n - start->n;
+  for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+    diff.buckets[bucket] = end->buckets[bucket] - start->buckets[bucket];
+  }
+  if (diff.n == 0) return;
+  printf(" %s p50 <=%" PRIu64 "us p99 <=%" PRIu64 "us", name,
+         histogram_percentile_us(&diff, 0.5),
+         histogram_percentile_us(&diff, 0.99));
+}
+
+// Returns whether anything went wrong at this level.
+bool report_level(int level, struct Stream* streams, int n_streams,
+                  double seconds, uint64_t messages, uint64_t refused,
+                  uint64_t synth_received,
+                  const struct JammerStats* jammer_stats) {
+  printf("level %d:", level);
+  double target_messages = 0;
+  for (int i = 0; i < n_streams; i++) {
+    double rate = 1e9 / streams[i].interval_ns;
+    printf(" %s %.0f/s", source_names[streams[i].source], rate);
+    int per_event = streams[i].source == SOURCE_BREATH ? 1 :
+      streams[i].source == SOURCE_KEYBOARD ? 2 * chord_size : 2;
+    target_messages += rate * per_event * seconds;
+  }
+  printf("\n");
+  printf("  sent %.0f messages/s (%.0f%% of target), %" PRIu64
+         " refused by ALSA\n", messages / seconds,
+         100 * messages / target_messages, refused);
+  printf("  synth got %.0f messages/s\n", synth_received / seconds);
+  bool trouble = refused > 0 || messages < 0.95 * target_messages;
+
+  if (jammer_stats == NULL) return trouble;
+
+  struct JammerStats* start = &level_start_stats;
+  uint64_t inputs = jammer_stats->n_inputs - start->n_inputs;
+  uint64_t input_overruns =
+    jammer_stats->n_input_overruns - start->n_input_overruns;
+  uint64_t tick_overruns =
+    jammer_stats->n_tick_overruns - start->n_tick_overruns;
+  uint64_t sent = jammer_stats->n_sent - start->n_sent;
+  uint64_t dropped =
+    jammer_stats->n_send_errors - start->n_send_errors +
+    jammer_stats->n_output_ring_full - start->n_output_ring_full;
+  printf("  jammer handled %.0f inputs/s, %" PRIu64 " input overruns, %"
+         PRIu64 " of %" PRIu64 " ticks over %.1fms (longest so far %.3fms)\n",
+         inputs / seconds, input_overruns, tick_overruns,
+         jammer_stats->n_ticks - start->n_ticks, TICK_BUDGET_NS / 1000000.0,
+         jammer_stats->max_tick_ns / 1000000.0);
+  printf("  jammer sent %.0f messages/s, %" PRIu64 " dropped\n",
+         sent / seconds, dropped);
+  printf("  latency:");
+  for (int source = 1; source < N_SOURCES; source++) {
+    print_latency(source_names[source], &start->source_latency[source],
+                  &jammer_stats->source_latency[source]);
+  }
+  printf("\n");
+  return trouble || input_overruns > 0 || tick_overruns > 0 || dropped > 0;
+}
+
+void usage(char* argv0) {
+  fprintf(stderr,
+          "usage: %s [--levels N] [--ramp FACTOR] [--seconds S]\n"
+          "       [--breath PER_SEC] [--chords PER_SEC] [--chord-size N]\n"
+          "       [--pedals PER_SEC] [--keypad PER_SEC] [--no-synth]\n"
+          "       [--stats-file PATH]\n",
+          argv0);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  int levels = 8;
+  double ramp = 2;
+  double seconds = 10;
+  double breath_rate = 100;
+  double chord_rate = 2;
+  double pedal_rate = 2;
+  double keypad_rate = 0;
+  bool synth = true;
+  const char* stats_fname = "/dev/shm/jammer-stats";
+
+  static struct option long_options[] = {
+    {"levels", required_argument, NULL, 'n'},
+    {"ramp", required_argument, NULL, 'r'},
+    {"seconds", required_argument, NULL, 's'},
+    {"breath", required_argument, NULL, 'b'},
+    {"chords", required_argument, NULL, 'c'},
+    {"chord-size", required_argument, NULL, 'z'},
+    {"pedals", required_argument, NULL, 'p'},
+    {"keypad", required_argument, NULL, 'k'},
+    {"no-synth", no_argument, NULL, 'S'},
+    {"stats-file", required_argument, NULL, 'f'},
+    {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'n': levels = atoi(optarg); break;
+    case 'r': ramp = atof(optarg); break;
+    case 's': seconds = atof(optarg); break;
+    case 'b': breath_rate = atof(optarg); break;
+    case 'c': chord_rate = atof(optarg); break;
+    case 'z': chord_size = atoi(optarg); break;
+    case 'p': pedal_rate = atof(optarg); break;
+    case 'k': keypad_rate = atof(optarg); break;
+    case 'S': synth = false; break;
+    case 'f': stats_fname = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || levels < 1 || ramp <= 0 || seconds <= 0 ||
+      chord_size < 1 || chord_size > MAX_CHORD) {
+    usage(argv[0]);
+  }
+
+  struct Stream streams[N_SOURCES];
+  int n_streams = 0;
+  double rates[N_SOURCES] = {0, pedal_rate, chord_rate, breath_rate,
+                             keypad_rate};
+  for (int source = 1; source < N_SOURCES; source++) {
+    if (rates[source] > 0) {
+      memset(&streams[n_streams], 0, sizeof(struct Stream));
+      streams[n_streams].source = source;
+      streams[n_streams].rate = rates[source];
+      n_streams++;
+    }
+  }
+  if (n_streams == 0) {
+    usage(argv[0]);
+  }
+
+  for (int source = 1; source < N_SOURCES; source++) {
+    open_source(source);
+  }
+  if (synth) {
+    open_synth();
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, synth_thread, NULL) != 0) {
+      die("start synth thread");
+    }
+  }
+
+  wait_for_jammer();
+
+  // jammer publishes its stats on startup, so look for them now.
+  const struct JammerStats* jammer_stats = map_stats(stats_fname);
+  if (jammer_stats == NULL) {
+    printf("no stats at %s, so only reporting what we can see\n",
+           stats_fname);
+  }
+
+  // Turn on footbass and the arpeggiator, so pedals have something to do.
+  press_key('W');
+  press_key('E');
+  srand(1);
+
+  int first_trouble = -1;
+  double scale = 1;
+  for (int level = 0; level < levels; level++, scale *= ramp) {
+    uint64_t start_ns = now();
+    uint64_t end_ns = start_ns + seconds * 1e9;
+    for (int i = 0; i < n_streams; i++) {
+      streams[i].interval_ns = 1e9 / (streams[i].rate * scale);
+      if (streams[i].interval_ns == 0) streams[i].interval_ns = 1;
+      streams[i].next_ns = start_ns;
+    }
+    uint64_t messages_before = n_messages;
+    uint64_t refused_before = n_refused;
+    uint64_t synth_before = n_synth_received();
+    if (jammer_stats != NULL) {
+      memcpy(&level_start_stats, jammer_stats, sizeof(level_start_stats));
+    }
+
+    // Always play whichever stream is due first.  If we can't keep up we
+    // don't skip anything, so the shortfall shows up in the rate we report.
+    while (true) {
+      struct Stream* next = &streams[0];
+      for (int i = 1; i < n_streams; i++) {
+        if (streams[i].next_ns < next->next_ns) {
+          next = &streams[i];
+        }
+      }
+      if (next->next_ns >= end_ns) break;
+      sleep_until(next->next_ns);
+      play(next);
+      next->next_ns += next->interval_ns;
+    }
+
+    // Give jammer a moment to finish with what we sent.
+    usleep(100000);
+    double elapsed = (now() - start_ns) / 1e9;
+    if (report_level(level, streams, n_streams, elapsed,
+                     n_messages - messages_before, n_refused - refused_before,
+                     n_synth_received() - synth_before, jammer_stats) &&
+        first_trouble < 0) {
+      first_trouble = level;
+    }
+  }
+
+  for (int i = 0; chord_held && i < chord_size; i++) {
+    send_note(SOURCE_KEYBOARD, MIDI_OFF, held_chord[i], 0);
+  }
+  if (first_trouble < 0) {
+    printf("no trouble at any level\n");
+  } else {
+    printf("first trouble at level %d\n", first_trouble);
+  }
+  return 0;
+}
@@ -1,24 +1,26 @@
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <errno.h>
 #include <unistd.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sys/inotify.h>
 #include <alsa/asoundlib.h>
 #include "linuxapi.h"
+#include "flight.h"
 #include "jammermidilib.h"
+#include "snapshot.h"
+#include "control.h"
 
 #define TICK_MS 1  // try to tick every N milliseconds
 
-#define FLUIDSYNTH_PORT_PREFIX "Synth input port"
-#define AXIS49_PORT_NAME "AXIS-49 2A MIDI 1"
-#define KEYBOARD_PORT_NAME "USB MIDI Interface MIDI 1"
-#define KEYBOARD_PORT_SUBSTR_1 "Piano"
-#define KEYBOARD_PORT_SUBSTR_2 "Roland"
-#define BREATH_CONTROLLER_PORT_SUBSTR "Breath Controller"
-#define FEET_PORT_NAME "mio MIDI 1"
-#define KEYPAD_PORT_NAME "mido-keypad"  // pitch-detect:kbd.py
+// The other port names are in the rig; see default_rig().
 #define MIDI_THROUGH_PORT_NAME "Midi Through Port-0"
 
 int fluidsynth_port;
@@ -93,32 +95,23 @@ void setup_ports() {
           printf("Device: %s\n", snd_seq_port_info_get_name(port_info));
         }
 
-        bool is_keyboard_port =
-	  strcmp(snd_seq_port_info_get_name(port_info),
-		 KEYBOARD_PORT_NAME) == 0 ||
-	  strstr(snd_seq_port_info_get_name(port_info),
-		 KEYBOARD_PORT_SUBSTR_1) != NULL ||
-	  strstr(snd_seq_port_info_get_name(port_info),
-		 KEYBOARD_PORT_SUBSTR_2) != NULL;
+        int role = port_role(rig, snd_seq_port_info_get_name(port_info));
+        bool is_keyboard_port = role == PORT_KEYBOARD;
 
         // Input ports: we need reading.
         if ((snd_seq_port_info_get_capability(port_info)
              & (SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ))
             == (SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ)) {
-          if (strcmp(snd_seq_port_info_get_name(port_info),
-                     AXIS49_PORT_NAME) == 0) {
+          if (role == PORT_AXIS49) {
             axis49_client = snd_seq_port_info_get_client(port_info);
             axis49_port = snd_seq_port_info_get_port(port_info);
-          } else if (strstr(snd_seq_port_info_get_name(port_info),
-                            BREATH_CONTROLLER_PORT_SUBSTR) != NULL) {
+          } else if (role == PORT_BREATH) {
             breath_controller_client = snd_seq_port_info_get_client(port_info);
             breath_controller_port = snd_seq_port_info_get_port(port_info);
-          } else if (strcmp(snd_seq_port_info_get_name(port_info),
-                            FEET_PORT_NAME) == 0) {
+          } else if (role == PORT_FEET) {
             feet_client = snd_seq_port_info_get_client(port_info);
             feet_port = snd_seq_port_info_get_port(port_info);
-          } else if (strcmp(snd_seq_port_info_get_name(port_info),
-                            KEYPAD_PORT_NAME) == 0) {
+          } else if (role == PORT_KEYPAD) {
             keypad_client = snd_seq_port_info_get_client(port_info);
             keypad_port = snd_seq_port_info_get_port(port_info);
           } else if (is_keyboard_port || !seen_keyboard) {
@@ -136,9 +129,7 @@ void setup_ports() {
         if ((snd_seq_port_info_get_capability(port_info)
              & (SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE))
             == (SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE)) {
-          if (strncmp(FLUIDSYNTH_PORT_PREFIX,
-                      snd_seq_port_info_get_name(port_info),
-                      strlen(FLUIDSYNTH_PORT_PREFIX)) == 0) {
+          if (role == PORT_SYNTH) {
             fluidsynth_client = snd_seq_port_info_get_client(port_info);
             fluidsynth_port = snd_seq_port_info_get_port(port_info);
           }
@@ -179,6 +170,12 @@ void setup_ports() {
                              fluidsynth_client, fluidsynth_port),
           "connect to fluidsynth");
 
+  // Have the kernel stamp everything arriving on our input ports with when it
+  // arrived; see event_arrival_ns().
+  snd_seq_port_info_set_timestamping(port_info, 1);
+  snd_seq_port_info_set_timestamp_real(port_info, 1);
+  snd_seq_port_info_set_timestamp_queue(port_info, queue);
+
   if (axis49_port != -1) {
     axis49_index = next_index++;
     snd_seq_port_info_set_port(port_info, axis49_index);
@@ -266,175 +263,594 @@ void setup_ports() {
   }
 }
 
-void tick() {
-  jml_tick();
+// The earliest breath reading since the last tick.  Air is integrated on
+// ticks, so that's when breath turns into output.
+uint64_t breath_arrival_ns = 0;
+
+void tick(uint64_t current_time) {
+  if (breath_arrival_ns != 0) {
+    cause_source = SOURCE_BREATH;
+    cause_ns = breath_arrival_ns;
+  }
+  jml_tick(current_time);
+  count_tick(current_time, now());
+  cause_source = SOURCE_NONE;
+  cause_ns = 0;
+  breath_arrival_ns = 0;
 }
 
-int tmp_jawharp_voice = 1;
-void handle_event(snd_seq_event_t* event) {
-  if (event->source.client == breath_controller_client) {
-    handle_cc(event->data.control.param, event->data.control.value);
-    return;
+volatile sig_atomic_t quitting = 0;
+volatile sig_atomic_t dump_requested = 0;
+
+void handle_quit_signal(int signum) {
+  quitting = 1;
+}
+
+void handle_dump_signal(int signum) {
+  dump_requested = 1;
+}
+
+// Step through the log levels, wrapping from debug back to error.
+void handle_log_level_signal(int signum) {
+  log_level = (log_level + 1) % N_LOG_LEVELS;
+}
+
+int parse_log_level(const char* name) {
+  for (int level = 0; level < N_LOG_LEVELS; level++) {
+    if (strcmp(name, log_level_names[level]) == 0) {
+      return level;
+    }
   }
+  return -1;
+}
+
+// Clients that aren't connected are -1, which no event comes from.
+int source_for_client(int client) {
+  if (client == feet_client) return SOURCE_FEET;
+  if (client == keyboard_client) return SOURCE_KEYBOARD;
+  if (client == breath_controller_client) return SOURCE_BREATH;
+  if (client == keypad_client) return SOURCE_KEYPAD;
+  return SOURCE_NONE;
+}
+
+// Turn an ALSA event into a record, or return false if it's something we
+// don't care about.
+bool record_from_event(snd_seq_event_t* event, struct MidiRecord* record) {
+  memset(record, 0, sizeof(*record));
+  record->ns = event_arrival_ns(event);
+  record->client = event->source.client;
+  record->source = source_for_client(record->client);
 
-  unsigned int action;
-  if (event->type == SND_SEQ_EVENT_NOTEON) {
-    action = MIDI_ON;
+  if (event->type == SND_SEQ_EVENT_CONTROLLER) {
+    record->action = MIDI_CC;
+    record->channel = event->data.control.channel;
+    record->note = event->data.control.param;
+    record->value = normalize(event->data.control.value);
+  } else if (event->type == SND_SEQ_EVENT_NOTEON) {
+    record->action = MIDI_ON;
+    record->channel = event->data.note.channel;
+    record->note = event->data.note.note;
+    record->value = event->data.note.velocity;
   } else if (event->type == SND_SEQ_EVENT_NOTEOFF) {
-    action = MIDI_OFF;
+    record->action = MIDI_OFF;
+    record->channel = event->data.note.channel;
+    record->note = event->data.note.note;
+    record->value = event->data.note.velocity;
   } else if (event->type == SND_SEQ_EVENT_CLOCK ||
              event->type == SND_SEQ_EVENT_SENSING) {
-    return;
+    return false;
   } else {
-    printf("unknown input type %d\n", event->type);
+    jlog(LOG_WARN, "unknown input type %d\n", event->type);
+    return false;
+  }
+  return true;
+}
+
+int tmp_jawharp_voice = 1;
+void dispatch_record(const struct MidiRecord* record) {
+  if (record->source == SOURCE_BREATH) {
+    if (record->action == MIDI_CC) {
+      if (breath_arrival_ns == 0) {
+        breath_arrival_ns = record->ns;
+      }
+      handle_cc(record->note, record->value);
+    }
+    return;
+  }
+
+  unsigned int action = record->action;
+  if (action != MIDI_ON && action != MIDI_OFF) {
+    jlog(LOG_WARN, "unknown input action %d\n", action);
     return;
   }
-  unsigned int note_in = event->data.note.note;
-  unsigned int val = event->data.note.velocity;
+  unsigned int note_in = record->note;
+  unsigned int val = record->value;
 
   if (action == MIDI_ON && val == 0) {
     action = MIDI_OFF;
   }
 
-  if (event->source.client == keyboard_client) {
+  if (record->source == SOURCE_KEYBOARD) {
     handle_piano(action, note_in, val);
-  } else if (event->source.client == axis49_client) {
-    /// pass
-  } else if (event->source.client == feet_client) {
-    handle_feet(action, note_in, val);
-  } else if (event->source.client == keypad_client) {
+  } else if (record->source == SOURCE_FEET) {
+    handle_feet(action, note_in, val, record->ns);
+  } else if (record->source == SOURCE_KEYPAD) {
     handle_keypad(action, note_in, val);
   } else {
-    printf("ignored\n");
+    jlog(LOG_DEBUG, "ignored\n");
+  }
+}
+
+// Anything sent while handling the record is timed from when it arrived.
+void handle_record(const struct MidiRecord* record) {
+  PROFILE_BEGIN(PHASE_HANDLE_EVENT);
+  stats->n_inputs++;
+  flight_record(record);
+  cause_source = record->source;
+  cause_ns = record->ns;
+  dispatch_record(record);
+  stats->n_beats_followed = beat_followed_n;
+  stats->beat_error_total_ns = beat_error_total_ns;
+  stats->beat_error_max_ns = beat_error_max_ns;
+  stats->n_beat_relocks = beat_relock_n;
+  PROFILE_END(PHASE_HANDLE_EVENT);
+  cause_source = SOURCE_NONE;
+  cause_ns = 0;
+}
+
+// Like snd_seq_event_input(), but counts input ALSA had to throw away because
+// we weren't reading fast enough.
+int read_event(snd_seq_event_t** event) {
+  int result = snd_seq_event_input(seq, event);
+  if (result == -ENOSPC) {
+    stats->n_input_overruns++;
+  }
+  return result;
+}
+
+void handle_event(snd_seq_event_t* event) {
+  struct MidiRecord record;
+  if (record_from_event(event, &record)) {
+    handle_record(&record);
+  }
+}
+
+// With --replay, input also comes from a flight recording, at the speed it
+// was played.  jammer-sim --capture is for going faster.
+struct FlightRecord* replay_records = NULL;
+uint64_t n_replay_records = 0;
+uint64_t next_replay = 0;
+// Add to a recorded time to get when to replay it.  Unsigned, so it's fine
+// for this to wrap.
+uint64_t replay_offset_ns = 0;
+
+void start_replay(const char* fname) {
+  replay_records = read_flight(fname, &n_replay_records);
+  printf("replaying %" PRIu64 " inputs from %s\n", n_replay_records, fname);
+  if (n_replay_records > 0) {
+    replay_offset_ns = now() + NS_PER_SEC - replay_records[0].ns;
   }
 }
 
-void select_endpoint_voice(int endpoint, int voice, int bank, int volume_delta,
-                           int manual_volume, bool pan) {
-  send_midi(MIDI_CC, CC_07, 0, endpoint);
-
-  int volume = 70;
-  switch (voice) {
-
-  case 80:
-    volume = 62;
-    break;
-  case 81:
-    volume = 90;
-    break;
-  case 84:
-    volume = 68;
-    break;
-  case 38:
-    volume = 87;
-    break;
-  case 85:
-    volume = 80;
-    break;
-  case 75:
-    volume = 87;
-    break;
-  case 39:
-    volume = 86;
-    break;
-  case 7:
-    volume = 98;
-    break;
-  case 35:
-    volume = 107;
-    break;
-  case 24:
-    volume = 102;
-    break;
-  case 64:
-    volume = 87;
-    break;
-  case 66:
-    volume = 82;
-    break;
-  case 67:
-    volume = 92;
-    break;
-  case 26:
-  case 28:
-    volume = 112;
-    break;
-  case 4:
-    volume = 122;
-    break;
-  case 0:
-    volume = 100;
-    break;
-  case 18:
-    volume = 65;
-    break;
-  case 5:
-    volume = 90;
-    break;
-  case 16:
-    volume = 110;
-    break;
-  case 32:
-    volume = 115;
-    break;
-  }
-
-  if (endpoint == ENDPOINT_DRUM) {
-    volume = MIDI_MAX;
-  }
-  
-  if (manual_volume != -1) {
-    volume = manual_volume;
-  }
-
-  volume += volume_delta;
-
-  if (endpoint == ENDPOINT_FLEX) {
-    volume -= 24;
-  } else if (endpoint == ENDPOINT_FOOTBASS) {
-    volume -= 20;
-  } else if (endpoint == ENDPOINT_ARP) {
-    volume -= 40;
-  } else if (endpoint == ENDPOINT_LOW) {
-    volume += 10;
-  } 
-
-  if (endpoint == ENDPOINT_OVERLAY ||
-      endpoint == ENDPOINT_FLEX ||
-      endpoint == ENDPOINT_HI ||
-      endpoint == ENDPOINT_ARP) {
-    if (voice == 39) {
-      volume -= 10;
-    } else if (voice == 26) {
-      volume -= 20;
-    } else if (voice == 4) {
-      volume -= 15;
-    } else if (voice == 64) {
-      volume -= 10;
+// When the next replayed input is due, or 0 if there isn't one.
+uint64_t next_replay_ns() {
+  if (next_replay >= n_replay_records) return 0;
+  return replay_records[next_replay].ns + replay_offset_ns;
+}
+
+void replay_due(uint64_t current_time) {
+  while (next_replay < n_replay_records &&
+         next_replay_ns() <= current_time) {
+    const struct FlightRecord* replayed = &replay_records[next_replay];
+    struct MidiRecord record;
+    memset(&record, 0, sizeof(record));
+    record.ns = next_replay_ns();
+    record.client = -1;
+    record.source = replayed->source;
+    record.action = replayed->action;
+    record.channel = replayed->channel;
+    record.note = replayed->note;
+    record.value = replayed->value;
+    next_replay++;
+    handle_record(&record);
+    if (next_replay == n_replay_records) {
+      jlog(LOG_INFO, "replay done\n");
     }
   }
+}
 
-  send_midi(MIDI_CC, CC_07, volume, endpoint);
-  send_midi(MIDI_CC, CC_PAN, pan ? MIDI_MAX : 0, endpoint);
-  send_midi(MIDI_CC, CC_BALANCE, pan ? MIDI_MAX : 0, endpoint);
+// With --threads the input thread reads the sequencer and leaves records on
+// input_ring for the engine (main) thread.
+bool threaded = false;
+struct Ring input_ring;
+int input_wake_fd = -1;
 
-  if (endpoint != CHANNEL_DRUM) {
-    choose_voice(endpoint, bank, voice);
+void* input_thread(void* unused) {
+  int n_poll_file_descriptors = snd_seq_poll_descriptors_count(seq, POLLIN);
+  struct pollfd* poll_file_descriptors =
+    malloc(sizeof(struct pollfd) * n_poll_file_descriptors);
+  snd_seq_poll_descriptors(seq, poll_file_descriptors, n_poll_file_descriptors,
+                           POLLIN);
+
+  while (true) {
+    if (poll(poll_file_descriptors, n_poll_file_descriptors, -1) <= 0) {
+      continue;
+    }
+
+    bool received = false;
+    do {
+      snd_seq_event_t* event;
+      struct MidiRecord record;
+      if (read_event(&event) > 0 && record_from_event(event, &record)) {
+        // If the engine has fallen behind wait for it instead of dropping
+        // input.  Each of these stalls is counted in n_full.
+        while (!ring_push(&input_ring, &record)) {
+          wake_fd(input_wake_fd);
+          usleep(100);
+        }
+        received = true;
+      }
+    } while (snd_seq_event_input_pending(seq, 0) > 0);
+
+    if (received) {
+      wake_fd(input_wake_fd);
+    }
+  }
+  return NULL;
+}
+
+void start_input_thread() {
+  ring_init(&input_ring, 1024, sizeof(struct MidiRecord));
+  input_wake_fd = attempt(eventfd(0, EFD_NONBLOCK), "create input eventfd");
+  start_thread(input_thread, /*realtime=*/true, "start input thread");
+}
+
+// With --tempo-thread, tempo estimates are made on a thread of their own,
+// which takes requests from tempo_request_ring and leaves results on
+// tempo_result_ring for the engine thread, so a pedal hit doesn't have to
+// wait for one before it plays.
+bool tempo_threaded = false;
+int tempo_cpu = -1;
+struct Ring tempo_request_ring;
+struct Ring tempo_result_ring;
+int tempo_request_fd = -1;
+int tempo_result_fd = -1;
+
+bool thread_hand_off_tempo(const struct TempoRequest* request) {
+  if (!ring_push(&tempo_request_ring, request)) {
+    return false;
+  }
+  wake_fd(tempo_request_fd);
+  return true;
+}
+
+void* tempo_thread(void* unused) {
+  if (tempo_cpu != -1) {
+    pin_to_cpu(tempo_cpu);
+  }
+  while (true) {
+    wait_fd(tempo_request_fd);
+    struct TempoRequest request;
+    while (ring_pop(&tempo_request_ring, &request)) {
+      struct TempoResult result = compute_tempo(&request);
+      // Results can't be dropped, so if the engine is behind wait for it.
+      while (!ring_push(&tempo_result_ring, &result)) {
+        wake_fd(tempo_result_fd);
+        usleep(100);
+      }
+      wake_fd(tempo_result_fd);
+    }
+  }
+  return NULL;
+}
+
+void start_tempo_thread() {
+  ring_init(&tempo_request_ring, 64, sizeof(struct TempoRequest));
+  ring_init(&tempo_result_ring, 64, sizeof(struct TempoResult));
+  tempo_request_fd = attempt(eventfd(0, 0), "create tempo request eventfd");
+  tempo_result_fd = attempt(eventfd(0, EFD_NONBLOCK),
+                            "create tempo result eventfd");
+
+  // A hit we weren't expecting waits for its estimate, so this is just below
+  // the engine, like the input and output threads.
+  start_thread(tempo_thread, /*realtime=*/true, "start tempo thread");
+  hand_off_tempo = thread_hand_off_tempo;
+}
+
+// Apply estimates as if we were still handling the hits they're for, so
+// whatever they play is timed from the hit.
+void apply_tempo_results() {
+  struct TempoResult result;
+  while (ring_pop(&tempo_result_ring, &result)) {
+    cause_source = SOURCE_FEET;
+    cause_ns = result.hit_ns;
+    apply_tempo(&result);
+    cause_source = SOURCE_NONE;
+    cause_ns = 0;
+  }
+}
+
+// The config file, if there is one, and an inotify watch on its directory:
+// editors usually save by writing a new file and renaming it over the old
+// one, which a watch on the file itself would miss.
+const char* config_fname = NULL;
+char config_basename[256];
+int config_watch_fd = -1;
+
+void watch_config(const char* fname) {
+  config_fname = fname;
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s", fname);
+  snprintf(config_basename, sizeof(config_basename), "%s", basename(path));
+  snprintf(path, sizeof(path), "%s", fname);
+  config_watch_fd = attempt(inotify_init1(IN_NONBLOCK | IN_CLOEXEC),
+                            "create config watch");
+  attempt(inotify_add_watch(config_watch_fd, dirname(path),
+                            IN_CLOSE_WRITE | IN_MOVED_TO),
+          "watch config");
+}
+
+// The config file is read and parsed on a thread of its own, at normal
+// priority, so the engine never waits on the disk.  The thread loads a
+// changed file into whichever rig the engine isn't using and hands over the
+// finished rig, which the engine swaps in between inputs.  If it doesn't
+// parse we keep the rig we have.
+struct Rig* pending_rig = NULL;
+int config_ready_fd = -1;  // wakes the engine
+int config_taken_fd = -1;  // wakes the config thread
+
+// Read what the watch saw, and say whether the config file changed.
+bool config_changed() {
+  char events[4096]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool changed = false;
+  ssize_t len;
+  while ((len = read(config_watch_fd, events, sizeof(events))) > 0) {
+    for (char* p = events; p < events + len;
+         p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+      struct inotify_event* event = (struct inotify_event*) p;
+      if (event->len > 0 && strcmp(event->name, config_basename) == 0) {
+        changed = true;
+      }
+    }
+  }
+  return changed;
+}
+
+void* config_thread(void* unused) {
+  struct pollfd watch = {config_watch_fd, POLLIN, 0};
+  while (true) {
+    if (poll(&watch, 1, -1) <= 0 || !config_changed()) continue;
+
+    uint64_t start_ns = now();
+    struct Rig* new_rig = spare_rig();
+    if (!load_rig(new_rig, config_fname)) {
+      jlog(LOG_WARN, "keeping the config we had\n");
+      continue;
+    }
+    jlog(LOG_INFO, "reloaded %s in %.3fms\n", config_fname,
+         (now() - start_ns) / 1000000.0);
+
+    // The spare is the engine's until it's swapped in.
+    __atomic_store_n(&pending_rig, new_rig, __ATOMIC_RELEASE);
+    wake_fd(config_ready_fd);
+    while (__atomic_load_n(&pending_rig, __ATOMIC_ACQUIRE) != NULL) {
+      wait_fd(config_taken_fd);
+    }
   }
+  return NULL;
+}
+
+void start_config_thread() {
+  config_ready_fd = attempt(eventfd(0, EFD_NONBLOCK),
+                            "create config ready eventfd");
+  config_taken_fd = attempt(eventfd(0, 0), "create config taken eventfd");
+  start_thread(config_thread, /*realtime=*/false, "start config thread");
+}
+
+// Engine thread: swap in the rig the config thread loaded, if there is one.
+void take_config() {
+  struct Rig* new_rig = __atomic_load_n(&pending_rig, __ATOMIC_ACQUIRE);
+  if (new_rig == NULL) return;
+  swap_rig(new_rig);
+  __atomic_store_n(&pending_rig, NULL, __ATOMIC_RELEASE);
+  wake_fd(config_taken_fd);
+}
+
+void print_stats() {
+  // Get anything still queued out ahead of the stats.
+  drain_log();
+  jml_print_stats();
+  print_load_stats();
+  print_controller_stats();
+  print_output_stats();
+  print_latency_stats();
+  print_profile();
+  print_log_stats();
+  print_flight_stats();
+  print_snapshot_stats();
+  if (threaded) {
+    print_ring_stats("input ring", &input_ring);
+    print_ring_stats("output ring", &output_ring);
+  }
+  if (tempo_threaded) {
+    print_ring_stats("tempo request ring", &tempo_request_ring);
+    print_ring_stats("tempo result ring", &tempo_result_ring);
+  }
+}
+
+void usage(char* argv0) {
+  printf("usage: %s [--tick-loop] [--queue] [--threads] [--batch] [--realtime]\n"
+         "       [--rt-priority N] [--cpu N] [--late-threshold-us N]\n"
+         "       [--log-level error|warn|info|debug] [--flight-minutes N]\n"
+         "       [--flight-file PATH] [--capture FILE] [--replay FILE]\n"
+         "       [--stats-file PATH] [--incremental-tempo] [--snap-to-hits]\n"
+         "       [--tempo-thread] [--tempo-cpu N] [--steps FILE]\n"
+         "       [--state-file PATH] [--fresh] [--control-socket PATH]\n"
+         "       [config]\n",
+         argv0);
+  exit(1);
+}
+
+// Like atoi(), but anything that isn't a whole number from min to max is a
+// usage error.
+int parse_number(const char* arg, int min, int max, char* argv0) {
+  char* end;
+  long value = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || value < min || value > max) {
+    printf("%s: expected a number from %d to %d, not %s\n", argv0, min, max,
+           arg);
+    usage(argv0);
+  }
+  return value;
 }
 
 int main(int argc, char** argv) {
-  if (argc != 1 && argc != 2) {
-    // For now ignore arg1 which used to be the tempo fname.
-    printf("usage: %s\n", argv[0]);
-    return 1;
+  // Wake every TICK_MS like we used to, instead of sleeping until the next
+  // thing jml_tick() has to do.  Useful for comparing subbeat lateness.
+  bool tick_loop = false;
+
+  bool realtime = false;
+  int rt_priority = 80;
+  int rt_cpu = -1;
+
+  int flight_minutes = 5;
+  const char* flight_fname = "/dev/shm/jammer-flight";
+  const char* capture_fname = NULL;
+  const char* replay_fname = NULL;
+  const char* stats_fname = "/dev/shm/jammer-stats";
+  const char* state_fname = "/dev/shm/jammer-state";
+  bool fresh = false;
+  // No control socket unless asked for one.
+  const char* control_path = NULL;
+
+  static struct option long_options[] = {
+    {"tick-loop", no_argument, NULL, 't'},
+    {"queue", no_argument, NULL, 'q'},
+    {"threads", no_argument, NULL, 'T'},
+    {"batch", no_argument, NULL, 'b'},
+    {"realtime", no_argument, NULL, 'r'},
+    {"rt-priority", required_argument, NULL, 'p'},
+    {"cpu", required_argument, NULL, 'c'},
+    {"late-threshold-us", required_argument, NULL, 'l'},
+    {"log-level", required_argument, NULL, 'L'},
+    {"flight-minutes", required_argument, NULL, 'm'},
+    {"flight-file", required_argument, NULL, 'f'},
+    {"capture", required_argument, NULL, 'C'},
+    {"replay", required_argument, NULL, 'R'},
+    {"stats-file", required_argument, NULL, 's'},
+    {"incremental-tempo", no_argument, NULL, 'I'},
+    {"snap-to-hits", no_argument, NULL, 'S'},
+    {"tempo-thread", no_argument, NULL, 'e'},
+    {"tempo-cpu", required_argument, NULL, 'E'},
+    {"steps", required_argument, NULL, 'P'},
+    {"state-file", required_argument, NULL, 'v'},
+    {"fresh", no_argument, NULL, 'F'},
+    {"control-socket", required_argument, NULL, 'o'},
+    {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 't':
+      tick_loop = true;
+      break;
+    case 'q':
+      schedule_bars = true;
+      break;
+    case 'T':
+      threaded = true;
+      break;
+    case 'b':
+      batch_output = true;
+      break;
+    case 'r':
+      realtime = true;
+      break;
+    case 'p':
+      rt_priority = parse_number(optarg, sched_get_priority_min(SCHED_FIFO),
+                                 sched_get_priority_max(SCHED_FIFO), argv[0]);
+      break;
+    case 'c':
+      rt_cpu = parse_number(optarg, 0, sysconf(_SC_NPROCESSORS_CONF) - 1,
+                            argv[0]);
+      break;
+    case 'l':
+      // Up to a second: anything later than that is a stall, not a subbeat
+      // that went out a bit late.
+      subbeat_late_threshold_ns =
+        (uint64_t) parse_number(optarg, 0, 1000000, argv[0]) * 1000;
+      break;
+    case 'L':
+      log_level = parse_log_level(optarg);
+      if (log_level < 0) {
+        usage(argv[0]);
+      }
+      break;
+    case 'm':
+      // An hour is already 58MB locked in memory.
+      flight_minutes = parse_number(optarg, 0, 60, argv[0]);
+      break;
+    case 'f':
+      flight_fname = optarg;
+      break;
+    case 'C':
+      capture_fname = optarg;
+      break;
+    case 'R':
+      replay_fname = optarg;
+      break;
+    case 's':
+      stats_fname = optarg;
+      break;
+    case 'I':
+      incremental_tempo = true;
+      break;
+    case 'S':
+      snap_to_hits = true;
+      break;
+    case 'e':
+      tempo_threaded = true;
+      break;
+    case 'E':
+      tempo_cpu = parse_number(optarg, 0, sysconf(_SC_NPROCESSORS_CONF) - 1,
+                               argv[0]);
+      break;
+    case 'P':
+      load_steps(&user_steps, optarg);
+      break;
+    case 'v':
+      state_fname = optarg;
+      break;
+    case 'F':
+      fresh = true;
+      break;
+    case 'o':
+      control_path = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind > 1) {
+    usage(argv[0]);
+  }
+  // The point of --cpu is to have that core to ourselves.
+  if (tempo_cpu != -1 && tempo_cpu == rt_cpu) {
+    printf("%s: --tempo-cpu can't be the engine's --cpu\n", argv[0]);
+    usage(argv[0]);
   }
-  
+  if (argc - optind == 1) {
+    watch_config(argv[optind]);
+  }
+  init_rig(config_fname);
+
   attempt(snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, 0),
           "open seq");
   attempt(snd_seq_set_client_name(seq, "jammer"),
           "set client name");
 
+  setup_queue();
   setup_ports();
 
   if (false) {
@@ -481,27 +897,219 @@ int main(int argc, char** argv) {
     }
   }
 
-  sleep(1);
-
-  jml_setup();
+  // If we crashed in the middle of a song, carry on with it.  There's no
+  // waiting for the synth or startup chime, just our settings sent again in
+  // case it restarted too.
+  static struct EngineState resume_from;
+  if (open_snapshot(state_fname, fresh ? NULL : &resume_from)) {
+    jml_resume(&resume_from);
+  } else {
+    sleep(1);
+    jml_setup();
+  }
   printf("listening...\n");
 
-  int n_poll_file_descriptors = snd_seq_poll_descriptors_count(seq, POLLIN);
-  struct pollfd* poll_file_descriptors =
-    malloc(sizeof(struct pollfd) * n_poll_file_descriptors);
-  snd_seq_poll_descriptors(seq, poll_file_descriptors, n_poll_file_descriptors,
-                           POLLIN);
+  publish_stats(stats_fname);
 
-  while (true) {
-    if (poll(poll_file_descriptors, n_poll_file_descriptors, TICK_MS) > 0) {
+  // Don't record a replay over the recording it might be replaying.
+  if (flight_minutes > 0 && replay_fname == NULL) {
+    start_flight_recorder(flight_fname, flight_minutes);
+  }
+
+  if (realtime) {
+    go_realtime(rt_priority, rt_cpu);
+  }
+  profile_init();
+
+  struct sigaction quit_action;
+  memset(&quit_action, 0, sizeof(quit_action));
+  quit_action.sa_handler = handle_quit_signal;
+  sigaction(SIGINT, &quit_action, NULL);
+  sigaction(SIGTERM, &quit_action, NULL);
+  sigaction(SIGQUIT, &quit_action, NULL);
+
+  struct sigaction dump_action;
+  memset(&dump_action, 0, sizeof(dump_action));
+  dump_action.sa_handler = handle_dump_signal;
+  sigaction(SIGUSR1, &dump_action, NULL);
+
+  struct sigaction log_level_action;
+  memset(&log_level_action, 0, sizeof(log_level_action));
+  log_level_action.sa_handler = handle_log_level_signal;
+  sigaction(SIGUSR2, &log_level_action, NULL);
+
+  // Leave signals to this thread, so they interrupt its poll().
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGQUIT);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  start_logger();
+  if (capture_fname != NULL) {
+    start_capture(capture_fname);
+  }
+  if (threaded) {
+    start_input_thread();
+    start_output_thread();
+  }
+  if (tempo_threaded) {
+    start_tempo_thread();
+  }
+  if (config_watch_fd >= 0) {
+    start_config_thread();
+  }
+  bool controlled = control_path != NULL &&
+    start_control_thread(control_path);
+  pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+
+  if (replay_fname != NULL) {
+    start_replay(replay_fname);
+  }
+
+  int timer_fd = attempt(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK),
+                         "create timer");
+
+  // Input descriptors (the sequencer's, or with threads the input thread's
+  // eventfd) followed by the timer, with --tempo-thread the tempo thread's
+  // eventfd, with a config file its watch, and with a control socket the
+  // control thread's eventfd.
+  int n_input_file_descriptors;
+  struct pollfd* poll_file_descriptors;
+  if (threaded) {
+    n_input_file_descriptors = 1;
+    poll_file_descriptors = malloc(sizeof(struct pollfd) * 5);
+    poll_file_descriptors[0].fd = input_wake_fd;
+    poll_file_descriptors[0].events = POLLIN;
+  } else {
+    n_input_file_descriptors = snd_seq_poll_descriptors_count(seq, POLLIN);
+    poll_file_descriptors =
+      malloc(sizeof(struct pollfd) * (n_input_file_descriptors + 4));
+    snd_seq_poll_descriptors(seq, poll_file_descriptors,
+                             n_input_file_descriptors, POLLIN);
+  }
+  int n_poll_file_descriptors = n_input_file_descriptors + 1;
+  struct pollfd* timer_poll_file_descriptor =
+    &poll_file_descriptors[n_input_file_descriptors];
+  timer_poll_file_descriptor->fd = timer_fd;
+  timer_poll_file_descriptor->events = POLLIN;
+  if (tempo_threaded) {
+    poll_file_descriptors[n_poll_file_descriptors].fd = tempo_result_fd;
+    poll_file_descriptors[n_poll_file_descriptors].events = POLLIN;
+    n_poll_file_descriptors++;
+  }
+  struct pollfd* config_poll_file_descriptor = NULL;
+  if (config_watch_fd >= 0) {
+    config_poll_file_descriptor =
+      &poll_file_descriptors[n_poll_file_descriptors++];
+    config_poll_file_descriptor->fd = config_ready_fd;
+    config_poll_file_descriptor->events = POLLIN;
+  }
+  struct pollfd* control_poll_file_descriptor = NULL;
+  if (controlled) {
+    control_poll_file_descriptor =
+      &poll_file_descriptors[n_poll_file_descriptors++];
+    control_poll_file_descriptor->fd = control_request_fd;
+    control_poll_file_descriptor->events = POLLIN;
+  }
+
+  while (!quitting) {
+    int timeout_ms = -1;
+    if (tick_loop) {
+      timeout_ms = TICK_MS;
+    } else {
+      uint64_t current_time = now();
+      uint64_t deadline = jml_next_deadline(current_time);
+      uint64_t replay_deadline = next_replay_ns();
+      if (replay_deadline != 0 &&
+          (deadline == 0 || replay_deadline < deadline)) {
+        deadline = replay_deadline;
+      }
+      if (deadline > 0 && deadline <= current_time) {
+        timeout_ms = 0;
+      } else {
+        arm_timer(timer_fd, deadline);
+      }
+    }
+
+    bool input_ready = false;
+    if (poll(poll_file_descriptors, n_poll_file_descriptors, timeout_ms) > 0) {
+      if (timer_poll_file_descriptor->revents & POLLIN) {
+        // Nothing to do with the count: we only care that we woke up.
+        wait_fd(timer_fd);
+      }
+      for (int i = 0; i < n_input_file_descriptors; i++) {
+        if (poll_file_descriptors[i].revents & POLLIN) {
+          input_ready = true;
+        }
+      }
+    }
+
+    // Catch up on time-based work before events change the state it depends
+    // on, such as the breath level update_air() integrates.
+    tick(now());
+
+    if (config_poll_file_descriptor != NULL &&
+        (config_poll_file_descriptor->revents & POLLIN)) {
+      wait_fd(config_ready_fd);
+      take_config();
+    }
+    if (control_poll_file_descriptor != NULL &&
+        (control_poll_file_descriptor->revents & POLLIN)) {
+      wait_fd(control_request_fd);
+      apply_control();
+    }
+
+    // Estimates for hits we've already handled go before any new hits.
+    if (tempo_threaded) {
+      wait_fd(tempo_result_fd);
+      apply_tempo_results();
+    }
+
+    if (threaded) {
+      if (input_ready) {
+        wait_fd(input_wake_fd);
+      }
+      struct MidiRecord record;
+      while (ring_pop(&input_ring, &record)) {
+        handle_record(&record);
+      }
+    } else if (input_ready) {
       do {
         snd_seq_event_t* event;
-        if (snd_seq_event_input(seq, &event) > 0) {
+        if (read_event(&event) > 0) {
           handle_event(event);
         }
       } while (snd_seq_event_input_pending(seq, 0) > 0);
     }
 
-    tick();
+    replay_due(now());
+
+    flush_midi();
+
+    uint64_t done_time = now();
+    maybe_save_snapshot(done_time);
+
+    if (dump_requested) {
+      dump_requested = 0;
+      print_latency_stats();
+      print_profile();
+    }
+  }
+
+  if (controlled) {
+    unlink(control_path);
   }
+  // We were asked to stop, so next time isn't a crash to recover from.
+  forget_snapshot();
+  stop_capture();
+  print_stats();
+  stop_output_thread();
+  cancel_scheduled_midi();
+  all_notes_off();
+  flush_midi();
+  drain_log();
+  return 0;
 }
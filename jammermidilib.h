@@ -1,6 +1,13 @@
 #ifndef JAMMER_MIDI_LIB_H
 #define JAMMER_MIDI_LIB_H
 
+#include "wheel.h"
+#include "profile.h"
+#include "log.h"
+#include "tempo.h"
+#include "steps.h"
+#include "rig.h"
+
 // Spec:
 // https://www.midi.org/specifications-old/item/table-1-summary-of-midi-message
 // https://www.midi.org/specifications-old/item/table-3-control-change-messages-data-bytes-2
@@ -43,6 +50,7 @@
 #define MIDI_MAX 127
 
 #define TICK_MS 1  // try to tick every N milliseconds
+#define TICK_NS (TICK_MS * 1000000LL)
 
 #define KICK_TIMES_LENGTH 12
 #define SNARE_TIMES_LENGTH 12
@@ -83,6 +91,10 @@
 #define DOWN (112)
 #define RIGHT (113)
 #define TAB (114)
+// Scene keys: SCENE_0 + n switches to scene n, or with velocity
+// SCENE_STORE_VELOCITY stores the current configuration there.
+#define SCENE_0 (115)
+#define SCENE_STORE_VELOCITY 127
 
 #define MODE_MAJOR 1
 #define MODE_MIXO 2
@@ -118,6 +130,133 @@
 
 #define MAX_FADE MIDI_MAX
 
+// Two, so a new config file can be read into the one we're not using and
+// then swapped in between inputs.
+struct Rig rigs[2];
+struct Rig* rig = &rigs[0];
+
+void bind_key(struct Rig* rig, int key, int action, int arg) {
+  rig->keys[key].action = action;
+  rig->keys[key].arg = arg;
+}
+
+void default_rig(struct Rig* rig) {
+  memset(rig, 0, sizeof(*rig));
+
+  add_port_name(rig, PORT_SYNTH, "Synth input port");
+  add_port_name(rig, PORT_AXIS49, "AXIS-49 2A MIDI 1");
+  add_port_name(rig, PORT_BREATH, "Breath Controller");
+  add_port_name(rig, PORT_FEET, "mio MIDI 1");
+  add_port_name(rig, PORT_KEYPAD, "mido-keypad");  // pitch-detect:kbd.py
+  add_port_name(rig, PORT_KEYBOARD, "USB MIDI Interface MIDI 1");
+  add_port_name(rig, PORT_KEYBOARD, "Piano");
+  add_port_name(rig, PORT_KEYBOARD, "Roland");
+
+  for (int voice = 0; voice < 128; voice++) {
+    rig->voice_volumes[voice] = DEFAULT_VOICE_VOLUME;
+  }
+  rig->voice_volumes[80] = 62;
+  rig->voice_volumes[81] = 90;
+  rig->voice_volumes[84] = 68;
+  rig->voice_volumes[38] = 87;
+  rig->voice_volumes[85] = 80;
+  rig->voice_volumes[75] = 87;
+  rig->voice_volumes[39] = 86;
+  rig->voice_volumes[7] = 98;
+  rig->voice_volumes[35] = 107;
+  rig->voice_volumes[24] = 102;
+  rig->voice_volumes[64] = 87;
+  rig->voice_volumes[66] = 82;
+  rig->voice_volumes[67] = 92;
+  rig->voice_volumes[26] = 112;
+  rig->voice_volumes[28] = 112;
+  rig->voice_volumes[4] = 122;
+  rig->voice_volumes[0] = 100;
+  rig->voice_volumes[18] = 65;
+  rig->voice_volumes[5] = 90;
+  rig->voice_volumes[16] = 110;
+  rig->voice_volumes[32] = 115;
+
+  bind_key(rig, DELETE, KEY_ACTION_MANUAL_VOLUME, 0);
+  bind_key(rig, ESCAPE, KEY_ACTION_RESET, 0);
+  bind_key(rig, F1, KEY_ACTION_CLEAR, 0);
+  bind_key(rig, F2, KEY_ACTION_PAN, 0);
+  bind_key(rig, '-', KEY_ACTION_VOLUME, -5);
+  bind_key(rig, '=', KEY_ACTION_VOLUME, 5);  // +
+
+  bind_key(rig, '`', KEY_ACTION_SELECT, ENDPOINT_DRUM);
+  bind_key(rig, TAB, KEY_ACTION_TOGGLE, ENDPOINT_DRUM);
+  bind_key(rig, '1', KEY_ACTION_SELECT, ENDPOINT_JAWHARP);
+  bind_key(rig, 'Q', KEY_ACTION_TOGGLE, ENDPOINT_JAWHARP);
+  bind_key(rig, '2', KEY_ACTION_SELECT, ENDPOINT_FOOTBASS);
+  bind_key(rig, 'W', KEY_ACTION_TOGGLE, ENDPOINT_FOOTBASS);
+  bind_key(rig, '3', KEY_ACTION_SELECT, ENDPOINT_ARP);
+  bind_key(rig, 'E', KEY_ACTION_TOGGLE, ENDPOINT_ARP);
+  bind_key(rig, '4', KEY_ACTION_SELECT, ENDPOINT_FLEX);
+  bind_key(rig, 'R', KEY_ACTION_TOGGLE, ENDPOINT_FLEX);
+  bind_key(rig, '5', KEY_ACTION_SELECT, ENDPOINT_LOW);
+  bind_key(rig, 'T', KEY_ACTION_TOGGLE, ENDPOINT_LOW);
+  bind_key(rig, '6', KEY_ACTION_SELECT, ENDPOINT_HI);
+  bind_key(rig, 'Y', KEY_ACTION_TOGGLE, ENDPOINT_HI);
+  bind_key(rig, '7', KEY_ACTION_SELECT, ENDPOINT_OVERLAY);
+  bind_key(rig, 'U', KEY_ACTION_TOGGLE, ENDPOINT_OVERLAY);
+  bind_key(rig, '8', KEY_ACTION_SELECT, ENDPOINT_DRONE_BASS);
+  bind_key(rig, 'I', KEY_ACTION_TOGGLE, ENDPOINT_DRONE_BASS);
+  bind_key(rig, '9', KEY_ACTION_SELECT, ENDPOINT_DRONE_CHORD);
+  bind_key(rig, 'O', KEY_ACTION_TOGGLE, ENDPOINT_DRONE_CHORD);
+
+  bind_key(rig, 'J', KEY_ACTION_DOWNBEAT, 0);
+  bind_key(rig, 'K', KEY_ACTION_UPBEAT, 0);
+  bind_key(rig, 'P', KEY_ACTION_DOUBLED, 0);
+  bind_key(rig, '[', KEY_ACTION_PRE_UNIQUE, 0);
+  bind_key(rig, ']', KEY_ACTION_OCTAVE, 1);
+  bind_key(rig, '\\', KEY_ACTION_OCTAVE, -1);
+  bind_key(rig, 'L', KEY_ACTION_UPBEAT_HIGH, 0);
+  bind_key(rig, ';', KEY_ACTION_SHORTISH, 0);
+  bind_key(rig, '\'', KEY_ACTION_SHORTER, 0);
+  bind_key(rig, ',', KEY_ACTION_CHORD, 0);
+  bind_key(rig, '.', KEY_ACTION_VEL, 0);
+  bind_key(rig, '/', KEY_ACTION_FADE, 0);
+  bind_key(rig, F4, KEY_ACTION_DUCKED, 0);
+  bind_key(rig, F5, KEY_ACTION_DRUM_CHOOSES_SOME_NOTES, 0);
+  bind_key(rig, F6, KEY_ACTION_AIR_LOCKED, 0);
+  bind_key(rig, F7, KEY_ACTION_FOLLOWS_AIR, 0);
+  bind_key(rig, '0', KEY_ACTION_JIG_TIME, 0);
+  bind_key(rig, F10, KEY_ACTION_ALL_DRUMS_DOWNBEAT, 0);
+  bind_key(rig, F9, KEY_ACTION_DRUM_CHOOSES_NOTES, 0);
+  bind_key(rig, UP, KEY_ACTION_MODE, MODE_MAJOR);
+  bind_key(rig, LEFT, KEY_ACTION_MODE, MODE_MIXO);
+  bind_key(rig, DOWN, KEY_ACTION_MODE, MODE_MINOR);
+  bind_key(rig, RIGHT, KEY_ACTION_MODE, MODE_BETH_COHENS);
+  bind_key(rig, F8, KEY_ACTION_ROOT, 0);
+
+  // punchy
+  bind_key(rig, 'A', KEY_ACTION_VOICE, 39);
+  bind_key(rig, 'S', KEY_ACTION_VOICE, 38);
+  bind_key(rig, 'D', KEY_ACTION_VOICE, 32);
+  // rejected 12, 0, 8, 45, 33, 5, 12
+  bind_key(rig, 'N', KEY_ACTION_VOICE, 87);
+  bind_key(rig, 'F', KEY_ACTION_VOICE, 16);
+  bind_key(rig, 'M', KEY_ACTION_VOICE, 15);
+  bind_key(rig, 'G', KEY_ACTION_VOICE, 35);
+  bind_key(rig, 'H', KEY_ACTION_VOICE, 18);
+  // continuous
+  bind_key(rig, 'Z', KEY_ACTION_VOICE, 75);
+  bind_key(rig, 'X', KEY_ACTION_VOICE, 85);
+  bind_key(rig, 'C', KEY_ACTION_VOICE, 4);
+  bind_key(rig, 'V', KEY_ACTION_VOICE, 67);
+  bind_key(rig, 'B', KEY_ACTION_VOICE, 81);
+
+  for (int key = 0; key < 128; key++) {
+    rig->drum_keys[key] = NO_KIT;
+  }
+  rig->drum_keys['A'] = KIT_RIM;
+  rig->drum_keys['S'] = KIT_RIM2;
+  rig->drum_keys['D'] = KIT_SNARE;
+  rig->drum_keys['F'] = KIT_CLAP;
+  rig->drum_keys['G'] = KIT_ESNARE;
+}
+
 int normalize(int val) {
   if (val > MIDI_MAX) {
     return MIDI_MAX;
@@ -164,11 +303,18 @@ struct Configuration {
   bool ducked[N_ENDPOINTS];
 };
 
-// TODO: allow multiple of these.
-struct Configuration global_config;
+// Scenes: whole configurations to switch between with one key, one per
+// song or so.  c points at the one we're playing.
+#define N_SCENES 10
+struct Configuration scenes[N_SCENES];
+int current_scene = 0;
 
 // TODO: pass this around
-struct Configuration* c = &global_config;
+struct Configuration* c = &scenes[0];
+
+// Goes up after anything changes the configuration (other than what's
+// playing), so a copy made for another thread can tell if it's out of date.
+uint32_t config_generation = 0;
 
 /* Anything mentioned here should be initialized in voices_reset */
 
@@ -176,6 +322,10 @@ bool piano_notes[MIDI_MAX];
 int root_note;
 int last_update_bass_note;
 int fifth_note;
+// The hit history below, up to the trackers, belongs to compute_tempo(),
+// which may be running on another thread.  clear_status() bumps
+// tempo_generation instead of clearing it, and compute_tempo() clears it
+// when it sees the new generation.
 uint64_t kick_times[KICK_TIMES_LENGTH];
 int kick_times_index;
 uint64_t snare_times[SNARE_TIMES_LENGTH];
@@ -184,6 +334,28 @@ uint64_t crash_times[CRASH_TIMES_LENGTH];
 int crash_times_index;
 uint64_t hihat_times[HIHAT_TIMES_LENGTH];
 int hihat_times_index;
+// The same hits again for the incremental estimator: kicks and snares, and
+// all four.
+struct TempoTracker low_tempo;
+struct TempoTracker all_tempo;
+uint32_t tempo_history_generation;
+uint32_t tempo_generation;
+// Use the incremental estimator (tempo.h) instead of estimate_tempo_helper()'s
+// search.  It's less work per hit, but still locks less often than the search
+// when the playing is sloppy.
+bool incremental_tempo = false;
+// The last tempo we locked to and when, for tempo_window().
+float last_tempo_bpm;
+uint64_t last_tempo_ns;
+// The beat tracker's loop (see track_beat()); beat_period_ns is 0 when
+// we're not tracking.
+uint64_t beat_period_ns;
+uint64_t predicted_downbeat_ns;
+// The last hit we played as a downbeat before we knew its tempo, with the
+// estimate handed off to another thread (see hand_off_tempo).
+uint64_t early_downbeat_ns;
+// Lay every bar out from its hit at the estimated tempo instead.
+bool snap_to_hits = false;
 uint64_t next_ns[N_SUBBEATS];
 uint64_t current_beat_ns;
 uint64_t last_downbeat_ns;
@@ -211,6 +383,23 @@ int prev_chord_note;
 int fade_value;
 int fade_target;
 
+// Everything the engine has to do at a particular time goes on here, and
+// jml_tick() runs whatever is due.
+struct Wheel wheel;
+// What's pending for each of next_ns[], so a new downbeat can replace them.
+int subbeat_events[N_SUBBEATS];
+int end_notes_event = WHEEL_NONE;
+int fade_event = WHEEL_NONE;
+int duck_event = WHEEL_NONE;
+
+void cancel_subbeats() {
+  for (int i = 0; i < N_SUBBEATS; i++) {
+    wheel_cancel(&wheel, subbeat_events[i]);
+    subbeat_events[i] = WHEEL_NONE;
+    next_ns[i] = 0;
+  }
+}
+
 int to_root(int note_out) {
   // 24-35
   return note_out % 12 + 24;
@@ -363,6 +552,9 @@ void update_drum_pedal_note() {
 }
 
 void update_bass(bool force_refresh);
+void check_end_notes_soon();
+void start_fading();
+void start_ducking();
 
 // Given a note relative to root, convert it into a note relative to fifth.
 int to_fifth(int note_out) {
@@ -418,19 +610,95 @@ void all_notes_off() {
   }
 }
 
-void reload_voice_setting(struct Configuration* c) {
-  int endpoint = c->selected_endpoint;
-  int voice = c->voices[endpoint];
-  int volume_delta = c->volume_deltas[endpoint];
-  int manual_volume = c->manual_volumes[voice];
-  bool pan = c->pans[endpoint];
+// Past these volume deltas every endpoint is at 0 or 127, and past these
+// octave deltas every note is off the end of the keyboard (footbass and
+// jawharp move by half octaves, but that still takes them 5 octaves), so
+// there's nothing to gain by going further and a lot of presses to get back.
+#define MAX_VOLUME_DELTA 127
+#define MAX_OCTAVE_DELTA 10
+
+// delta moved by change, kept within -max to max.
+int move_delta(int delta, int change, int max) {
+  delta += change;
+  if (delta < -max) return -max;
+  if (delta > max) return max;
+  return delta;
+}
+
+// The CC 7 volume for voice on endpoint.
+int voice_volume(int endpoint, int voice, int volume_delta,
+                 int manual_volume) {
+  int volume = rig->voice_volumes[voice];
+
+  if (endpoint == ENDPOINT_DRUM) {
+    volume = MIDI_MAX;
+  }
+  
+  if (manual_volume != -1) {
+    volume = manual_volume;
+  }
+
+  volume += volume_delta;
+
+  if (endpoint == ENDPOINT_FLEX) {
+    volume -= 24;
+  } else if (endpoint == ENDPOINT_FOOTBASS) {
+    volume -= 20;
+  } else if (endpoint == ENDPOINT_ARP) {
+    volume -= 40;
+  } else if (endpoint == ENDPOINT_LOW) {
+    volume += 10;
+  } 
+
+  if (endpoint == ENDPOINT_OVERLAY ||
+      endpoint == ENDPOINT_FLEX ||
+      endpoint == ENDPOINT_HI ||
+      endpoint == ENDPOINT_ARP) {
+    if (voice == 39) {
+      volume -= 10;
+    } else if (voice == 26) {
+      volume -= 20;
+    } else if (voice == 4) {
+      volume -= 15;
+    } else if (voice == 64) {
+      volume -= 10;
+    }
+  }
+  return volume;
+}
 
+void select_endpoint_voice(int endpoint, int voice, int bank, int volume_delta,
+                           int manual_volume, bool pan) {
+  send_midi(MIDI_CC, CC_07, 0, endpoint);
+  send_midi(MIDI_CC, CC_07,
+            voice_volume(endpoint, voice, volume_delta, manual_volume),
+            endpoint);
+  send_midi(MIDI_CC, CC_PAN, pan ? MIDI_MAX : 0, endpoint);
+  send_midi(MIDI_CC, CC_BALANCE, pan ? MIDI_MAX : 0, endpoint);
+
+  if (endpoint != CHANNEL_DRUM) {
+    choose_voice(endpoint, bank, voice);
+  }
+}
+
+int endpoint_volume_delta(const struct Configuration* c, int endpoint) {
+  int volume_delta = c->volume_deltas[endpoint];
   if (endpoint != ENDPOINT_JAWHARP && c->ducked[endpoint]) {
     volume_delta += 20;
   }
+  return volume_delta;
+}
+
+void send_voice_setting(const struct Configuration* c, int endpoint) {
+  int voice = c->voices[endpoint];
   select_endpoint_voice(endpoint,
                         voice % 128, voice / 128,
-                        volume_delta, manual_volume, pan);
+                        endpoint_volume_delta(c, endpoint),
+                        c->manual_volumes[voice], c->pans[endpoint]);
+}
+
+void reload_voice_setting(struct Configuration* c) {
+  send_voice_setting(c, c->selected_endpoint);
 }
 
 void select_voice(struct Configuration* c, int voice) {
@@ -579,29 +847,14 @@ void clear_status() {
   fifth_note = to_root(root_note + 7);
   last_update_bass_note = 0;
 
-  for (int i = 0; i < KICK_TIMES_LENGTH; i++) {
-    kick_times[i] = 0;
-  }
-  kick_times_index = 0;
-
-  for (int i = 0; i < SNARE_TIMES_LENGTH; i++) {
-    snare_times[i] = 0;
-  }
-  snare_times_index = 0;
+  // Forget the hit history, and ignore any estimates still on their way.
+  tempo_generation++;
+  early_downbeat_ns = 0;
+  last_tempo_ns = 0;
+  beat_period_ns = 0;
+  predicted_downbeat_ns = 0;
 
-  for (int i = 0; i < CRASH_TIMES_LENGTH; i++) {
-    crash_times[i] = 0;
-  }
-  crash_times_index = 0;
-
-  for (int i = 0; i < HIHAT_TIMES_LENGTH; i++) {
-    hihat_times[i] = 0;
-  }
-  hihat_times_index = 0;
-
-  for (int i = 0; i < N_SUBBEATS; i++) {
-    next_ns[i] = 0;
-  }
+  cancel_subbeats();
 
   current_beat_ns = 0;
   last_downbeat_ns = 0;
@@ -760,6 +1013,167 @@ bool should_end_note(int current_len, bool is_shortish, bool is_shorter) {
   return false;
 }
 
+// What an endpoint does on each subbeat only depends on a few flags that
+// change when keys are pressed, so instead of working it out with
+// select_note() and should_end_note() every subbeat we compile the flags
+// into a table the first time we play with them.
+struct PatternStep {
+  int8_t offset;  // added to the note and the fifth
+  bool send;
+};
+
+struct Pattern {
+  uint32_t flags;  // pattern_flags() this was compiled from
+  // End the note once it's been sounding this many subbeats, or never if -1.
+  int end_len;
+  struct PatternStep steps[N_SUBBEATS];
+};
+
+#define PATTERN_CHORD       (1 << 0)
+#define PATTERN_DOWNBEAT    (1 << 1)
+#define PATTERN_UPBEAT      (1 << 2)
+#define PATTERN_UPBEAT_HIGH (1 << 3)
+#define PATTERN_PRE_UNIQUE  (1 << 4)
+#define PATTERN_DOUBLED     (1 << 5)
+#define PATTERN_SHORTISH    (1 << 6)
+#define PATTERN_SHORTER     (1 << 7)
+#define PATTERN_JIG_TIME    (1 << 8)
+#define PATTERN_FLAGS       (1 << 9)  // one past all of them
+// Never matches pattern_flags(): jml_setup() starts every endpoint with this.
+#define PATTERN_UNCOMPILED  0xffffffff
+
+struct Pattern patterns[N_ENDPOINTS];
+uint64_t n_patterns_compiled = 0;
+
+uint32_t pattern_flags(int endpoint) {
+  return (c->chord[endpoint] ? PATTERN_CHORD : 0) |
+    (c->downbeat[endpoint] ? PATTERN_DOWNBEAT : 0) |
+    (c->upbeat[endpoint] ? PATTERN_UPBEAT : 0) |
+    (c->upbeat_high[endpoint] ? PATTERN_UPBEAT_HIGH : 0) |
+    (c->pre_unique[endpoint] ? PATTERN_PRE_UNIQUE : 0) |
+    (c->doubled[endpoint] ? PATTERN_DOUBLED : 0) |
+    (c->shortish[endpoint] ? PATTERN_SHORTISH : 0) |
+    (c->shorter[endpoint] ? PATTERN_SHORTER : 0) |
+    (jig_time ? PATTERN_JIG_TIME : 0);
+}
+
+void compile_pattern(struct Pattern* pattern, uint32_t flags) {
+  bool chord = flags & PATTERN_CHORD;
+  bool send_downbeat = flags & PATTERN_DOWNBEAT;
+  bool send_upbeat = flags & PATTERN_UPBEAT;
+  bool upbeat_high = flags & PATTERN_UPBEAT_HIGH;
+  bool pre_unique = flags & PATTERN_PRE_UNIQUE;
+  bool doubled = flags & PATTERN_DOUBLED;
+  bool shortish = flags & PATTERN_SHORTISH;
+  bool shorter = flags & PATTERN_SHORTER;
+  bool jig = flags & PATTERN_JIG_TIME;
+
+  int base = chord ? 12 : 0;
+  for (int i = 0; i < N_SUBBEATS; i++) {
+    pattern->steps[i].offset = base;
+    pattern->steps[i].send = false;
+  }
+
+  pattern->steps[0].send = send_downbeat;
+
+  struct PatternStep* up = &pattern->steps[jig ? 2*72/3-3 : 72/2-1];
+  up->send = send_upbeat;
+  if (upbeat_high && pre_unique) {
+    up->offset += 24;
+  } else if (upbeat_high || pre_unique) {
+    up->offset += 12;
+  }
+
+  // In jig time the pre-upbeat leads into the upbeat like the pre-downbeat
+  // does in reels, and there's no pre-downbeat.
+  int lead_offset = base;
+  if (upbeat_high && pre_unique) {
+    lead_offset += 36;
+  } else if (pre_unique) {
+    lead_offset += 12 + 7;
+  } else if (upbeat_high) {
+    lead_offset += 12;
+  }
+  if (jig) {
+    struct PatternStep* pre = &pattern->steps[72/3-3];
+    pre->send = send_upbeat && doubled;
+    pre->offset = lead_offset;
+  } else {
+    struct PatternStep* pre = &pattern->steps[72/4];
+    pre->send = send_downbeat && doubled;
+    if (pre_unique) {
+      pre->offset += upbeat_high ? 12 : 7;
+    }
+    struct PatternStep* predown = &pattern->steps[3*72/4];
+    predown->send = send_upbeat && doubled;
+    predown->offset = lead_offset;
+  }
+
+  pattern->end_len = -1;
+  if (shortish || shorter) {
+    pattern->end_len = jig ? 24 : 18;  // kept if shortish only
+    if (shortish && shorter) {
+      pattern->end_len /= 3;
+    } else if (shorter) {
+      pattern->end_len /= 2;
+    }
+  }
+  pattern->flags = flags;
+}
+
+const struct Pattern* endpoint_pattern(int endpoint) {
+  uint32_t flags = pattern_flags(endpoint);
+  struct Pattern* pattern = &patterns[endpoint];
+  if (pattern->flags != flags) {
+    compile_pattern(pattern, flags);
+    n_patterns_compiled++;
+  }
+  return pattern;
+}
+
+// Compare every pattern compile_pattern() can make against select_note() and
+// should_end_note(), printing any differences.  Returns how many there were.
+int verify_patterns() {
+  bool saved_jig_time = jig_time;
+  int n_wrong = 0;
+  for (uint32_t flags = 0; flags < PATTERN_FLAGS; flags++) {
+    struct Pattern pattern;
+    compile_pattern(&pattern, flags);
+    jig_time = flags & PATTERN_JIG_TIME;
+
+    for (int subbeat = 0; subbeat < N_SUBBEATS; subbeat++) {
+      int selected_note = 0;
+      bool send_note = false;
+      select_note(subbeat, flags & PATTERN_CHORD, flags & PATTERN_DOWNBEAT,
+                  flags & PATTERN_UPBEAT, flags & PATTERN_UPBEAT_HIGH,
+                  flags & PATTERN_PRE_UNIQUE, flags & PATTERN_DOUBLED,
+                  &selected_note, &send_note);
+      const struct PatternStep* step = &pattern.steps[subbeat];
+      if (step->send != send_note || step->offset != selected_note) {
+        printf("pattern %03x subbeat %d: compiled %d%s, expected %d%s\n",
+               flags, subbeat, step->offset, step->send ? " send" : "",
+               selected_note, send_note ? " send" : "");
+        n_wrong++;
+      }
+    }
+
+    for (int len = -1; len < N_SUBBEATS; len++) {
+      bool end_note = should_end_note(len, flags & PATTERN_SHORTISH,
+                                      flags & PATTERN_SHORTER);
+      bool compiled_end = len != -1 && pattern.end_len != -1 &&
+        len >= pattern.end_len;
+      if (end_note != compiled_end) {
+        printf("pattern %03x length %d: compiled %s, expected %s\n",
+               flags, len, compiled_end ? "end" : "keep",
+               end_note ? "end" : "keep");
+        n_wrong++;
+      }
+    }
+  }
+  jig_time = saved_jig_time;
+  return n_wrong;
+}
+
 void arpeggiate_endpoint(int endpoint, int subbeat, uint64_t current_time, bool drone) {
   if (!c->on[endpoint]) return;
   if (drone && c->current_note[endpoint] == -1) return;
@@ -768,22 +1182,17 @@ void arpeggiate_endpoint(int endpoint, int subbeat, uint64_t current_time, bool
     c->current_len[endpoint]++;
   }
 
+  const struct Pattern* pattern = endpoint_pattern(endpoint);
+  const struct PatternStep* step = &pattern->steps[subbeat];
   int note_out = active_note();
-  int selected_note = note_out;
-  int fifth = to_fifth(selected_note);
-  bool send_note = false;
-
-  select_note(subbeat, c->chord[endpoint], c->downbeat[endpoint],
-              c->upbeat[endpoint], c->upbeat_high[endpoint], c->pre_unique[endpoint],
-              c->doubled[endpoint], &selected_note, &send_note);
-  select_note(subbeat, c->chord[endpoint], c->downbeat[endpoint],
-              c->upbeat[endpoint], c->upbeat_high[endpoint], c->pre_unique[endpoint],
-              c->doubled[endpoint], &fifth, &send_note);
+  int selected_note = note_out + step->offset;
+  int fifth = to_fifth(note_out) + step->offset;
+  bool send_note = step->send;
 
+  int len = c->current_len[endpoint];
   bool end_note = send_note ||
     (!(endpoint == ENDPOINT_FOOTBASS && drum_chooses_notes) &&
-     should_end_note(c->current_len[endpoint], c->shortish[endpoint],
-                     c->shorter[endpoint]));
+     len != -1 && pattern->end_len != -1 && len >= pattern->end_len);
 
   if (end_note && c->current_note[endpoint] != -1) {
     psend_midi(MIDI_OFF, c->current_note[endpoint], 0, endpoint);
@@ -822,6 +1231,9 @@ void arpeggiate_endpoint(int endpoint, int subbeat, uint64_t current_time, bool
       }
 
       c->last_arpeggiation[endpoint] = current_time;
+      if (endpoint == ENDPOINT_FOOTBASS) {
+        check_end_notes_soon();
+      }
     }
   }
 }
@@ -902,136 +1314,583 @@ void arpeggiate_drum(int subbeat, uint64_t current_time) {
   }
 }
 
-void arpeggiate(int subbeat, uint64_t current_time, bool drone, bool running) {
-  arpeggiate_endpoint(ENDPOINT_FOOTBASS, subbeat, current_time, drone);
-  if (running || c->shorter[ENDPOINT_DRUM]) {
-    arpeggiate_drum(subbeat, current_time);
+// Step patterns from --steps, if any.  An endpoint with steps plays those
+// instead of what the rhythm keys say.
+struct Steps user_steps;
+// The note each step is sounding, or -1.
+int step_notes[MAX_STEPS];
+
+void end_step(int index) {
+  if (step_notes[index] == -1) return;
+  psend_midi(MIDI_OFF, step_notes[index], 0,
+             user_steps.steps[index].endpoint);
+  step_notes[index] = -1;
+}
+
+void play_steps(int subbeat) {
+  for (int i = user_steps.first_end[subbeat];
+       i < user_steps.first_end[subbeat + 1]; i++) {
+    end_step(user_steps.ends[i]);
+  }
+  for (int i = user_steps.first_start[subbeat];
+       i < user_steps.first_start[subbeat + 1]; i++) {
+    int index = user_steps.starts[i];
+    const struct Step* step = &user_steps.steps[index];
+    int endpoint = step->endpoint;
+    if (!c->on[endpoint]) continue;
+
+    end_step(index);
+    int note = step->note;
+    if (endpoint != ENDPOINT_DRUM) {
+      note += step->from_chord ? active_chord() : active_note();
+    }
+    int vel = step->velocity;
+    if (vel == STEP_DEFAULT_VELOCITY) {
+      vel = c->vel[endpoint] ? last_fb_vel : 90;
+    }
+    psend_midi(MIDI_ON, note, vel, endpoint);
+    step_notes[index] = note;
   }
-  arpeggiate_endpoint(ENDPOINT_ARP, subbeat, current_time, drone);
 }
 
-uint64_t delta(uint64_t a, uint64_t b) {
-  return a > b ? a - b : b - a;
+void arpeggiate(int subbeat, uint64_t current_time, bool drone, bool running) {
+  if (!user_steps.endpoints[ENDPOINT_FOOTBASS]) {
+    arpeggiate_endpoint(ENDPOINT_FOOTBASS, subbeat, current_time, drone);
+  }
+  if ((running || c->shorter[ENDPOINT_DRUM]) &&
+      !user_steps.endpoints[ENDPOINT_DRUM]) {
+    arpeggiate_drum(subbeat, current_time);
+  }
+  if (!user_steps.endpoints[ENDPOINT_ARP]) {
+    arpeggiate_endpoint(ENDPOINT_ARP, subbeat, current_time, drone);
+  }
+  if (user_steps.n > 0 && !drone) {
+    play_steps(subbeat);
+  }
 }
 
-uint64_t min(uint64_t a, uint64_t b) {
-  return a < b ? a : b;
+// Whether we're playing a tempo, in which case we look for the next one
+// in the octave around it.
+bool have_tempo(uint64_t current_time) {
+  return last_tempo_ns != 0 && current_time - last_tempo_ns < TEMPO_WINDOW_NS;
 }
 
-uint64_t best_match_hit(uint64_t target, uint64_t* hits, int hit_len) {
-  uint64_t best_error = NS_PER_SEC;  // default to being way off
-  for (int i = 0; i < hit_len; i++) {
-    uint64_t error = delta(target, hits[i]);
-    if (error < best_error) {
-      best_error = error;
-    }
+// Where to look for a tempo: an octave starting here.
+float tempo_window(uint64_t current_time) {
+  if (have_tempo(current_time)) {
+    return last_tempo_bpm / sqrtf(2);
   }
-  return best_error;
+  return TEMPO_DEFAULT_WINDOW_BPM;
 }
 
-float estimate_tempo_helper(uint64_t current_time, bool consider_high) {
+float estimate_tempo_helper(uint64_t current_time, bool consider_high,
+                            float window_bpm, bool slower) {
   // Take a super naive approach: for each candidate tempo, consider
   // how much error that would imply for each recent hit we've seen,
   // and take the tempo with the lowest error.
   //
   // If the hit doesn't fit the pattern, don't give up, treat it as
   // an extra hit and ignore it.
+  //
+  // tempo_search() does this for every candidate against one timeline of
+  // all the hits we're considering.
+  float ago[KICK_TIMES_LENGTH + SNARE_TIMES_LENGTH + CRASH_TIMES_LENGTH +
+            HIHAT_TIMES_LENGTH];
+  int n = 0;
+  for (int i = 0; i < KICK_TIMES_LENGTH; i++) {
+    n = tempo_add_hit(ago, n, current_time, kick_times[i]);
+  }
+  for (int i = 0; i < SNARE_TIMES_LENGTH; i++) {
+    n = tempo_add_hit(ago, n, current_time, snare_times[i]);
+  }
+  if (consider_high) {
+    for (int i = 0; i < CRASH_TIMES_LENGTH; i++) {
+      n = tempo_add_hit(ago, n, current_time, crash_times[i]);
+    }
+    for (int i = 0; i < HIHAT_TIMES_LENGTH; i++) {
+      n = tempo_add_hit(ago, n, current_time, hihat_times[i]);
+    }
+  }
 
-  float best_bpm = -1;
-  // something way high, in case we fail to find anything
-  uint64_t best_error = NS_PER_SEC * 100L;
+  return tempo_search(ago, n, window_bpm, slower);
+}
 
-  int n_downbeats_to_consider = 4;
 
-  for (float candidate_bpm = 70;
-       candidate_bpm < 140;
-       candidate_bpm += 0.25) {
+// Whether to hand each bar's subbeats to the platform to send ahead of time
+// (see send_at_ns) instead of putting them on the wheel one by one.
+bool schedule_bars = false;
+// The last subbeat we've handed off, if schedule_bars.
+uint64_t bar_scheduled_until_ns = 0;
 
-    uint64_t whole_note_ns = 60L * NS_PER_SEC / candidate_bpm;
-    uint64_t candidate_error = 0;
+// The arpeggiation maybe_end_notes() last ended, so we only end each one once.
+uint64_t last_ended_arpeggiation = 0;
 
-    // Look for a kick or snare (or maybe anything) on every past downbeat
-    for (int i = 0; i < n_downbeats_to_consider; i++) {
-      uint64_t target = current_time - (i+1)*whole_note_ns;
-      uint64_t error =
-        min(best_match_hit(target, kick_times, KICK_TIMES_LENGTH),
-            best_match_hit(target, snare_times, SNARE_TIMES_LENGTH));
+int end_notes_threshold() {
+  int threshold = NS_PER_SEC;
+  if (c->shortish[ENDPOINT_FOOTBASS]) {
+    threshold /= 2;
+  }
+  if (c->shorter[ENDPOINT_FOOTBASS]) {
+    threshold /= 4;
+  }
+  return threshold;
+}
 
-      if (consider_high) {
-	error = min(error,
-		    best_match_hit(target, crash_times, CRASH_TIMES_LENGTH));
-	error = min(error,
-		    best_match_hit(target, hihat_times, HIHAT_TIMES_LENGTH));
-      }
+// Stand in for maybe_end_notes() for footbass arpeggiations at a and then b
+// that are both in a bar we're scheduling ahead of time.
+void schedule_end_notes_between(uint64_t a, uint64_t b) {
+  if (!drum_chooses_notes) return;
+  if (!c->shortish[ENDPOINT_FOOTBASS] && !c->shorter[ENDPOINT_FOOTBASS]) return;
+  if (a == 0 || a == last_ended_arpeggiation) return;
 
-      candidate_error += error;
-    }
+  uint64_t end_ns = a + end_notes_threshold() + 1;
+  if (end_ns < b) {
+    send_at_ns = end_ns;
+    endpoint_notes_off(ENDPOINT_FOOTBASS);
+    last_ended_arpeggiation = a;
+  }
+}
+
+// Arpeggiate the rest of the bar from subbeat first now, with every note
+// sent for when its subbeat is due.  Later changes to the configuration or the root take
+// effect from the next bar.
+void schedule_bar(int first) {
+  uint64_t prev_arpeggiation = c->last_arpeggiation[ENDPOINT_FOOTBASS];
+  for (int i = first; i < N_SUBBEATS; i++) {
+    send_at_ns = next_ns[i];
+    arpeggiate(i, next_ns[i], /*drone=*/false, /*running=*/true);
+    bar_scheduled_until_ns = next_ns[i];
+    next_ns[i] = 0;
 
-    if (candidate_error < best_error) {
-      best_error = candidate_error;
-      best_bpm = candidate_bpm;
+    uint64_t arpeggiation = c->last_arpeggiation[ENDPOINT_FOOTBASS];
+    if (arpeggiation != prev_arpeggiation) {
+      schedule_end_notes_between(prev_arpeggiation, arpeggiation);
+      prev_arpeggiation = arpeggiation;
     }
   }
+  send_at_ns = 0;
+}
+
+void forget_arpeggiated_notes(int endpoint) {
+  endpoint_notes_off(endpoint);
+  c->current_note[endpoint] = -1;
+  c->current_fifth[endpoint] = -1;
+  c->current_len[endpoint] = -1;
+}
+
+// A new downbeat is replacing a bar we scheduled ahead of time: drop what
+// hasn't gone out yet.  Our idea of which notes are sounding is from the end
+// of that bar, so stop whatever is actually sounding instead.
+void cancel_bar(uint64_t current_time) {
+  if (bar_scheduled_until_ns <= current_time) return;
+
+  cancel_scheduled_midi();
+  bar_scheduled_until_ns = 0;
+
+  forget_arpeggiated_notes(ENDPOINT_FOOTBASS);
+  forget_arpeggiated_notes(ENDPOINT_ARP);
+}
+
+// How late subbeats go out relative to their next_ns[] deadlines.
+uint64_t subbeat_late_n = 0;
+uint64_t subbeat_late_total_ns = 0;
+uint64_t subbeat_late_max_ns = 0;
+// Subbeats later than this count as missed deadlines.
+uint64_t subbeat_late_threshold_ns = 1000000;
+uint64_t subbeat_missed_n = 0;
+
+void record_subbeat_lateness(uint64_t late_ns) {
+  subbeat_late_n++;
+  subbeat_late_total_ns += late_ns;
+  if (late_ns > subbeat_late_max_ns) {
+    subbeat_late_max_ns = late_ns;
+  }
+  if (late_ns > subbeat_late_threshold_ns) {
+    subbeat_missed_n++;
+  }
+}
+
+void fire_subbeat(int subbeat, uint64_t current_time) {
+  PROFILE_BEGIN(PHASE_SUBBEAT);
+  subbeat_events[subbeat] = WHEEL_NONE;
+  record_subbeat_lateness(current_time - next_ns[subbeat]);
+  arpeggiate(subbeat, current_time, /*drone=*/false, /*running=*/true);
+  next_ns[subbeat] = 0;
+  PROFILE_END(PHASE_SUBBEAT);
+}
+
+// Beat tracking.  Each hit that gives us a tempo starts a bar, but instead
+// of laying the bar out from scratch at whatever tempo that hit suggests, we
+// keep a phase-locked loop: a bar length and a prediction of when the next
+// downbeat will be.  A hit near the prediction corrects both a little,
+// in proportion to how far off it was, and the new bar is stretched or
+// squeezed so it ends where the loop now expects the next downbeat.  So a
+// drummer drifting gets followed smoothly, and one sloppy hit only moves
+// the grid part way.  A hit near the half or a quarter of the bar, like a
+// snare between kicks, corrects the loop the same way by how far it was
+// from there, but doesn't start a bar: the rest of the current one is
+// stretched or squeezed instead.  A hit far from all of these, or a tempo
+// far from the loop's, starts over from the hit like we used to.
+//
+// The first two gains are fractions of the phase error: how much of it we
+// take as the downbeat really having moved, and how much as the bar being
+// longer or shorter than we thought.  The loop alone is slow to notice a
+// tempo change, though, so we also pull the bar length part way towards the
+// tempo estimate, which has the last few bars to go on.
+#define BEAT_PHASE_GAIN 0.75
+#define BEAT_PERIOD_GAIN 0.25
+#define BEAT_TEMPO_GAIN 0.25
+// Start over if a hit is more than this fraction of a bar from where we
+// expected it, or the tempo estimate is more than this fraction off ours.
+// Hits near the first or third quarter have to be closer, since those are
+// only a quarter of a bar from the downbeat or the half.
+#define BEAT_CAPTURE 8
+#define BEAT_QUARTER_CAPTURE 16
+#define BEAT_TEMPO_CAPTURE 16
+// Or if they skipped more than this many downbeats.
+#define BEAT_MAX_SKIPPED 3
+
+// How far hits are from where we predicted them, for ones we follow.
+uint64_t beat_followed_n = 0;
+uint64_t beat_error_total_ns = 0;
+uint64_t beat_error_max_ns = 0;
+uint64_t beat_relock_n = 0;
+
+void record_beat_error(uint64_t error_ns) {
+  beat_followed_n++;
+  beat_error_total_ns += error_ns;
+  if (error_ns > beat_error_max_ns) {
+    beat_error_max_ns = error_ns;
+  }
+}
+
+// How far a hit at current_time is from the downbeat we predicted, once
+// we've moved the prediction past any downbeats the drummer sat out.
+int64_t beat_error(uint64_t current_time, uint64_t* skipped) {
+  *skipped = 0;
+  if (beat_period_ns != 0 &&
+      current_time + beat_period_ns / 2 > predicted_downbeat_ns) {
+    *skipped = (current_time + beat_period_ns / 2 - predicted_downbeat_ns) /
+      beat_period_ns;
+  }
+  return (int64_t) (current_time -
+                    (predicted_downbeat_ns + *skipped * beat_period_ns));
+}
+
+// Whether the loop would follow a hit at current_time rather than start
+// over, as long as the tempo estimate agrees.
+bool expecting_downbeat(uint64_t current_time) {
+  if (beat_period_ns == 0) return false;
+  uint64_t skipped;
+  int64_t error = beat_error(current_time, &skipped);
+  uint64_t abs_error = error < 0 ? -error : error;
+  return skipped <= BEAT_MAX_SKIPPED &&
+    abs_error <= beat_period_ns / BEAT_CAPTURE;
+}
+
+// A hit at current_time gave us a tempo estimate of estimate_ns per bar.
+// Update the loop and return how long this hit's bar should be, or 0 if
+// the hit is partway through the current bar and doesn't start one.
+uint64_t track_beat(uint64_t current_time, uint64_t estimate_ns) {
+  // If the drummer sat out a bar or two, compare to the downbeat they
+  // came back in on.
+  uint64_t skipped;
+  int64_t error = beat_error(current_time, &skipped);
+  predicted_downbeat_ns += skipped * beat_period_ns;
+  uint64_t tempo_off = estimate_ns > beat_period_ns ?
+    estimate_ns - beat_period_ns : beat_period_ns - estimate_ns;
+
+  // Which quarter of the bar the hit is nearest, counting back from the
+  // downbeat, and how far it is from it.
+  int64_t quarter = 0;
+  if (beat_period_ns != 0) {
+    quarter = llround(4.0 * error / beat_period_ns);
+    error -= quarter * (int64_t) beat_period_ns / 4;
+  }
+  uint64_t abs_error = error < 0 ? -error : error;
+
+  if (snap_to_hits || beat_period_ns == 0 || skipped > BEAT_MAX_SKIPPED ||
+      quarter <= -4 || quarter >= 4 ||
+      abs_error > beat_period_ns /
+          (quarter % 2 == 0 ? BEAT_CAPTURE : BEAT_QUARTER_CAPTURE) ||
+      tempo_off > beat_period_ns / BEAT_TEMPO_CAPTURE) {
+    beat_period_ns = estimate_ns;
+    predicted_downbeat_ns = current_time + estimate_ns;
+    beat_relock_n++;
+    return estimate_ns;
+  }
+
+  record_beat_error(abs_error);
+  beat_period_ns += (int64_t) (BEAT_PERIOD_GAIN * error) +
+    (int64_t) (BEAT_TEMPO_GAIN *
+               ((int64_t) estimate_ns - (int64_t) beat_period_ns));
+  // Where the loop thinks this hit really was, and so the next downbeat.
+  predicted_downbeat_ns += (int64_t) (BEAT_PHASE_GAIN * error);
+  if (quarter != 0) return 0;
+  predicted_downbeat_ns += beat_period_ns;
+  return predicted_downbeat_ns - current_time;
+}
+
+// Everything compute_tempo() needs to know about a hit, so it can run on
+// another thread without looking at the engine's state.
+struct TempoRequest {
+  uint64_t hit_ns;
+  uint64_t submitted_ns;  // when we handed it off, or 0 if we didn't
+  int note_in;
+  float window_bpm;
+  bool slower;
+  bool consider_high;
+  uint32_t generation;
+};
+
+struct TempoResult {
+  uint64_t hit_ns;
+  uint64_t submitted_ns;
+  float bpm;  // 0 if the hit doesn't give us a tempo
+  uint32_t generation;
+};
 
-  if (best_bpm < 0) {
-    printf("best_bpm = %.2f : not expected\n", best_bpm);
-    return best_bpm;
+// If set, estimate_tempo() calls this to have the estimate made somewhere
+// else, and whoever does it passes the result to apply_tempo() on the
+// engine thread.  If it returns false we make the estimate ourselves.
+bool (*hand_off_tempo)(const struct TempoRequest* request) = NULL;
+
+// How long handed off estimates took to come back, and how many subbeats
+// were already due by the time they did.
+uint64_t tempo_handoff_n = 0;
+uint64_t tempo_handoff_total_ns = 0;
+uint64_t tempo_handoff_max_ns = 0;
+uint64_t tempo_handoff_skipped_subbeats = 0;
+
+void clear_tempo_history() {
+  for (int i = 0; i < KICK_TIMES_LENGTH; i++) {
+    kick_times[i] = 0;
   }
+  kick_times_index = 0;
 
-  uint64_t whole_beat = NS_PER_SEC * 60 / best_bpm;
+  for (int i = 0; i < SNARE_TIMES_LENGTH; i++) {
+    snare_times[i] = 0;
+  }
+  snare_times_index = 0;
 
-  // Allow error of up to 1/32 note on each of the downbeats.
-  uint64_t max_allowed_error = (whole_beat * n_downbeats_to_consider) / 32;
+  for (int i = 0; i < CRASH_TIMES_LENGTH; i++) {
+    crash_times[i] = 0;
+  }
+  crash_times_index = 0;
 
-  bool acceptable_error = best_error < max_allowed_error;
+  for (int i = 0; i < HIHAT_TIMES_LENGTH; i++) {
+    hihat_times[i] = 0;
+  }
+  hihat_times_index = 0;
+
+  tempo_tracker_clear(&low_tempo);
+  tempo_tracker_clear(&all_tempo);
+}
 
-  if (!acceptable_error) {
-    return -1;
+// Add the hit to the history and estimate the tempo it gives us.  This only
+// touches the hit history, so it can run on any one thread at a time.
+struct TempoResult compute_tempo(const struct TempoRequest* request) {
+  uint64_t current_time = request->hit_ns;
+  if (request->generation != tempo_history_generation) {
+    clear_tempo_history();
+    tempo_history_generation = request->generation;
   }
 
-  return best_bpm;
+  int note_in = request->note_in;
+  if (note_in == MIDI_DRUM_IN_KICK) {
+    kick_times[kick_times_index] = current_time;
+    kick_times_index = (kick_times_index+1) % KICK_TIMES_LENGTH;
+  } else if (note_in == MIDI_DRUM_IN_SNARE) {
+    snare_times[snare_times_index] = current_time;
+    snare_times_index = (snare_times_index+1) % SNARE_TIMES_LENGTH;
+  } else if (note_in == MIDI_DRUM_IN_CRASH) {
+    crash_times[crash_times_index] = current_time;
+    crash_times_index = (crash_times_index+1) % CRASH_TIMES_LENGTH;
+  } else if (note_in == MIDI_DRUM_IN_HIHAT) {
+    hihat_times[hihat_times_index] = current_time;
+    hihat_times_index = (hihat_times_index+1) % HIHAT_TIMES_LENGTH;
+  }
+
+  float window_bpm = request->window_bpm;
+  bool slower = request->slower;
+  bool consider_high = request->consider_high;
+  float best_bpm;
+
+  if (incremental_tempo) {
+    // The trackers have to see every hit, even when we'll only use one.
+    bool low = note_in == MIDI_DRUM_IN_KICK || note_in == MIDI_DRUM_IN_SNARE;
+    best_bpm = tempo_tracker_hit(&low_tempo, current_time, low,
+                                 window_bpm, slower);
+    float all_bpm = tempo_tracker_hit(&all_tempo, current_time, true,
+                                      window_bpm, slower);
+    if (best_bpm < 0 && consider_high) {
+      best_bpm = all_bpm;
+    }
+  } else {
+    best_bpm = estimate_tempo_helper(current_time, /*consider_high=*/ false,
+                                     window_bpm, slower);
+    if (best_bpm < 0 && consider_high) {
+      best_bpm = estimate_tempo_helper(current_time, /*consider_high=*/ true,
+                                       window_bpm, slower);
+    }
+  }
+
+  struct TempoResult result;
+  result.hit_ns = current_time;
+  result.submitted_ns = request->submitted_ns;
+  result.bpm = best_bpm > 0 ? best_bpm : 0;
+  result.generation = request->generation;
+  return result;
+}
+
+// Time subbeats first and on subbeat_ns apart, starting at first_ns, and
+// note where ducking turns around.
+void lay_out_subbeats(int first, uint64_t first_ns, uint64_t subbeat_ns) {
+  for (int i = first; i < N_SUBBEATS; i++) {
+    next_ns[i] = first_ns + (i - first) * subbeat_ns;
+    if (i == (jig_time ? 60 : 50)) {
+      next_duck_peak_ns = next_ns[i];
+    } else if (i == (jig_time ? 30 : 20)) {
+      next_duck_trough_ns = next_ns[i];
+    } else if (i == N_SUBBEATS - 1) {
+      next_downbeat_ns = next_ns[i];
+    }
+  }
 }
 
+// A hit partway through the bar moved the loop's next downbeat: spread
+// what's left of the bar out so it ends there.  A bar scheduled ahead with
+// --queue has already gone out, so that one just ends where it ends.
+void stretch_bar(uint64_t current_time) {
+  if (schedule_bars) return;
+  int first = 0;
+  while (first < N_SUBBEATS && subbeat_events[first] == WHEEL_NONE) {
+    first++;
+  }
+  if (first == N_SUBBEATS || predicted_downbeat_ns <= current_time) return;
 
-void estimate_tempo(uint64_t current_time, int note_in) {
-  current_beat_ns = 0;
+  for (int i = first; i < N_SUBBEATS; i++) {
+    wheel_cancel(&wheel, subbeat_events[i]);
+  }
+  uint64_t subbeat_ns =
+    (predicted_downbeat_ns - current_time) / (N_SUBBEATS - first + 1);
+  lay_out_subbeats(first, current_time + subbeat_ns, subbeat_ns);
+  for (int i = first; i < N_SUBBEATS; i++) {
+    subbeat_events[i] = wheel_schedule(&wheel, next_ns[i], fire_subbeat, i);
+  }
+  start_ducking();
+}
+
+// Play subbeat 0 for a hit at current_time, ending the bar before it.
+void start_bar(uint64_t current_time) {
+  cancel_subbeats();
+  if (schedule_bars) {
+    cancel_bar(current_time);
+  }
+  arpeggiate(0, current_time, /*drone=*/false, /*running=*/true);
+  last_downbeat_ns = current_time;
+}
 
-  float best_bpm = estimate_tempo_helper(current_time, /*consider_high=*/ false);
-  if (best_bpm < 0 && (allow_all_drums_downbeat || drum_chooses_notes)) {
-    best_bpm = estimate_tempo_helper(current_time, /*consider_high=*/ true);
+void apply_tempo(const struct TempoResult* result) {
+  // We've been reset since this hit.
+  if (result->generation != tempo_generation) return;
+
+  uint64_t current_time = result->hit_ns;
+  bool started = early_downbeat_ns == current_time;
+  uint64_t first_due_ns = 0;
+  if (result->submitted_ns != 0) {
+    // Compensate for how long the estimate took by laying the bar out from
+    // the hit as usual, and skipping any subbeats that are already past.
+    first_due_ns = now();
+    uint64_t took = first_due_ns - result->submitted_ns;
+    tempo_handoff_n++;
+    tempo_handoff_total_ns += took;
+    if (took > tempo_handoff_max_ns) {
+      tempo_handoff_max_ns = took;
+    }
   }
 
+  float best_bpm = result->bpm;
   if (best_bpm <= 0) {
-    if (drum_chooses_notes) {
+    if (started) {
+      // We guessed wrong, but the old bar was over anyway.
+      current_beat_ns = 0;
+    } else if (drum_chooses_notes) {
       arpeggiate(0, current_time, /*drone=*/false, /*running=*/false);
     }
     return;
   }
 
   // We have a tempo: best_bpm
-  printf("Tempo selected: %f\n", best_bpm);
+  jlog(LOG_INFO, "Tempo selected: %f\n", best_bpm);
+  last_tempo_bpm = best_bpm;
+  last_tempo_ns = current_time;
   
-  uint64_t whole_beat = NS_PER_SEC * 60 / best_bpm;
-  current_beat_ns = whole_beat;
+  uint64_t bar_ns = track_beat(current_time, NS_PER_SEC * 60 / best_bpm);
+  current_beat_ns = beat_period_ns;
 
-  arpeggiate(0, current_time, /*drone=*/false, /*running=*/true);
-  last_downbeat_ns = current_time;
+  // A later hit has already started a bar of its own.
+  if (early_downbeat_ns > current_time) return;
 
-  next_ns[0] = current_time;
-  for (int i = 1; i < N_SUBBEATS; i++) {
-    next_ns[i] = next_ns[i-1] + (whole_beat)/72;
-    if (i == (jig_time ? 60 : 50)) {
-      next_duck_peak_ns = next_ns[i];
-    } else if (i == (jig_time ? 30 : 20)) {
-      next_duck_trough_ns = next_ns[i];
-    } else if (i == N_SUBBEATS - 1) {
-      next_downbeat_ns = next_ns[i];
+  if (bar_ns == 0) {
+    stretch_bar(now());
+    return;
+  }
+
+  if (!started) {
+    start_bar(current_time);
+  }
+
+  lay_out_subbeats(0, current_time, bar_ns/72);
+
+  int first = 1;
+  while (first < N_SUBBEATS && next_ns[first] < first_due_ns) {
+    next_ns[first++] = 0;
+    tempo_handoff_skipped_subbeats++;
+  }
+  if (schedule_bars) {
+    schedule_bar(first);
+  } else {
+    for (int i = first; i < N_SUBBEATS; i++) {
+      subbeat_events[i] = wheel_schedule(&wheel, next_ns[i], fire_subbeat, i);
     }
   }
+  start_ducking();
 }
 
-void count_drum_hit(int note_in) {
-  uint64_t current_time = now();
+void estimate_tempo(uint64_t current_time, int note_in) {
+  struct TempoRequest request;
+  request.hit_ns = current_time;
+  request.submitted_ns = 0;
+  request.note_in = note_in;
+  request.window_bpm = tempo_window(current_time);
+  request.slower = !have_tempo(current_time);
+  request.consider_high = allow_all_drums_downbeat || drum_chooses_notes;
+  request.generation = tempo_generation;
+
+  if (hand_off_tempo != NULL) {
+    // Don't make the downbeat wait for the estimate if it's where we were
+    // expecting one.  Otherwise it waits, like it would if we were making
+    // the estimate here.
+    if (expecting_downbeat(current_time)) {
+      start_bar(current_time);
+      early_downbeat_ns = current_time;
+    } else {
+      current_beat_ns = 0;
+    }
+    request.submitted_ns = now();
+    if (hand_off_tempo(&request)) return;
+    request.submitted_ns = 0;
+  } else {
+    current_beat_ns = 0;
+  }
+
+  struct TempoResult result = compute_tempo(&request);
+  apply_tempo(&result);
+}
+
+// current_time is when the hit arrived, which may be a bit before now().
+void count_drum_hit(int note_in, uint64_t current_time) {
 
   // When drum_chooses_some_notes only pedals 1, 3, and 4 should
   // affect the most recent pedal; otherwise we want to use all
@@ -1071,22 +1930,9 @@ void count_drum_hit(int note_in) {
     most_recent_choosy_drum_ts = current_time;
   }
 
-  if (note_in == MIDI_DRUM_IN_KICK) {
-    kick_times[kick_times_index] = current_time;
-    estimate_tempo(current_time, note_in);
-    kick_times_index = (kick_times_index+1) % KICK_TIMES_LENGTH;
-  } else if (note_in == MIDI_DRUM_IN_SNARE) {
-    snare_times[snare_times_index] = current_time;
+  if (note_in == MIDI_DRUM_IN_KICK || note_in == MIDI_DRUM_IN_SNARE ||
+      note_in == MIDI_DRUM_IN_CRASH || note_in == MIDI_DRUM_IN_HIHAT) {
     estimate_tempo(current_time, note_in);
-    snare_times_index = (snare_times_index+1) % SNARE_TIMES_LENGTH;
-  } else if (note_in == MIDI_DRUM_IN_CRASH) {
-    crash_times[crash_times_index] = current_time;
-    estimate_tempo(current_time, note_in);
-    crash_times_index = (crash_times_index+1) % CRASH_TIMES_LENGTH;
-  } else if (note_in == MIDI_DRUM_IN_HIHAT) {
-    hihat_times[hihat_times_index] = current_time;
-    estimate_tempo(current_time, note_in);
-    hihat_times_index = (hihat_times_index+1) % HIHAT_TIMES_LENGTH;
   }
 }
 
@@ -1329,6 +2175,7 @@ void handle_piano(unsigned int mode, unsigned int note_in, unsigned int val) {
 }
 
 void full_reset() {
+  forget_sent_controllers();
   voices_reset();
   all_notes_off();
 }
@@ -1353,6 +2200,7 @@ void toggle_ducked() {
 	     c->selected_endpoint);
   reload_voice_setting(c);
   update_bass(/*force_refresh=*/true);
+  start_ducking();
 }
 
 void toggle_endpoint(int endpoint) {
@@ -1369,207 +2217,300 @@ void toggle_endpoint(int endpoint) {
   }
 }
 
-void handle_keypad(unsigned int mode, unsigned char note_in, unsigned int val) {
+// Whether going from one configuration to the other changes what endpoint
+// sounds like, so whatever it's playing has to stop.
+bool scene_changes_sound(const struct Configuration* from,
+                         const struct Configuration* to, int endpoint) {
+  return from->on[endpoint] != to->on[endpoint] ||
+    from->voices[endpoint] != to->voices[endpoint] ||
+    from->chord[endpoint] != to->chord[endpoint] ||
+    from->octave_deltas[endpoint] != to->octave_deltas[endpoint];
+}
+
+// Send only what differs between the two configurations, instead of
+// reloading every endpoint's voice.  Controller changes are held until the
+// end of the batch anyway (see send_midi()), so they go out together.
+void send_scene_diff(const struct Configuration* from,
+                     const struct Configuration* to) {
+  for (int endpoint = 0; endpoint < N_ENDPOINTS; endpoint++) {
+    if (scene_changes_sound(from, to, endpoint)) {
+      if (endpoint < N_DRONE_ENDPOINTS) {
+        drone_endpoint_off(endpoint);
+      } else {
+        endpoint_notes_off(endpoint);
+      }
+    }
+
+    int from_voice = from->voices[endpoint];
+    int to_voice = to->voices[endpoint];
+    int from_volume = voice_volume(endpoint, from_voice % 128,
+                                   endpoint_volume_delta(from, endpoint),
+                                   from->manual_volumes[from_voice]);
+    int to_volume = voice_volume(endpoint, to_voice % 128,
+                                 endpoint_volume_delta(to, endpoint),
+                                 to->manual_volumes[to_voice]);
+    if (from_volume != to_volume) {
+      send_midi(MIDI_CC, CC_07, to_volume, endpoint);
+    }
+    if (from->pans[endpoint] != to->pans[endpoint]) {
+      send_midi(MIDI_CC, CC_PAN, to->pans[endpoint] ? MIDI_MAX : 0, endpoint);
+      send_midi(MIDI_CC, CC_BALANCE, to->pans[endpoint] ? MIDI_MAX : 0,
+                endpoint);
+    }
+    if (from_voice != to_voice && endpoint != CHANNEL_DRUM) {
+      choose_voice(endpoint, to_voice / 128, to_voice % 128);
+    }
+    // Like toggle_follows_air() and toggle_ducked(): anything driven by air
+    // or ducking starts from silence and the next tick brings it up.
+    if (from->follows_air[endpoint] != to->follows_air[endpoint] ||
+        from->ducked[endpoint] != to->ducked[endpoint]) {
+      psend_midi(MIDI_CC, CC_11,
+                 (to->follows_air[endpoint] || to->ducked[endpoint] ||
+                  endpoint == ENDPOINT_JAWHARP) ? 0 : MIDI_MAX,
+                 endpoint);
+    }
+  }
+}
+
+// What's left to do after going from one configuration to another, once c
+// is the new one.
+struct ConfigurationChange {
+  bool drones_changed;
+  bool ducking_changed;
+};
+
+// Start going from one configuration to another: send what's different, and
+// carry over whatever is playing wherever it still sounds the same.
+struct ConfigurationChange begin_configuration_change(
+    const struct Configuration* from, struct Configuration* to) {
+  send_scene_diff(from, to);
+
+  struct ConfigurationChange change = {false, false};
+  for (int endpoint = 0; endpoint < N_ENDPOINTS; endpoint++) {
+    // Keep playing whatever didn't change.
+    if (scene_changes_sound(from, to, endpoint)) {
+      to->current_note[endpoint] = -1;
+      to->current_fifth[endpoint] = -1;
+      to->current_len[endpoint] = -1;
+      change.drones_changed |= endpoint < N_DRONE_ENDPOINTS;
+    } else {
+      to->current_note[endpoint] = from->current_note[endpoint];
+      to->current_fifth[endpoint] = from->current_fifth[endpoint];
+      to->current_len[endpoint] = from->current_len[endpoint];
+    }
+    to->last_arpeggiation[endpoint] = from->last_arpeggiation[endpoint];
+    change.ducking_changed |= from->ducked[endpoint] != to->ducked[endpoint];
+  }
+  return change;
+}
+
+void finish_configuration_change(struct ConfigurationChange change) {
+  if (change.drones_changed) {
+    // Only starts the drones we stopped: the others are already playing
+    // the right note.
+    update_bass(/*force_refresh=*/true);
+  }
+  if (change.ducking_changed) {
+    start_ducking();
+  }
+}
+
+void switch_scene(int scene) {
+  if (scene == current_scene) return;
+  jlog(LOG_INFO, "switching to scene %d\n", scene);
+  struct ConfigurationChange change =
+    begin_configuration_change(c, &scenes[scene]);
+  // The control thread reads c.
+  __atomic_store_n(&c, &scenes[scene], __ATOMIC_RELEASE);
+  current_scene = scene;
+  finish_configuration_change(change);
+}
+
+void store_scene(int scene) {
+  jlog(LOG_INFO, "storing scene %d\n", scene);
+  if (scene != current_scene) {
+    scenes[scene] = *c;
+  }
+}
+
+void press_key(unsigned int mode, unsigned char note_in, unsigned int val) {
   if (mode != MIDI_ON) return;
 
-  printf("recv: %c\n", note_in);
+  jlog(LOG_INFO, "recv: %c\n", note_in);
+
+  if (note_in >= SCENE_0 && note_in < SCENE_0 + N_SCENES) {
+    if (val == SCENE_STORE_VELOCITY) {
+      store_scene(note_in - SCENE_0);
+    } else {
+      switch_scene(note_in - SCENE_0);
+    }
+    return;
+  }
 
   int selected_voice = c->voices[c->selected_endpoint];
 
-  if (c->selected_endpoint == ENDPOINT_DRUM) {
-    switch (note_in) {
-    case 'A': c->drum_voice = KIT_RIM; return;
-    case 'S': c->drum_voice = KIT_RIM2; return;
-    case 'D': c->drum_voice = KIT_SNARE; return;
-    case 'F': c->drum_voice = KIT_CLAP; return;
-    case 'G': c->drum_voice = KIT_ESNARE; return;
-    }
+  if (c->selected_endpoint == ENDPOINT_DRUM &&
+      rig->drum_keys[note_in] != NO_KIT) {
+    c->drum_voice = rig->drum_keys[note_in];
+    return;
   }
 
-  switch (note_in) {
-  case DELETE:
-    // Manual volume entry
+  // What each key does is in the rig; see default_rig().
+  int arg = rig->keys[note_in].arg;
+  switch (rig->keys[note_in].action) {
+  case KEY_ACTION_MANUAL_VOLUME:
     c->manual_volumes[selected_voice] = val;
     reload_voice_setting(c);
     return;
-  case ESCAPE:
+  case KEY_ACTION_RESET:
     full_reset();
     return;
-  case F1:
+  case KEY_ACTION_CLEAR:
     clear_endpoint();
     return;
-  case F2:
+  case KEY_ACTION_PAN:
     c->pans[c->selected_endpoint] = !c->pans[c->selected_endpoint];
     reload_voice_setting(c);
     return;
-  case '-':
-    c->volume_deltas[c->selected_endpoint] -= 5;
-    reload_voice_setting(c);
-    return;
-  case '=': // +
-    c->volume_deltas[c->selected_endpoint] += 5;
+  case KEY_ACTION_VOLUME:
+    c->volume_deltas[c->selected_endpoint] = move_delta(
+      c->volume_deltas[c->selected_endpoint], arg, MAX_VOLUME_DELTA);
     reload_voice_setting(c);
     return;
-  case '`':
-    c->selected_endpoint = ENDPOINT_DRUM;
-    return;
-  case 'r': // tab
-    toggle_endpoint(ENDPOINT_DRUM);
-    return;
-  case '1':
-    c->selected_endpoint = ENDPOINT_JAWHARP;
-    return;
-  case 'Q':
-    toggle_endpoint(ENDPOINT_JAWHARP);
-    return;
-  case '2':
-    c->selected_endpoint = ENDPOINT_FOOTBASS;
-    return;
-  case 'W':
-    toggle_endpoint(ENDPOINT_FOOTBASS);
-    update_bass(/*force_refresh=*/true);
-    return;
-  case '3':
-    c->selected_endpoint = ENDPOINT_ARP;
-    return;
-  case 'E':
-    toggle_endpoint(ENDPOINT_ARP);
-    update_bass(/*force_refresh=*/true);
-    return;
-  case '4':
-    c->selected_endpoint = ENDPOINT_FLEX;
-    return;
-  case 'R':
-    toggle_endpoint(ENDPOINT_FLEX);
-    return;
-  case '5':
-    c->selected_endpoint = ENDPOINT_LOW;
-    return;
-  case 'T':
-    toggle_endpoint(ENDPOINT_LOW);
-    return;
-  case '6':
-    c->selected_endpoint = ENDPOINT_HI;
-    return;
-  case 'Y':
-    toggle_endpoint(ENDPOINT_HI);
-    return;
-  case '7':
-    c->selected_endpoint = ENDPOINT_OVERLAY;
-    return;
-  case 'U':
-    toggle_endpoint(ENDPOINT_OVERLAY);
-    return;
-  case '8':
-    c->selected_endpoint = ENDPOINT_DRONE_BASS;
-    return;
-  case 'I':
-    toggle_endpoint(ENDPOINT_DRONE_BASS);
+  case KEY_ACTION_SELECT:
+    c->selected_endpoint = arg;
     return;
-  case '9':
-    c->selected_endpoint = ENDPOINT_DRONE_CHORD;
-    return;
-  case 'O':
-    toggle_endpoint(ENDPOINT_DRONE_CHORD);
+  case KEY_ACTION_TOGGLE:
+    toggle_endpoint(arg);
+    if (arg == ENDPOINT_FOOTBASS || arg == ENDPOINT_ARP) {
+      update_bass(/*force_refresh=*/true);
+    }
     return;
 
-  case 'J':
+  case KEY_ACTION_DOWNBEAT:
     c->downbeat[c->selected_endpoint] = !c->downbeat[c->selected_endpoint];
     return;
-  case 'K':
+  case KEY_ACTION_UPBEAT:
     c->upbeat[c->selected_endpoint] = !c->upbeat[c->selected_endpoint];
     return;
-  case 'P':
+  case KEY_ACTION_DOUBLED:
     c->doubled[c->selected_endpoint] = !c->doubled[c->selected_endpoint];
     return;
-  case '[':
+  case KEY_ACTION_PRE_UNIQUE:
     c->pre_unique[c->selected_endpoint] = !c->pre_unique[c->selected_endpoint];
     return;
-  case ']':
+  case KEY_ACTION_OCTAVE:
     endpoint_notes_off(c->selected_endpoint);
-    c->octave_deltas[c->selected_endpoint]++;
+    c->octave_deltas[c->selected_endpoint] = move_delta(
+      c->octave_deltas[c->selected_endpoint], arg, MAX_OCTAVE_DELTA);
     return;
-  case '\\':
-    endpoint_notes_off(c->selected_endpoint);
-    c->octave_deltas[c->selected_endpoint]--;
-    return;
-  case 'L':
+  case KEY_ACTION_UPBEAT_HIGH:
     c->upbeat_high[c->selected_endpoint] = !c->upbeat_high[c->selected_endpoint];
     return;
-  case ';':
+  case KEY_ACTION_SHORTISH:
     c->shortish[c->selected_endpoint] = !c->shortish[c->selected_endpoint];
+    check_end_notes_soon();
     return;
-  case '\'':
+  case KEY_ACTION_SHORTER:
     c->shorter[c->selected_endpoint] = !c->shorter[c->selected_endpoint];
+    check_end_notes_soon();
     return;
-  case ',':
+  case KEY_ACTION_CHORD:
     c->chord[c->selected_endpoint] = !c->chord[c->selected_endpoint];
     endpoint_notes_off(c->selected_endpoint);
     return;
-  case '.':
+  case KEY_ACTION_VEL:
     c->vel[c->selected_endpoint] = !c->vel[c->selected_endpoint];
     return;
-  case '/':
+  case KEY_ACTION_FADE:
     fade_target = fade_target == 0 ? MAX_FADE : 0;
+    start_fading();
     return;
-  case F4:
+  case KEY_ACTION_DUCKED:
     toggle_ducked();
     return;
-  case F5:
+  case KEY_ACTION_DRUM_CHOOSES_SOME_NOTES:
     drum_chooses_some_notes = !drum_chooses_some_notes;
     if (drum_chooses_some_notes) {
       most_recent_drum_pedal = MIDI_PEDAL_3;
     }
     return;
-  case F6:
+  case KEY_ACTION_AIR_LOCKED:
     toggle_air_locked();
     return;
-  case F7:
+  case KEY_ACTION_FOLLOWS_AIR:
     toggle_follows_air();
     return;
-  case '0':
+  case KEY_ACTION_JIG_TIME:
     jig_time = !jig_time;
     return;
-  case F10:
+  case KEY_ACTION_ALL_DRUMS_DOWNBEAT:
     allow_all_drums_downbeat = !allow_all_drums_downbeat;
     return;
-  case F9:
+  case KEY_ACTION_DRUM_CHOOSES_NOTES:
     drum_chooses_notes = !drum_chooses_notes;
+    check_end_notes_soon();
     return;
-  case UP:
-    musical_mode = MODE_MAJOR;
-    return;
-  case LEFT:
-    musical_mode = MODE_MIXO;
-    return;
-  case DOWN:
-    musical_mode = MODE_MINOR;
+  case KEY_ACTION_MODE:
+    musical_mode = arg;
     return;
-  case RIGHT:
-    musical_mode = MODE_BETH_COHENS;
-    return;
-  case F8:
+  case KEY_ACTION_ROOT:
     root_note = to_root(val);
     fifth_note = to_root(root_note + 7);
     update_bass(/*force_refresh=*/false);
     return;
+  case KEY_ACTION_VOICE:
+    select_voice(c, arg);
+    return;
+  }
+}
 
-  // punchy
-  case 'A': select_voice(c, 39); return;
-  case 'S': select_voice(c, 38); return;
-  case 'D': select_voice(c, 32); return;
-    // rejected 12, 0, 8, 45, 33, 5, 12
-  case 'N': select_voice(c, 87); return;
-  case 'F': select_voice(c, 16); return;
-  case 'M': select_voice(c, 15); return;
-  case 'G': select_voice(c, 35); return;
-  case 'H': select_voice(c, 18); return;
-  // continuous
-  case 'Z': select_voice(c, 75); return;
-  case 'X': select_voice(c, 85); return;
-  case 'C': select_voice(c,  4); return;
-  case 'V': select_voice(c, 67); return;
-  case 'B': select_voice(c, 81); return;
+void handle_keypad(unsigned int mode, unsigned char note_in, unsigned int val) {
+  press_key(mode, note_in, val);
+  // Only after the key has done whatever it does: see config_generation.
+  __atomic_store_n(&config_generation, config_generation + 1,
+                   __ATOMIC_RELEASE);
+}
+
+// Start with the rig in fname, or the defaults if fname is NULL.  Call before
+// jml_setup().  Exits if fname is no good.
+void init_rig(const char* fname) {
+  if (fname == NULL) {
+    default_rig(rig);
+  } else if (!load_rig(rig, fname)) {
+    exit(1);
+  }
+}
+
+// The one of rigs[] we're not using, to load a new rig into.  Another
+// thread can load it, as long as it doesn't while a swap_rig() is pending.
+struct Rig* spare_rig() {
+  return __atomic_load_n(&rig, __ATOMIC_ACQUIRE) == &rigs[0] ?
+    &rigs[1] : &rigs[0];
+}
+
+// Swap in a rig we've just loaded into new_rig, which should be
+// spare_rig().  Held notes keep sounding, but any endpoint whose voice is
+// now a different volume gets its new volume right away.
+void swap_rig(struct Rig* new_rig) {
+  int old_volumes[N_ENDPOINTS];
+  for (int endpoint = 0; endpoint < N_ENDPOINTS; endpoint++) {
+    int voice = c->voices[endpoint];
+    old_volumes[endpoint] = voice_volume(endpoint, voice % 128,
+                                         endpoint_volume_delta(c, endpoint),
+                                         c->manual_volumes[voice]);
+  }
+
+  __atomic_store_n(&rig, new_rig, __ATOMIC_RELEASE);
+
+  for (int endpoint = 0; endpoint < N_ENDPOINTS; endpoint++) {
+    int voice = c->voices[endpoint];
+    int volume = voice_volume(endpoint, voice % 128,
+                              endpoint_volume_delta(c, endpoint),
+                              c->manual_volumes[voice]);
+    if (volume != old_volumes[endpoint]) {
+      send_midi(MIDI_CC, CC_07, volume, endpoint);
+    }
   }
 }
 
@@ -1578,7 +2519,8 @@ int remap(int val, int min, int max) {
   return val * range / MIDI_MAX + min;
 }
 
-void handle_feet(unsigned int mode, unsigned int note_in, unsigned int val) {
+void handle_feet(unsigned int mode, unsigned int note_in, unsigned int val,
+                 uint64_t arrival_ns) {
   if (mode != MIDI_ON) {
     return;
   }
@@ -1595,7 +2537,7 @@ void handle_feet(unsigned int mode, unsigned int note_in, unsigned int val) {
   }
 
   //printf("foot: %d %d\n", note_in, val);
-  count_drum_hit(note_in);
+  count_drum_hit(note_in, arrival_ns);
   if (drum_chooses_notes ||
       (drum_chooses_some_notes &&
        note_in != MIDI_DRUM_IN_KICK)) {
@@ -1605,7 +2547,7 @@ void handle_feet(unsigned int mode, unsigned int note_in, unsigned int val) {
 
 void handle_cc(unsigned int cc, unsigned int val) {
   if (cc != CC_BREATH && cc != CC_11) {
-    printf("Unknown Control change %d\n", cc);
+    jlog(LOG_WARN, "Unknown Control change %d\n", cc);
     return;
   }
 
@@ -1725,19 +2667,203 @@ void calculate_breath_speeds() {
          max_air, fill_time_ms, fill_time_ticks, breath_gain);
 }
 
+// Nothing is sounding and nothing is compiled yet.
+void forget_played_notes() {
+  for (int i = 0; i < N_ENDPOINTS; i++) {
+    current_note[i] = -1;
+    patterns[i].flags = PATTERN_UNCOMPILED;
+  }
+  for (int i = 0; i < MAX_STEPS; i++) {
+    step_notes[i] = -1;
+  }
+}
+
+// Cleared by jml_resume(): a restart in the middle of a song shouldn't play
+// over it.
+bool startup_chime = true;
+
 void jml_setup() {
+  wheel_init(&wheel);
+  // 0 is a real handle.
+  for (int i = 0; i < N_SUBBEATS; i++) {
+    subbeat_events[i] = WHEEL_NONE;
+  }
   calculate_breath_speeds();
   full_reset();
+  // Every scene starts out as the default until something is stored there.
+  for (int i = 1; i < N_SCENES; i++) {
+    scenes[i] = scenes[0];
+  }
+
+  forget_played_notes();
+}
+
+// What a restart needs to carry on where we were: every scene, and the
+// status clear_status() would otherwise start over.  Times are on the now()
+// clock, which keeps going across restarts.  Hit history isn't here: the
+// next few hits rebuild it, and meanwhile the beat tracker has the tempo.
+struct EngineState {
+  struct Configuration scenes[N_SCENES];
+  int current_scene;
+
+  int root_note;
+  int fifth_note;
+  int musical_mode;
+  bool jig_time;
+  bool allow_all_drums_downbeat;
+  bool drum_chooses_notes;
+  bool drum_chooses_some_notes;
+  int most_recent_drum_pedal;
+  int chord_type;
+  int chord_note;
+  int current_drum_pedal_note;
+  int last_drum_pedal_note;
+  int prev_chord_type;
+  int prev_chord_note;
+  int fade_value;
+  int fade_target;
+
+  float last_tempo_bpm;
+  uint64_t last_tempo_ns;
+  uint64_t beat_period_ns;
+  uint64_t predicted_downbeat_ns;
+  uint64_t current_beat_ns;
+  uint64_t last_downbeat_ns;
+  uint64_t next_downbeat_ns;
+  uint64_t next_duck_trough_ns;
+  uint64_t next_duck_peak_ns;
+  uint64_t next_ns[N_SUBBEATS];
+};
 
-  for (int i = 0; i < N_ENDPOINTS; i++) {
-    current_note[i] = -1;
+void save_engine_state(struct EngineState* state) {
+  memcpy(state->scenes, scenes, sizeof(scenes));
+  state->current_scene = current_scene;
+
+  state->root_note = root_note;
+  state->fifth_note = fifth_note;
+  state->musical_mode = musical_mode;
+  state->jig_time = jig_time;
+  state->allow_all_drums_downbeat = allow_all_drums_downbeat;
+  state->drum_chooses_notes = drum_chooses_notes;
+  state->drum_chooses_some_notes = drum_chooses_some_notes;
+  state->most_recent_drum_pedal = most_recent_drum_pedal;
+  state->chord_type = chord_type;
+  state->chord_note = chord_note;
+  state->current_drum_pedal_note = current_drum_pedal_note;
+  state->last_drum_pedal_note = last_drum_pedal_note;
+  state->prev_chord_type = prev_chord_type;
+  state->prev_chord_note = prev_chord_note;
+  state->fade_value = fade_value;
+  state->fade_target = fade_target;
+
+  state->last_tempo_bpm = last_tempo_bpm;
+  state->last_tempo_ns = last_tempo_ns;
+  state->beat_period_ns = beat_period_ns;
+  state->predicted_downbeat_ns = predicted_downbeat_ns;
+  state->current_beat_ns = current_beat_ns;
+  state->last_downbeat_ns = last_downbeat_ns;
+  state->next_downbeat_ns = next_downbeat_ns;
+  state->next_duck_trough_ns = next_duck_trough_ns;
+  state->next_duck_peak_ns = next_duck_peak_ns;
+  memcpy(state->next_ns, next_ns, sizeof(next_ns));
+}
+
+// Instead of jml_setup(): pick up from a state saved by a jammer that's no
+// longer running, without resetting the synth.
+void jml_resume(const struct EngineState* state) {
+  wheel_init(&wheel);
+  calculate_breath_speeds();
+  forget_played_notes();
+  startup_chime = false;
+
+  memcpy(scenes, state->scenes, sizeof(scenes));
+  current_scene = state->current_scene;
+  c = &scenes[current_scene];
+
+  root_note = state->root_note;
+  fifth_note = state->fifth_note;
+  musical_mode = state->musical_mode;
+  jig_time = state->jig_time;
+  allow_all_drums_downbeat = state->allow_all_drums_downbeat;
+  drum_chooses_notes = state->drum_chooses_notes;
+  drum_chooses_some_notes = state->drum_chooses_some_notes;
+  most_recent_drum_pedal = state->most_recent_drum_pedal;
+  chord_type = state->chord_type;
+  chord_note = state->chord_note;
+  current_drum_pedal_note = state->current_drum_pedal_note;
+  last_drum_pedal_note = state->last_drum_pedal_note;
+  prev_chord_type = state->prev_chord_type;
+  prev_chord_note = state->prev_chord_note;
+  fade_value = state->fade_value;
+  fade_target = state->fade_target;
+
+  last_tempo_bpm = state->last_tempo_bpm;
+  last_tempo_ns = state->last_tempo_ns;
+  beat_period_ns = state->beat_period_ns;
+  predicted_downbeat_ns = state->predicted_downbeat_ns;
+  current_beat_ns = state->current_beat_ns;
+  last_downbeat_ns = state->last_downbeat_ns;
+  next_downbeat_ns = state->next_downbeat_ns;
+  next_duck_trough_ns = state->next_duck_trough_ns;
+  next_duck_peak_ns = state->next_duck_peak_ns;
+  memcpy(next_ns, state->next_ns, sizeof(next_ns));
+
+  // The synth may have been restarted too, so tell it every endpoint's
+  // voice, volume, and pan again.  Like send_scene_diff(), anything driven
+  // by air or ducking starts from silence and the next tick brings it up.
+  forget_sent_controllers();
+  for (int endpoint = 0; endpoint < N_ENDPOINTS; endpoint++) {
+    send_voice_setting(c, endpoint);
+    psend_midi(MIDI_CC, CC_11,
+               (c->follows_air[endpoint] || c->ducked[endpoint] ||
+                endpoint == ENDPOINT_JAWHARP) ? 0 : MIDI_MAX,
+               endpoint);
+  }
+
+  // The synth is still playing whatever the old jammer left sounding, but
+  // we've lost track of what that was.  Stop it and start the drones again.
+  all_notes_off();
+  for (int scene = 0; scene < N_SCENES; scene++) {
+    for (int endpoint = 0; endpoint < N_ENDPOINTS; endpoint++) {
+      scenes[scene].current_note[endpoint] = -1;
+      scenes[scene].current_fifth[endpoint] = -1;
+      scenes[scene].current_len[endpoint] = -1;
+    }
+  }
+  last_update_bass_note = active_note();
+  update_bass(/*force_refresh=*/true);
+
+  // Carry on with the rest of the bar, if it isn't over.
+  uint64_t current_time = now();
+  int first = 0;
+  while (first < N_SUBBEATS && next_ns[first] < current_time) {
+    next_ns[first++] = 0;
+  }
+  for (int i = 0; i < N_SUBBEATS; i++) {
+    subbeat_events[i] = WHEEL_NONE;
   }
+  if (schedule_bars) {
+    schedule_bar(first);
+  } else {
+    for (int i = first; i < N_SUBBEATS; i++) {
+      subbeat_events[i] = wheel_schedule(&wheel, next_ns[i], fire_subbeat, i);
+    }
+  }
+  start_ducking();
+  start_fading();
 }
 
-void update_air() {
+void update_air(uint64_t n_ticks) {
   // see calculate_breath_speeds()
-  air *= leakage;
-  air += breath * breath_gain;
+  if (n_ticks == 1) {
+    air *= leakage;
+    air += breath * breath_gain;
+  } else {
+    // Same as doing the single tick update n_ticks times, with breath held
+    // constant: the leaked air plus a geometric series of inflations.
+    double leaked = pow(leakage, n_ticks);
+    air = air * leaked + breath * breath_gain * (1 - leaked) / (1 - leakage);
+  }
   if (air > max_air) {
     air = max_air;
   }
@@ -1746,6 +2872,14 @@ void update_air() {
 }
 
 int last_air_val = 0;
+
+// Once breath is zero and the bag has leaked below 1 there's nothing left for
+// forward_air() to send, so we don't need to keep ticking for it.
+bool air_idle() {
+  return breath == 0 && air < 1 && last_air_val == 0 &&
+    flex_val() == last_flex_val;
+}
+
 void forward_air() {
   int val = air;
 
@@ -1774,16 +2908,26 @@ void forward_air() {
 }
 
 int last_duck_val = 0;
-void duck() {
-  bool any_ducked = false;
+
+bool any_ducked() {
   for (int endpoint = 0; endpoint < N_ENDPOINTS; endpoint++) {
     if (c->ducked[endpoint]) {
-      any_ducked = true;
+      return true;
     }
   }
-  if (!any_ducked) return;
+  return false;
+}
 
-  uint64_t current_time = now();
+// After the final trough the curve stays at 0 until the next kick re-anchors
+// it, so there's only something for duck() to do before then.
+bool duck_moving(uint64_t current_time) {
+  if (!any_ducked()) return false;
+  uint64_t peak_to_peak = next_downbeat_ns - last_downbeat_ns;
+  return current_time < next_duck_trough_ns + peak_to_peak;
+}
+
+void duck(uint64_t current_time) {
+  if (!any_ducked()) return;
 
   // Curve ramps down to 0 at next_duck_trough_ns, then up
   // to target_peak at next_duck_peak_ns, and back.  All linear.
@@ -1832,77 +2976,228 @@ void duck() {
   }  
 }
 
-void trigger_subbeats() {
-  uint64_t current_time = now();
-
-  for (int i = 1 /* 0 is triggered by kick directly */; i < N_SUBBEATS; i++) {
-    if (next_ns[i] > 0 && current_time > next_ns[i]) {
-      arpeggiate(i, current_time, /*drone=*/false, /*running=*/true);
-      next_ns[i] = 0;
-    }
+bool should_end_notes() {
+  if (!drum_chooses_notes) return false;
+  if (!c->shortish[ENDPOINT_FOOTBASS] && !c->shorter[ENDPOINT_FOOTBASS]) {
+    return false;
   }
+  return c->last_arpeggiation[ENDPOINT_FOOTBASS] != last_ended_arpeggiation;
 }
 
-void maybe_end_notes() {
-  if (!drum_chooses_notes) return;
-  if (!c->shortish[ENDPOINT_FOOTBASS] && !c->shorter[ENDPOINT_FOOTBASS]) return;
+uint64_t end_notes_ns() {
+  return c->last_arpeggiation[ENDPOINT_FOOTBASS] + end_notes_threshold() + 1;
+}
 
-  int threshold = NS_PER_SEC;
-  if (c->shortish[ENDPOINT_FOOTBASS]) {
-    threshold /= 2;
-  }
-  if (c->shorter[ENDPOINT_FOOTBASS]) {
-    threshold /= 4;
-  }
+void maybe_end_notes(int unused, uint64_t current_time) {
+  end_notes_event = WHEEL_NONE;
+  if (!should_end_notes()) return;
+  PROFILE_BEGIN(PHASE_END_NOTES);
 
-  uint64_t current_time = now();
   //printf("%lld %lld %lld %d\n",
   //       current_time, c->last_arpeggiation[ENDPOINT_FOOTBASS],
   //       current_time - c->last_arpeggiation[ENDPOINT_FOOTBASS],
   //       threshold);
-  if (current_time - c->last_arpeggiation[ENDPOINT_FOOTBASS] > threshold) {
+  if (current_time >= end_notes_ns()) {
     endpoint_notes_off(ENDPOINT_FOOTBASS);
+    last_ended_arpeggiation = c->last_arpeggiation[ENDPOINT_FOOTBASS];
+  } else {
+    // Not yet, or the threshold changed since we were scheduled.
+    end_notes_event = wheel_schedule(&wheel, end_notes_ns(),
+                                     maybe_end_notes, 0);
   }
+  PROFILE_END(PHASE_END_NOTES);
 }
 
-uint64_t tick_n = 0;
-uint64_t subtick_n = 0;
-void jml_tick() {
+// Something maybe_end_notes() depends on has changed, so have it take
+// another look on the next tick.
+void check_end_notes_soon() {
+  wheel_cancel(&wheel, end_notes_event);
+  end_notes_event = wheel_schedule(&wheel, 0, maybe_end_notes, 0);
+}
+
+// We fade from 100 to 0 over 4000ms, so we want to progress every 40ms.
+#define FADE_STEP_NS (40 * 1000000LL)
 
-  // play startup chime
-  if (tick_n == 0) {
-    psend_midi(MIDI_ON, 28, 100, ENDPOINT_LOW);
-  } else if (tick_n == 500) {
-    psend_midi(MIDI_OFF, 28, 100, ENDPOINT_LOW);
-    psend_midi(MIDI_ON, 33, 100, ENDPOINT_LOW);
-  } else if (tick_n == 2000) {
-    psend_midi(MIDI_OFF, 33, 100, ENDPOINT_LOW);
+void fade_step(int unused, uint64_t current_time) {
+  fade_event = WHEEL_NONE;
+  PROFILE_BEGIN(PHASE_FADE);
+  progress_fades();
+  PROFILE_END(PHASE_FADE);
+  if (fade_target != fade_value) {
+    fade_event = wheel_schedule(&wheel, current_time + FADE_STEP_NS,
+                                fade_step, 0);
   }
+}
 
-  // Called every TICK_MS
-  update_air();
-  forward_air();
-  duck();
-  trigger_subbeats();
-  maybe_end_notes();
+void start_fading() {
+  if (wheel_scheduled(&wheel, fade_event)) return;
+  fade_event = wheel_schedule(&wheel, 0, fade_step, 0);
+}
 
-  // We fade from 100 to 0 over 4000ms, so we want to progress every 40 ticks.
-  if (tick_n % 40 == 0) {
-    progress_fades();
+// The duck curve moves continuously, so while it's moving we update it every
+// tick.
+void duck_step(int unused, uint64_t current_time) {
+  duck_event = WHEEL_NONE;
+  PROFILE_BEGIN(PHASE_DUCK);
+  duck(current_time);
+  PROFILE_END(PHASE_DUCK);
+  if (duck_moving(current_time)) {
+    duck_event = wheel_schedule(&wheel, current_time + TICK_NS, duck_step, 0);
   }
+}
 
-  if (++tick_n % 450 == 0) {
+void start_ducking() {
+  if (wheel_scheduled(&wheel, duck_event)) return;
+  duck_event = wheel_schedule(&wheel, 0, duck_step, 0);
+}
+
+// Send a MIDI message at ns.  The message is packed into the event's arg,
+// with the endpoint on top: it's under 16, so arg can't overflow, where
+// action (0x80 and up) could.
+void send_midi_event(int packed, uint64_t current_time) {
+  psend_midi(packed & 0xff, (packed >> 16) & 0xff, (packed >> 8) & 0xff,
+             (packed >> 24) & 0xff);
+}
+
+int schedule_midi(uint64_t ns, int action, int note, int velocity,
+                  int endpoint) {
+  return wheel_schedule(&wheel, ns, send_midi_event,
+                        (endpoint << 24) | ((note & 0xff) << 16) |
+                        ((velocity & 0xff) << 8) | (action & 0xff));
+}
+
+void play_startup_chime(uint64_t current_time) {
+  psend_midi(MIDI_ON, 28, 100, ENDPOINT_LOW);
+  schedule_midi(current_time + 500 * TICK_NS, MIDI_OFF, 28, 100, ENDPOINT_LOW);
+  schedule_midi(current_time + 500 * TICK_NS, MIDI_ON, 33, 100, ENDPOINT_LOW);
+  schedule_midi(current_time + 2000 * TICK_NS, MIDI_OFF, 33, 100,
+                ENDPOINT_LOW);
+}
+
+uint64_t tick_n = 0;
+uint64_t subtick_n = 0;
+uint64_t last_tick_ns = 0;  // when tick number tick_n - 1 ran
+
+#if defined(FAKE_FEET) || defined(FAKE_CHANGE_PITCH)
+#define FAKE_INPUT_NS (450 * TICK_NS)
+
+void fake_input(int unused, uint64_t current_time) {
 #ifdef FAKE_FEET
-    handle_feet(MIDI_ON, MIDI_DRUM_IN_KICK, 100);
+  handle_feet(MIDI_ON, MIDI_DRUM_IN_KICK, 100, current_time);
 #endif
 
 #ifdef FAKE_CHANGE_PITCH
-    if (++subtick_n % 2 == 0) {
-      root_note = to_root(root_note + 1);
-      update_bass(/*force_refresh=*/false);
+  if (++subtick_n % 2 == 0) {
+    root_note = to_root(root_note + 1);
+    update_bass(/*force_refresh=*/false);
+  }
+#endif
+
+  wheel_schedule(&wheel, current_time + FAKE_INPUT_NS, fake_input, 0);
+}
+#endif
+
+// When tick number tick (>= tick_n) is due.
+uint64_t tick_deadline(uint64_t tick) {
+  return last_tick_ns + (tick - tick_n + 1) * TICK_NS;
+}
+
+void advance_ticks(uint64_t n_ticks) {
+  tick_n += n_ticks;
+
+  PROFILE_BEGIN(PHASE_UPDATE_AIR);
+  update_air(n_ticks);
+  PROFILE_END(PHASE_UPDATE_AIR);
+
+  PROFILE_BEGIN(PHASE_FORWARD_AIR);
+  forward_air();
+  PROFILE_END(PHASE_FORWARD_AIR);
+}
+
+// current_time is shared by everything this tick does, so they all agree.
+void jml_tick(uint64_t current_time) {
+  PROFILE_BEGIN(PHASE_TICK);
+
+  // Air is still simulated in whole ticks.  We're not necessarily called
+  // every TICK_MS (see jml_next_deadline()), so catch up on however many
+  // whole ticks have passed since last time.
+  if (last_tick_ns == 0) {
+    last_tick_ns = current_time;
+    if (startup_chime) {
+      play_startup_chime(current_time);
     }
+#if defined(FAKE_FEET) || defined(FAKE_CHANGE_PITCH)
+    wheel_schedule(&wheel, current_time + FAKE_INPUT_NS - TICK_NS,
+                   fake_input, 0);
 #endif
+    advance_ticks(1);
+  } else if (current_time - last_tick_ns >= TICK_NS) {
+    uint64_t n_ticks = (current_time - last_tick_ns) / TICK_NS;
+    last_tick_ns += n_ticks * TICK_NS;
+    advance_ticks(n_ticks);
   }
+
+  PROFILE_BEGIN(PHASE_WHEEL);
+  wheel_run(&wheel, current_time);
+  PROFILE_END(PHASE_WHEEL);
+
+  PROFILE_END(PHASE_TICK);
+}
+
+uint64_t earliest(uint64_t deadline, uint64_t candidate) {
+  if (deadline == 0 || candidate < deadline) {
+    return candidate;
+  }
+  return deadline;
+}
+
+// When jml_tick() next has something to do, or 0 if nothing is pending until
+// the next input event.
+uint64_t jml_next_deadline(uint64_t current_time) {
+  if (last_tick_ns == 0) return current_time;
+
+  uint64_t deadline = wheel_next_deadline(&wheel);
+  if (!air_idle()) {
+    deadline = earliest(deadline, tick_deadline(tick_n));
+  }
+  return deadline;
+}
+
+// When the next subbeat is due, or 0 if none are scheduled.  Unlike
+// jml_next_deadline() this leaves out the breath and ducking ticks, which
+// come every TICK_NS for as long as anyone is playing.
+uint64_t jml_next_subbeat_deadline() {
+  for (int i = 0; i < N_SUBBEATS; i++) {
+    uint64_t deadline = wheel_event_ns(&wheel, subbeat_events[i]);
+    if (deadline != 0) return deadline;
+  }
+  return 0;
+}
+
+void jml_print_stats() {
+  printf("subbeats: %" PRIu64 " sent, mean lateness %.3fms, max %.3fms\n",
+         subbeat_late_n,
+         subbeat_late_n == 0 ? 0 :
+             subbeat_late_total_ns / 1000000.0 / subbeat_late_n,
+         subbeat_late_max_ns / 1000000.0);
+  printf("subbeats: %" PRIu64 " missed their deadline by more than %.3fms\n",
+         subbeat_missed_n, subbeat_late_threshold_ns / 1000000.0);
+  printf("beat tracking: %" PRIu64 " hits followed, mean error %.3fms, "
+         "max %.3fms, %" PRIu64 " relocks\n",
+         beat_followed_n,
+         beat_followed_n == 0 ? 0 :
+             beat_error_total_ns / 1000000.0 / beat_followed_n,
+         beat_error_max_ns / 1000000.0, beat_relock_n);
+  if (hand_off_tempo != NULL) {
+    printf("tempo handoff: %" PRIu64 " estimates, mean %.3fms, max %.3fms, "
+           "%" PRIu64 " subbeats already past\n",
+           tempo_handoff_n,
+           tempo_handoff_n == 0 ? 0 :
+               tempo_handoff_total_ns / 1000000.0 / tempo_handoff_n,
+           tempo_handoff_max_ns / 1000000.0, tempo_handoff_skipped_subbeats);
+  }
+  printf("patterns: %" PRIu64 " compiled\n", n_patterns_compiled);
+  print_wheel_stats("timing wheel", &wheel);
 }
 
 #endif
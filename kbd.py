@@ -64,12 +64,33 @@ keycodes = {
     'KEY_TAB': 'KEY_r', # 114
 }
 
+SCENE_0 = 115  # ctrl+0 through ctrl+9 are 115 through 124
+SCENE_STORE_VELOCITY = 127  # with shift, store instead of switch
+
+def held(side_a, side_b):
+    return modifiers[side_a] or modifiers[side_b]
+
 def handle_key(keycode, midiport):
     global state
     global digit_note_to_send
 
     keycode = keycodes.get(keycode, keycode)
 
+    if (len(keycode) == len('KEY_0') and
+        'KEY_0' <= keycode <= 'KEY_9' and
+        held('KEY_LEFTCTRL', 'KEY_RIGHTCTRL')):
+        pseudo_note = SCENE_0 + int(keycode[-1])
+        if held('KEY_LEFTSHIFT', 'KEY_RIGHTSHIFT'):
+            print("storing scene %s" % keycode[-1])
+            midiport.send(mido.Message('note_on', note=pseudo_note,
+                                       velocity=SCENE_STORE_VELOCITY))
+        else:
+            print("scene %s" % keycode[-1])
+            midiport.send(mido.Message('note_on', note=pseudo_note))
+        digit_note_to_send = None
+        digits_read.clear()
+        return
+
     if (len(keycode) == len('KEY_0') and
         'KEY_0' <= keycode <= 'KEY_9' and
         digit_note_to_send):
@@ -0,0 +1,70 @@
+#ifndef JML_LATENCY_H
+#define JML_LATENCY_H
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+// Log-bucketed latency histograms.  Bucket 0 is under 1us, and bucket n
+// covers [2^(n-1), 2^n) microseconds, so the top bucket starts at about 17s.
+// Recording is a few adds and a count-leading-zeros, with nothing to
+// allocate or lock; each histogram should only be written from one thread.
+
+#define LATENCY_BUCKETS 26
+
+struct Histogram {
+  uint64_t n;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[LATENCY_BUCKETS];
+};
+
+int latency_bucket(uint64_t latency_ns) {
+  uint64_t us = latency_ns / 1000;
+  if (us == 0) return 0;
+  int bucket = 64 - __builtin_clzll(us);
+  return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+void histogram_record(struct Histogram* histogram, uint64_t latency_ns) {
+  histogram->n++;
+  histogram->total_ns += latency_ns;
+  if (latency_ns > histogram->max_ns) {
+    histogram->max_ns = latency_ns;
+  }
+  histogram->buckets[latency_bucket(latency_ns)]++;
+}
+
+// Upper bound of the bucket the p-th fraction of samples falls in.
+uint64_t histogram_percentile_us(struct Histogram* histogram, double p) {
+  uint64_t target = histogram->n * p;
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+    seen += histogram->buckets[bucket];
+    if (seen > target) {
+      return (uint64_t) 1 << bucket;
+    }
+  }
+  return (uint64_t) 1 << (LATENCY_BUCKETS - 1);
+}
+
+void print_histogram(const char* name, struct Histogram* histogram) {
+  if (histogram->n == 0) return;
+
+  printf("%s: %" PRIu64 " events, mean %.3fms, p50 <%" PRIu64 "us, "
+         "p99 <%" PRIu64 "us, max %.3fms\n",
+         name, histogram->n,
+         histogram->total_ns / 1000000.0 / histogram->n,
+         histogram_percentile_us(histogram, 0.5),
+         histogram_percentile_us(histogram, 0.99),
+         histogram->max_ns / 1000000.0);
+  for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+    if (histogram->buckets[bucket] == 0) continue;
+    printf("  %8" PRIu64 "us - %8" PRIu64 "us: %" PRIu64 "\n",
+           bucket == 0 ? 0 : (uint64_t) 1 << (bucket - 1),
+           (uint64_t) 1 << bucket,
+           histogram->buckets[bucket]);
+  }
+}
+
+#endif
@@ -4,7 +4,19 @@
 #include <stdbool.h>
 #include <time.h>
 #include <math.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include "common.h"
+#include "ring.h"
+#include "latency.h"
+#include "stats.h"
+#include "log.h"
+#include "controllers.h"
 
 int attempt(int result, char* errmsg) {
   if (result < 0) {
@@ -14,14 +26,156 @@ int attempt(int result, char* errmsg) {
   return result;
 }
 
+// Not CLOCK_MONOTONIC_COARSE: deadlines computed from this are handed to a
+// CLOCK_MONOTONIC timerfd, and the coarse clock can lag that by a whole jiffy.
 uint64_t now() {
   struct timespec ts;
-  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
   return (ts.tv_sec * 1000000000LL) + ts.tv_nsec;
 }
 
+// Arm timer_fd to fire at deadline_ns on the now() clock, or disarm it if
+// deadline_ns is 0.
+void arm_timer(int timer_fd, uint64_t deadline_ns) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = deadline_ns / 1000000000LL;
+  spec.it_value.tv_nsec = deadline_ns % 1000000000LL;
+  attempt(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL),
+          "arm timer");
+}
+
+// How much stack and heap to touch up front so we don't take page faults
+// once we're running.
+#define PREFAULT_STACK_BYTES (512 * 1024)
+#define PREFAULT_HEAP_BYTES (4 * 1024 * 1024)
+
+void prefault_stack() {
+  volatile unsigned char stack[PREFAULT_STACK_BYTES];
+  for (int i = 0; i < PREFAULT_STACK_BYTES; i += 4096) {
+    stack[i] = 0;
+  }
+  (void) stack[0];
+}
+
+// Keep the calling thread on one core.
+void pin_to_cpu(int cpu) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  attempt(sched_setaffinity(0, sizeof(cpus), &cpus), "pin to cpu");
+}
+
+// What go_realtime() gave the engine thread.  Threads inherit their
+// creator's scheduling, so start_thread() uses these to keep the others from
+// competing with the engine on its core at its priority.
+int engine_priority = 0;  // 0 if we're not real-time
+cpu_set_t other_cpus;     // where threads that aren't the engine run
+
+// Lock and prefault memory, switch the calling thread to SCHED_FIFO at
+// priority, and, if cpu isn't -1, pin it to that core.
+void go_realtime(int priority, int cpu) {
+  // Keep freed heap mapped instead of handing it back to the kernel, so once
+  // it's been touched and locked it stays that way.
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+  attempt(mlockall(MCL_CURRENT | MCL_FUTURE), "lock memory");
+
+  prefault_stack();
+  unsigned char* heap = malloc(PREFAULT_HEAP_BYTES);
+  for (int i = 0; i < PREFAULT_HEAP_BYTES; i += 4096) {
+    heap[i] = 0;
+  }
+  free(heap);
+
+  attempt(sched_getaffinity(0, sizeof(other_cpus), &other_cpus),
+          "get affinity");
+  if (cpu != -1) {
+    if (CPU_COUNT(&other_cpus) > 1) {
+      CPU_CLR(cpu, &other_cpus);
+    }
+    pin_to_cpu(cpu);
+  }
+
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = priority;
+  attempt(sched_setscheduler(0, SCHED_FIFO, &param), "set SCHED_FIFO");
+
+  printf("running SCHED_FIFO at priority %d", priority);
+  if (cpu != -1) {
+    printf(" on cpu %d", cpu);
+  }
+  printf(" with memory locked\n");
+  engine_priority = priority;
+}
+
+// Start a thread that isn't the engine.  Once we're real-time it runs off
+// the engine's core, and if realtime just below the engine's priority,
+// otherwise at normal priority.  Before that it's like pthread_create().
+pthread_t start_thread(void* (*run)(void*), bool realtime, char* what) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (engine_priority > 0) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    if (realtime) {
+      pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+      param.sched_priority = engine_priority > 1 ? engine_priority - 1 : 1;
+    } else {
+      pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    }
+    pthread_attr_setschedparam(&attr, &param);
+    pthread_attr_setaffinity_np(&attr, sizeof(other_cpus), &other_cpus);
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, &attr, run, NULL) != 0) {
+    die(what);
+  }
+  pthread_attr_destroy(&attr);
+  return thread;
+}
+
 snd_seq_t* seq;
 
+// Queue for timestamping input and for sending events ahead of time.
+int queue = -1;
+// now() at queue time zero.
+uint64_t queue_start_ns = 0;
+
+// If nonzero, send_midi() schedules its event on the queue to go out at this
+// now() time instead of sending it immediately.
+uint64_t send_at_ns = 0;
+
+void setup_queue() {
+  queue = attempt(snd_seq_alloc_named_queue(seq, "jammer"), "alloc queue");
+  attempt(snd_seq_start_queue(seq, queue, NULL), "start queue");
+  attempt(snd_seq_drain_output(seq), "drain queue start");
+
+  snd_seq_queue_status_t* status;
+  attempt(snd_seq_queue_status_malloc(&status), "alloc queue status");
+  attempt(snd_seq_get_queue_status(seq, queue, status), "get queue status");
+  const snd_seq_real_time_t* queue_time =
+    snd_seq_queue_status_get_real_time(status);
+  queue_start_ns =
+    now() - (queue_time->tv_sec * 1000000000LL + queue_time->tv_nsec);
+  snd_seq_queue_status_free(status);
+}
+
+// When event reached our port.  Our input ports have the kernel stamp events
+// with the queue's real time on arrival, which is more accurate than when we
+// got around to reading them.  Fall back to now() for unstamped events.
+uint64_t event_arrival_ns(const snd_seq_event_t* event) {
+  if (queue < 0 || event->queue != queue ||
+      (event->flags & SND_SEQ_TIME_STAMP_MASK) != SND_SEQ_TIME_STAMP_REAL) {
+    return now();
+  }
+  return queue_start_ns + event->time.time.tv_sec * 1000000000LL +
+    event->time.time.tv_nsec;
+}
+
 void reset_event(snd_seq_event_t* ev) {
   snd_seq_ev_clear(ev);
   snd_seq_ev_set_source(ev, 0);
@@ -31,42 +185,283 @@ void reset_event(snd_seq_event_t* ev) {
   ev->flags = SND_SEQ_TIME_STAMP_REAL;
 }
 
-void send_midi(int action, int note, int velocity, int endpoint) {
-  if (note < 0) note = 0;
-  if (note > 127) note = 127;
+void really_cancel_scheduled_midi() {
+  snd_seq_remove_events_t* remove;
+  attempt(snd_seq_remove_events_malloc(&remove), "alloc remove events");
+  snd_seq_remove_events_set_condition(remove, SND_SEQ_REMOVE_OUTPUT);
+  snd_seq_remove_events_set_queue(remove, queue);
+  attempt(snd_seq_remove_events(seq, remove), "remove scheduled events");
+  snd_seq_remove_events_free(remove);
+}
 
-  if (velocity < 0) velocity = 0;
-  if (velocity > 127) velocity = 127;
+// With batch_output, output_record() only fills alsa-lib's output buffer and
+// drain_midi() sends everything in one write at the end of each batch.
+bool batch_output = false;
+int n_buffered = 0;
 
+uint64_t n_flushes = 0;
+uint64_t n_flushed_messages = 0;
+uint64_t max_flushed_messages = 0;
+uint64_t total_flush_ns = 0;
+uint64_t max_flush_ns = 0;
 
-  int channel = endpoint;
-  //printf("sending %d %d %d %d\n", action, channel, note, velocity);
+void drain_midi() {
+  if (n_buffered == 0) return;
+
+  uint64_t start_ns = now();
+  int result = snd_seq_drain_output(seq);
+  uint64_t flush_ns = now() - start_ns;
+  if (result < 0) {
+    jlog(LOG_ERROR, "failed to drain %d events (err=%d)\n", n_buffered,
+         result);
+  }
+
+  n_flushes++;
+  n_flushed_messages += n_buffered;
+  if (n_buffered > max_flushed_messages) {
+    max_flushed_messages = n_buffered;
+  }
+  total_flush_ns += flush_ns;
+  if (flush_ns > max_flush_ns) {
+    max_flush_ns = flush_ns;
+  }
+  n_buffered = 0;
+}
+
+void print_output_stats() {
+  if (!batch_output) return;
+  printf("output: %" PRIu64 " flushes, %.1f messages per flush (max %" PRIu64
+         "), %.3fms per flush (max %.3fms)\n",
+         n_flushes,
+         n_flushes == 0 ? 0 : 1.0 * n_flushed_messages / n_flushes,
+         max_flushed_messages,
+         n_flushes == 0 ? 0 : total_flush_ns / 1000000.0 / n_flushes,
+         max_flush_ns / 1000000.0);
+}
+
+// Which kind of input the engine is responding to, and when it arrived.
+// jammer.c sets these while it handles each input event, and send_midi()
+// copies them onto whatever that sends so output_record() can time it.
+int cause_source = SOURCE_NONE;
+uint64_t cause_ns = 0;
+
+void record_latency(const struct MidiRecord* record) {
+  if (record->cause_ns == 0) return;
+
+  uint64_t current_time = now();
+  uint64_t latency_ns = current_time > record->cause_ns ?
+    current_time - record->cause_ns : 0;
+  histogram_record(&stats->source_latency[record->source], latency_ns);
+  if (record->channel < N_ENDPOINTS) {
+    histogram_record(&stats->endpoint_latency[record->channel], latency_ns);
+  }
+}
+
+void print_latency_stats() {
+  char name[64];
+  for (int source = 1; source < N_SOURCES; source++) {
+    snprintf(name, sizeof(name), "latency from %s", source_names[source]);
+    print_histogram(name, &stats->source_latency[source]);
+  }
+  for (int endpoint = 0; endpoint < N_ENDPOINTS; endpoint++) {
+    snprintf(name, sizeof(name), "latency to endpoint %d", endpoint);
+    print_histogram(name, &stats->endpoint_latency[endpoint]);
+  }
+}
+
+// Hand a record to ALSA.  With output_threaded only the output thread calls
+// this.
+void output_record(const struct MidiRecord* record) {
+  if (record->action == MIDI_CANCEL_SCHEDULED) {
+    really_cancel_scheduled_midi();
+    return;
+  }
 
   snd_seq_event_t ev;
   reset_event(&ev);
 
   const char* friendly_action;
-  if (action == MIDI_CC) {
-    snd_seq_ev_set_controller(&ev, channel, note, velocity);
+  if (record->action == MIDI_CC) {
+    snd_seq_ev_set_controller(&ev, record->channel, record->note,
+                              record->value);
     friendly_action = "cc";
-  } else if (action == MIDI_ON) {
-    snd_seq_ev_set_noteon(&ev, channel, note, velocity);
+  } else if (record->action == MIDI_ON) {
+    snd_seq_ev_set_noteon(&ev, record->channel, record->note, record->value);
     friendly_action = "on";
-  } else if (action == MIDI_OFF) {
-    snd_seq_ev_set_noteoff(&ev, channel, note, velocity);
+  } else if (record->action == MIDI_OFF) {
+    snd_seq_ev_set_noteoff(&ev, record->channel, record->note, record->value);
     friendly_action = "off";
+  } else if (record->action == MIDI_PROGRAM) {
+    snd_seq_ev_set_pgmchange(&ev, record->channel, record->note);
+    friendly_action = "program";
   } else {
-    printf("unknown action %d\n", action);
+    jlog(LOG_ERROR, "unknown action %d\n", record->action);
     return;
   }
 
-  int result = snd_seq_event_output_direct(seq, &ev);
+  if (record->ns > 0 && queue >= 0) {
+    uint64_t queue_ns = record->ns > queue_start_ns ?
+      record->ns - queue_start_ns : 0;
+    snd_seq_real_time_t time;
+    time.tv_sec = queue_ns / 1000000000LL;
+    time.tv_nsec = queue_ns % 1000000000LL;
+    snd_seq_ev_schedule_real(&ev, queue, /*relative=*/0, &time);
+  }
+
+  int result;
+  if (batch_output) {
+    result = snd_seq_event_output(seq, &ev);
+    if (result >= 0) {
+      n_buffered++;
+    }
+  } else {
+    result = snd_seq_event_output_direct(seq, &ev);
+  }
   if (result < 0) {
-    printf("dropped %s %d %d %d (err=%d)\n",
-           friendly_action, channel, note, velocity, result);
+    stats->n_send_errors++;
+    jlog(LOG_ERROR, "dropped %s %d %d %d (err=%d)\n",
+         friendly_action, record->channel, record->note, record->value,
+         result);
+    return;
+  }
+  stats->n_sent++;
+  record_latency(record);
+}
+
+// With output_threaded, send_midi() and friends leave their records on
+// output_ring for the output thread instead of writing to ALSA themselves.
+bool output_threaded = false;
+struct Ring output_ring;
+int output_wake_fd = -1;
+bool output_pending = false;
+
+void wake_fd(int fd) {
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) < 0) {
+    // The counter can only overflow if nobody is reading, so ignore.
+  }
+}
+
+void wait_fd(int fd) {
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) < 0) {
+    // Spurious wakeups are fine.
+  }
+}
+
+void emit_record(const struct MidiRecord* record) {
+  if (output_threaded) {
+    // If the ring is full this is dropped, and counted in n_full.
+    if (!ring_push(&output_ring, record)) {
+      stats->n_output_ring_full++;
+    }
+    output_pending = true;
+    return;
+  }
+  output_record(record);
+}
+
+void emit_controller(int channel, int controller, int value) {
+  struct MidiRecord record;
+  memset(&record, 0, sizeof(record));
+  record.source = pending_controller_sources[channel][controller];
+  record.cause_ns = pending_controller_causes[channel][controller];
+  record.action = MIDI_CC;
+  record.channel = channel;
+  record.note = controller;
+  record.value = value;
+  emit_record(&record);
+}
+
+// Called after each batch of work: send what we've buffered, or let the
+// output thread know there's something for it.
+void flush_midi() {
+  flush_controllers();
+  if (!output_threaded) {
+    drain_midi();
+  } else if (output_pending) {
+    wake_fd(output_wake_fd);
+    output_pending = false;
   }
 }
 
+pthread_t output_thread_id;
+bool output_stopping = false;
+
+void* output_thread(void* unused) {
+  while (true) {
+    wait_fd(output_wake_fd);
+    // Checked before emptying the ring, so once we see it we also see
+    // everything pushed before it.
+    bool stopping = __atomic_load_n(&output_stopping, __ATOMIC_ACQUIRE);
+    struct MidiRecord record;
+    while (ring_pop(&output_ring, &record)) {
+      output_record(&record);
+    }
+    drain_midi();
+    if (stopping) return NULL;
+  }
+}
+
+void start_output_thread() {
+  ring_init(&output_ring, 4096, sizeof(struct MidiRecord));
+  output_wake_fd = attempt(eventfd(0, 0), "create output eventfd");
+  output_threaded = true;
+  output_thread_id = start_thread(output_thread, /*realtime=*/true,
+                                  "start output thread");
+}
+
+// Have the output thread send everything we've given it and exit, and then
+// send directly from here on.  Only once it's gone is seq ours again.
+void stop_output_thread() {
+  if (!output_threaded) return;
+  flush_midi();
+  __atomic_store_n(&output_stopping, true, __ATOMIC_RELEASE);
+  wake_fd(output_wake_fd);
+  pthread_join(output_thread_id, NULL);
+  output_threaded = false;
+}
+
+// Drop anything we've scheduled that the queue hasn't delivered yet.
+void cancel_scheduled_midi() {
+  if (queue < 0) return;
+
+  struct MidiRecord record;
+  memset(&record, 0, sizeof(record));
+  record.action = MIDI_CANCEL_SCHEDULED;
+  emit_record(&record);
+}
+
+void send_midi(int action, int note, int velocity, int endpoint) {
+  if (note < 0) note = 0;
+  if (note > 127) note = 127;
+
+  if (velocity < 0) velocity = 0;
+  if (velocity > 127) velocity = 127;
+
+
+  int channel = endpoint;
+  //printf("sending %d %d %d %d\n", action, channel, note, velocity);
+
+  if (hold_controller(action, channel, note, velocity)) return;
+
+  struct MidiRecord record;
+  memset(&record, 0, sizeof(record));
+  record.ns = send_at_ns;
+  // Breath only reaches the output through controllers; anything else sent
+  // on the tick after it is there for some other reason.
+  if (send_at_ns == 0 &&
+      (cause_source != SOURCE_BREATH || action == MIDI_CC)) {
+    record.source = cause_source;
+    record.cause_ns = cause_ns;
+  }
+  record.action = action;
+  record.channel = channel;
+  record.note = note;
+  record.value = velocity;
+  emit_record(&record);
+}
+
 void choose_voice(int channel, int bank, int voice) {
   if (bank < 0) bank = 0;
   if (bank > 127) bank = 127;
@@ -74,16 +469,17 @@ void choose_voice(int channel, int bank, int voice) {
   if (voice > 127) voice = 127;
 
   // bank select doesn't seem to work, though
-  printf("selecting voice %d-%d for channel %d\n", bank, voice, channel);
+  jlog(LOG_INFO, "selecting voice %d-%d for channel %d\n", bank, voice,
+       channel);
   send_midi(MIDI_CC, CC_BANK_SELECT, bank, channel);
 
-  snd_seq_event_t ev;
-  reset_event(&ev);
-  snd_seq_ev_set_pgmchange(&ev, channel, voice);
-  attempt(snd_seq_event_output_direct(seq, &ev), "send event");
-  printf("set endpoint #%d to voice %d\n", channel, voice);
+  struct MidiRecord record;
+  memset(&record, 0, sizeof(record));
+  record.action = MIDI_PROGRAM;
+  record.channel = channel;
+  record.note = voice;
+  emit_record(&record);
+  jlog(LOG_INFO, "set endpoint #%d to voice %d\n", channel, voice);
 }
 
-
-
 #endif
@@ -0,0 +1,269 @@
+#ifndef JML_LOG_H
+#define JML_LOG_H
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "common.h"
+
+// Logging that's safe to call from the real-time path.  jlog() doesn't
+// format anything or make any syscalls: it copies the format string pointer
+// and its arguments into a fixed-size record on a lock-free ring, and a
+// background thread formats and writes them.  Any thread may log.
+//
+// Because formatting happens later, %s arguments must point to something
+// that will still be there: string literals or other static storage.
+//
+// Until start_logger() is called, or if it isn't, jlog() just prints.
+
+// In linuxapi.h, or simapi.h for the sim.
+pthread_t start_thread(void* (*run)(void*), bool realtime, char* what);
+
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#define N_LOG_LEVELS 4
+
+// Messages above this level are dropped before they're recorded.  Safe to
+// change from anywhere at any time, including a signal handler.
+volatile int log_level = LOG_INFO;
+
+const char* log_level_names[N_LOG_LEVELS] = {"error", "warn", "info", "debug"};
+
+#define LOG_MAX_ARGS 8
+#define LOG_CAPACITY 1024  // must be a power of two
+
+union LogArg {
+  int64_t i;
+  double d;
+  const void* p;
+};
+
+struct LogRecord {
+  // Which lap of the ring this record is ready for, as in Dmitry Vyukov's
+  // bounded MPMC queue.
+  uint64_t sequence;
+  const char* format;
+  int n_args;
+  union LogArg args[LOG_MAX_ARGS];
+};
+
+struct Logger {
+  uint64_t enqueue_pos __attribute__((aligned(64)));
+  uint64_t dequeue_pos __attribute__((aligned(64)));
+  uint64_t n_overflows __attribute__((aligned(64)));
+  struct LogRecord records[LOG_CAPACITY];
+};
+
+struct Logger logger;
+bool logger_running = false;
+
+// Fill types with the type each of format's conversions takes: 'i' for int,
+// 'l' for long, 'L' for long long, 'd' for double, and 'p' for pointers.
+// Returns the number of conversions.
+int log_conversions(const char* format, char* types) {
+  int n = 0;
+  for (const char* c = format; *c; c++) {
+    if (*c != '%') continue;
+    c++;
+    if (*c == '%') continue;
+    while (*c && strchr("-+ #0123456789.*", *c)) c++;
+    int longs = 0;
+    while (*c && strchr("hlqjzt", *c)) {
+      if (*c == 'l') longs++;
+      if (*c == 'q' || *c == 'j') longs = 2;
+      c++;
+    }
+    if (!*c) break;
+
+    char type;
+    if (strchr("fFeEgGaA", *c)) {
+      type = 'd';
+    } else if (*c == 's' || *c == 'p') {
+      type = 'p';
+    } else {
+      type = longs == 0 ? 'i' : longs == 1 ? 'l' : 'L';
+    }
+    if (n < LOG_MAX_ARGS) {
+      types[n] = type;
+    }
+    n++;
+  }
+  return n;
+}
+
+void jlog(int level, const char* format, ...) {
+  if (level > log_level) return;
+
+  va_list ap;
+  va_start(ap, format);
+
+  if (!logger_running) {
+    vprintf(format, ap);
+    va_end(ap);
+    return;
+  }
+
+  uint64_t pos = __atomic_load_n(&logger.enqueue_pos, __ATOMIC_RELAXED);
+  struct LogRecord* record;
+  while (true) {
+    record = &logger.records[pos & (LOG_CAPACITY - 1)];
+    uint64_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+    int64_t lap = (int64_t) (sequence - pos);
+    if (lap == 0) {
+      if (__atomic_compare_exchange_n(&logger.enqueue_pos, &pos, pos + 1,
+                                      /*weak=*/true, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (lap < 0) {
+      // Full.
+      __atomic_fetch_add(&logger.n_overflows, 1, __ATOMIC_RELAXED);
+      va_end(ap);
+      return;
+    } else {
+      pos = __atomic_load_n(&logger.enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  char types[LOG_MAX_ARGS];
+  int n_args = log_conversions(format, types);
+  if (n_args > LOG_MAX_ARGS) n_args = LOG_MAX_ARGS;
+  for (int i = 0; i < n_args; i++) {
+    switch (types[i]) {
+    case 'i': record->args[i].i = va_arg(ap, int); break;
+    case 'l': record->args[i].i = va_arg(ap, long); break;
+    case 'L': record->args[i].i = va_arg(ap, long long); break;
+    case 'd': record->args[i].d = va_arg(ap, double); break;
+    case 'p': record->args[i].p = va_arg(ap, const void*); break;
+    }
+  }
+  va_end(ap);
+  record->format = format;
+  record->n_args = n_args;
+  __atomic_store_n(&record->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Format record the way printf would have.
+void log_format(const struct LogRecord* record, char* out, size_t size) {
+  char types[LOG_MAX_ARGS];
+  log_conversions(record->format, types);
+
+  size_t used = 0;
+  int arg = 0;
+  const char* c = record->format;
+  while (*c && used + 1 < size) {
+    if (*c != '%') {
+      out[used++] = *c++;
+      continue;
+    }
+    if (c[1] == '%') {
+      out[used++] = '%';
+      c += 2;
+      continue;
+    }
+
+    // Copy out just this conversion and format it on its own.
+    const char* start = c++;
+    while (*c && !strchr("diouxXcfFeEgGaAsp", *c)) c++;
+    if (*c) c++;
+    char spec[32];
+    size_t spec_len = c - start;
+    if (spec_len >= sizeof(spec)) spec_len = sizeof(spec) - 1;
+    memcpy(spec, start, spec_len);
+    spec[spec_len] = '\0';
+
+    int n = 0;
+    if (arg < record->n_args) {
+      const union LogArg* value = &record->args[arg];
+      switch (types[arg]) {
+      case 'i': n = snprintf(out + used, size - used, spec, (int) value->i);
+        break;
+      case 'l': n = snprintf(out + used, size - used, spec, (long) value->i);
+        break;
+      case 'L':
+        n = snprintf(out + used, size - used, spec, (long long) value->i);
+        break;
+      case 'd': n = snprintf(out + used, size - used, spec, value->d); break;
+      case 'p': n = snprintf(out + used, size - used, spec, value->p); break;
+      }
+    }
+    arg++;
+    if (n > 0) {
+      used += n;
+      if (used >= size) used = size - 1;
+    }
+  }
+  out[used] = '\0';
+}
+
+// Format and write whatever has been logged.  Returns whether there was
+// anything.
+bool drain_log() {
+  bool any = false;
+  uint64_t pos = __atomic_load_n(&logger.dequeue_pos, __ATOMIC_RELAXED);
+  while (true) {
+    struct LogRecord* record = &logger.records[pos & (LOG_CAPACITY - 1)];
+    uint64_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+    int64_t lap = (int64_t) (sequence - (pos + 1));
+    if (lap < 0) break;  // empty
+    if (lap > 0) {
+      pos = __atomic_load_n(&logger.dequeue_pos, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (!__atomic_compare_exchange_n(&logger.dequeue_pos, &pos, pos + 1,
+                                     /*weak=*/true, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED)) {
+      continue;
+    }
+
+    char line[512];
+    log_format(record, line, sizeof(line));
+    __atomic_store_n(&record->sequence, pos + LOG_CAPACITY, __ATOMIC_RELEASE);
+    fputs(line, stdout);
+    any = true;
+    pos++;
+  }
+  if (any) {
+    fflush(stdout);
+  }
+  return any;
+}
+
+void* logger_thread(void* unused) {
+  while (true) {
+    if (!drain_log()) {
+      usleep(10000);
+    }
+  }
+  return NULL;
+}
+
+// The logger thread is never real-time, and once we are it stays off the
+// engine's core.
+void start_logger() {
+  for (uint64_t i = 0; i < LOG_CAPACITY; i++) {
+    logger.records[i].sequence = i;
+  }
+  logger.enqueue_pos = 0;
+  logger.dequeue_pos = 0;
+  logger.n_overflows = 0;
+
+  start_thread(logger_thread, /*realtime=*/false, "start logger thread");
+  logger_running = true;
+}
+
+void print_log_stats() {
+  if (!logger_running) return;
+  drain_log();
+  printf("log: %" PRIu64 " messages dropped because the ring was full\n",
+         __atomic_load_n(&logger.n_overflows, __ATOMIC_RELAXED));
+}
+
+#endif
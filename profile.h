@@ -0,0 +1,201 @@
+#ifndef JML_PROFILE_H
+#define JML_PROFILE_H
+
+// Per-phase profiling of the engine, for finding what's eating the tick
+// budget.  Build with -DJML_PROFILE (make jammer-profile) to turn it on;
+// otherwise all of this compiles to nothing.
+//
+// Each phase is timed with the CLOCK_MONOTONIC clock and, where the kernel
+// lets us, CPU cycle and instruction counters from perf_event_open(2).  We
+// keep min/mean/max and a log2 histogram for p99 per phase, and print them
+// with print_profile() (on SIGUSR1 and at exit).
+
+#define PHASE_TICK 0
+#define PHASE_UPDATE_AIR 1
+#define PHASE_FORWARD_AIR 2
+#define PHASE_WHEEL 3
+#define PHASE_SUBBEAT 4
+#define PHASE_END_NOTES 5
+#define PHASE_FADE 6
+#define PHASE_DUCK 7
+#define PHASE_HANDLE_EVENT 8
+#define N_PHASES 9
+
+#ifdef JML_PROFILE
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+const char* phase_names[N_PHASES] = {
+  "tick", "update_air", "forward_air", "wheel", "subbeat", "end_notes",
+  "fade", "duck", "handle_event"};
+
+#define PROFILE_BUCKETS 64
+
+struct PhaseCounter {
+  uint64_t n;
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[PROFILE_BUCKETS];
+};
+
+struct PhaseProfile {
+  struct PhaseCounter ns;
+  struct PhaseCounter cycles;
+  struct PhaseCounter instructions;
+};
+
+struct PhaseProfile phase_profiles[N_PHASES];
+// The tick budget: jml_tick() should be done well inside a millisecond.
+#define PROFILE_TICK_BUDGET_NS 1000000
+uint64_t profile_overruns = 0;  // ticks that went over the budget
+
+// Group leader counts cycles, and instructions hang off it so one read()
+// gets both.  -1 if perf_event_open() isn't allowed here.
+int profile_fd = -1;
+
+struct ProfileSample {
+  uint64_t ns;
+  bool counted;  // whether cycles and instructions were read
+  uint64_t cycles;
+  uint64_t instructions;
+};
+
+int open_counter(uint64_t config, int group_fd) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.disabled = group_fd == -1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  // This thread, on any CPU.
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+// Call from the engine thread, since the counters only follow the thread
+// that opens them.
+void profile_init() {
+  profile_fd = open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+  if (profile_fd < 0) {
+    perror("perf_event_open");
+    printf("profiling with the clock only\n");
+    return;
+  }
+  if (open_counter(PERF_COUNT_HW_INSTRUCTIONS, profile_fd) < 0) {
+    perror("perf_event_open instructions");
+  }
+  ioctl(profile_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(profile_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+struct ProfileSample profile_begin() {
+  struct ProfileSample sample;
+  memset(&sample, 0, sizeof(sample));
+  if (profile_fd >= 0) {
+    uint64_t values[3];  // number of counters, cycles, instructions
+    memset(values, 0, sizeof(values));
+    // At least the count and cycles, even if instructions wouldn't open.
+    if (read(profile_fd, values, sizeof(values)) >=
+        (ssize_t) (2 * sizeof(uint64_t))) {
+      sample.counted = true;
+      sample.cycles = values[1];
+      sample.instructions = values[2];
+    }
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  sample.ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  return sample;
+}
+
+void count_phase(struct PhaseCounter* counter, uint64_t value) {
+  if (counter->n == 0 || value < counter->min) {
+    counter->min = value;
+  }
+  if (value > counter->max) {
+    counter->max = value;
+  }
+  counter->n++;
+  counter->total += value;
+  int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+  counter->buckets[bucket < PROFILE_BUCKETS ? bucket : PROFILE_BUCKETS - 1]++;
+}
+
+void profile_end(int phase, const struct ProfileSample* start) {
+  struct ProfileSample end = profile_begin();
+  struct PhaseProfile* profile = &phase_profiles[phase];
+  uint64_t ns = end.ns - start->ns;
+  count_phase(&profile->ns, ns);
+  // If either read failed the difference is meaningless, and likely huge.
+  if (start->counted && end.counted) {
+    count_phase(&profile->cycles, end.cycles - start->cycles);
+    count_phase(&profile->instructions,
+                end.instructions - start->instructions);
+  }
+  if (phase == PHASE_TICK && ns > PROFILE_TICK_BUDGET_NS) {
+    profile_overruns++;
+  }
+}
+
+// Upper bound of the bucket holding the 99th percentile.
+uint64_t phase_p99(struct PhaseCounter* counter) {
+  uint64_t target = counter->n * 0.99;
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+    seen += counter->buckets[bucket];
+    if (seen > target) {
+      return bucket == 0 ? 0 : ((uint64_t) 1 << bucket) - 1;
+    }
+  }
+  return counter->max;
+}
+
+void print_phase_counter(const char* unit, struct PhaseCounter* counter) {
+  printf("    %-12s min %" PRIu64 ", mean %" PRIu64 ", p99 <=%" PRIu64
+         ", max %" PRIu64 "\n",
+         unit, counter->min, counter->total / counter->n, phase_p99(counter),
+         counter->max);
+}
+
+void print_profile() {
+  for (int phase = 0; phase < N_PHASES; phase++) {
+    struct PhaseProfile* profile = &phase_profiles[phase];
+    if (profile->ns.n == 0) continue;
+    printf("profile %s: %" PRIu64 " runs\n", phase_names[phase],
+           profile->ns.n);
+    print_phase_counter("ns", &profile->ns);
+    if (profile->cycles.n > 0) {
+      print_phase_counter("cycles", &profile->cycles);
+      print_phase_counter("instructions", &profile->instructions);
+    }
+  }
+  printf("profile: %" PRIu64 " ticks took longer than %.3fms\n",
+         profile_overruns, PROFILE_TICK_BUDGET_NS / 1000000.0);
+}
+
+#define PROFILE_BEGIN(phase) \
+  struct ProfileSample profile_##phase = profile_begin()
+#define PROFILE_END(phase) profile_end(phase, &profile_##phase)
+
+#else
+
+#define profile_init()
+#define print_profile()
+#define PROFILE_BEGIN(phase)
+#define PROFILE_END(phase)
+
+#endif
+
+#endif
@@ -0,0 +1,317 @@
+#ifndef JML_RIG_H
+#define JML_RIG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+// The rig: which ALSA ports are which device, how loud each voice is, and
+// what each keypad key does.  jammermidilib.h fills in the defaults
+// (default_rig()), and a config file, read at startup and again whenever it
+// changes, overrides them a line at a time:
+//
+//   port ROLE NAME        # a port whose name contains NAME is ROLE
+//   volume VOICE VOLUME   # CC 7 for VOICE (0 to 127) before adjustments
+//   key KEY ACTION [ARG]  # what KEY does; "none" to do nothing
+//   drum-key KEY KIT      # what KEY does instead when drums are selected
+//
+// Roles are port_role_names.  Keys are a single character, or one of
+// key_names for the keys kbd.py sends as something else.  Actions are
+// key_action_names, and the ones that take an argument take a number, an
+// endpoint, or a mode (see key_action_args).  Kits are kit_names.  "#"
+// starts a comment.  `jammer-sim --print-config` prints the defaults in this
+// format.
+
+#define PORT_SYNTH 0
+#define PORT_AXIS49 1
+#define PORT_KEYBOARD 2
+#define PORT_BREATH 3
+#define PORT_FEET 4
+#define PORT_KEYPAD 5
+#define N_PORT_ROLES 6
+
+const char* port_role_names[N_PORT_ROLES] = {
+  "synth", "axis49", "keyboard", "breath", "feet", "keypad"};
+
+#define KEY_ACTION_NONE 0
+#define KEY_ACTION_MANUAL_VOLUME 1  // set the voice's volume to the velocity
+#define KEY_ACTION_RESET 2
+#define KEY_ACTION_CLEAR 3          // the selected endpoint
+#define KEY_ACTION_PAN 4
+#define KEY_ACTION_VOLUME 5         // change the endpoint's volume by ARG
+#define KEY_ACTION_SELECT 6         // endpoint ARG
+#define KEY_ACTION_TOGGLE 7         // endpoint ARG on or off
+#define KEY_ACTION_DOWNBEAT 8
+#define KEY_ACTION_UPBEAT 9
+#define KEY_ACTION_DOUBLED 10
+#define KEY_ACTION_PRE_UNIQUE 11
+#define KEY_ACTION_OCTAVE 12        // change the endpoint's octave by ARG
+#define KEY_ACTION_UPBEAT_HIGH 13
+#define KEY_ACTION_SHORTISH 14
+#define KEY_ACTION_SHORTER 15
+#define KEY_ACTION_CHORD 16
+#define KEY_ACTION_VEL 17
+#define KEY_ACTION_FADE 18
+#define KEY_ACTION_DUCKED 19
+#define KEY_ACTION_DRUM_CHOOSES_SOME_NOTES 20
+#define KEY_ACTION_AIR_LOCKED 21
+#define KEY_ACTION_FOLLOWS_AIR 22
+#define KEY_ACTION_JIG_TIME 23
+#define KEY_ACTION_ALL_DRUMS_DOWNBEAT 24
+#define KEY_ACTION_DRUM_CHOOSES_NOTES 25
+#define KEY_ACTION_MODE 26          // mode ARG
+#define KEY_ACTION_ROOT 27          // the root is the velocity
+#define KEY_ACTION_VOICE 28         // voice ARG for the selected endpoint
+#define N_KEY_ACTIONS 29
+
+const char* key_action_names[N_KEY_ACTIONS] = {
+  "none", "manual-volume", "reset", "clear", "pan", "volume", "select",
+  "toggle", "downbeat", "upbeat", "doubled", "pre-unique", "octave",
+  "upbeat-high", "shortish", "shorter", "chord", "vel", "fade", "ducked",
+  "drum-chooses-some-notes", "air-locked", "follows-air", "jig-time",
+  "all-drums-downbeat", "drum-chooses-notes", "mode", "root", "voice"};
+
+#define ARG_NONE 0
+#define ARG_NUMBER 1
+#define ARG_ENDPOINT 2
+#define ARG_MODE 3
+
+int key_action_args[N_KEY_ACTIONS] = {
+  [KEY_ACTION_VOLUME] = ARG_NUMBER,
+  [KEY_ACTION_SELECT] = ARG_ENDPOINT,
+  [KEY_ACTION_TOGGLE] = ARG_ENDPOINT,
+  [KEY_ACTION_OCTAVE] = ARG_NUMBER,
+  [KEY_ACTION_MODE] = ARG_MODE,
+  [KEY_ACTION_VOICE] = ARG_NUMBER,
+};
+
+// Indexed by MODE_*, which start at 1.
+#define N_MODE_NAMES 5
+const char* mode_names[N_MODE_NAMES] = {
+  NULL, "major", "mixo", "minor", "beth-cohens"};
+
+// Indexed by KIT_*.
+#define N_KIT_NAMES 5
+const char* kit_names[N_KIT_NAMES] = {
+  "rim", "rim2", "snare", "clap", "esnare"};
+#define NO_KIT -1
+
+// The keys kbd.py sends as 'a' + N and so on, from FIRST_NAMED_KEY.
+#define FIRST_NAMED_KEY 98
+#define N_KEY_NAMES 17
+const char* key_names[N_KEY_NAMES] = {
+  "F1", "F2", "F3", "F4", "F5", "F6", "F7", "F8", "F9", "F10", "DELETE",
+  "ESCAPE", "UP", "LEFT", "DOWN", "RIGHT", "TAB"};
+
+// For voices the rig doesn't mention.
+#define DEFAULT_VOICE_VOLUME 70
+
+#define MAX_PORT_NAMES 16
+#define MAX_PORT_NAME 64
+
+struct PortName {
+  int role;  // PORT_*
+  char name[MAX_PORT_NAME];
+};
+
+struct KeyBinding {
+  uint8_t action;  // KEY_ACTION_*
+  int16_t arg;
+};
+
+struct Rig {
+  // In order: the first that matches a port says what it is.
+  int n_port_names;
+  struct PortName port_names[MAX_PORT_NAMES];
+  int voice_volumes[128];
+  struct KeyBinding keys[128];
+  int8_t drum_keys[128];  // KIT_* or NO_KIT
+};
+
+void default_rig(struct Rig* rig);
+
+// Which PORT_* a port is, or -1 if we don't know.
+int port_role(const struct Rig* rig, const char* name) {
+  for (int i = 0; i < rig->n_port_names; i++) {
+    if (strstr(name, rig->port_names[i].name) != NULL) {
+      return rig->port_names[i].role;
+    }
+  }
+  return -1;
+}
+
+void add_port_name(struct Rig* rig, int role, const char* name) {
+  struct PortName* port_name = &rig->port_names[rig->n_port_names++];
+  port_name->role = role;
+  snprintf(port_name->name, sizeof(port_name->name), "%s", name);
+}
+
+int find_name(const char* name, const char** names, int n) {
+  for (int i = 0; i < n; i++) {
+    if (names[i] != NULL && strcmp(name, names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int parse_key(const char* name) {
+  if (strlen(name) == 1) return name[0];
+  int named = find_name(name, key_names, N_KEY_NAMES);
+  return named < 0 ? -1 : FIRST_NAMED_KEY + named;
+}
+
+// Read fname into rig, on top of the defaults.  Prints what's wrong and
+// returns false if we can't, leaving rig half done.
+bool load_rig(struct Rig* rig, const char* fname) {
+  FILE* file = fopen(fname, "r");
+  if (file == NULL) {
+    perror(fname);
+    return false;
+  }
+
+  default_rig(rig);
+  bool ok = true;
+  bool cleared_ports = false;
+  char line[256];
+  int line_n = 0;
+  while (ok && fgets(line, sizeof(line), file)) {
+    line_n++;
+    char* hash = strchr(line, '#');
+    if (hash) *hash = '\0';
+
+    char directive[32], first[MAX_PORT_NAME], second[32];
+    int n = sscanf(line, "%31s %63s %31s", directive, first, second);
+    if (n <= 0) continue;  // blank or comment
+
+    if (strcmp(directive, "port") == 0) {
+      // The name is the rest of the line, spaces and all.
+      char* name = strstr(line, first) + strlen(first);
+      while (*name == ' ' || *name == '\t') name++;
+      char* end = name + strlen(name);
+      while (end > name && (end[-1] == '\n' || end[-1] == ' ' ||
+                            end[-1] == '\t')) {
+        *--end = '\0';
+      }
+      int role = find_name(first, port_role_names, N_PORT_ROLES);
+      // Any ports in the file replace the default ones.
+      if (!cleared_ports) {
+        rig->n_port_names = 0;
+        cleared_ports = true;
+      }
+      ok = n >= 3 && role >= 0 && end - name < MAX_PORT_NAME &&
+        rig->n_port_names < MAX_PORT_NAMES;
+      if (ok) {
+        add_port_name(rig, role, name);
+      }
+    } else if (strcmp(directive, "volume") == 0) {
+      int voice = atoi(first);
+      int volume = atoi(second);
+      ok = n == 3 && voice >= 0 && voice < 128 && volume >= 0 &&
+        volume <= 127;
+      if (ok) {
+        rig->voice_volumes[voice] = volume;
+      }
+    } else if (strcmp(directive, "key") == 0) {
+      char arg[32];
+      n = sscanf(line, "%31s %63s %31s %31s", directive, first, second, arg);
+      int key = parse_key(first);
+      int action = n >= 3 ?
+        find_name(second, key_action_names, N_KEY_ACTIONS) : -1;
+      int arg_type = action >= 0 ? key_action_args[action] : ARG_NONE;
+      int arg_value = 0;
+      if (n == 4 && arg_type == ARG_NUMBER) {
+        arg_value = atoi(arg);
+      } else if (n == 4 && arg_type == ARG_ENDPOINT) {
+        arg_value = find_name(arg, endpoint_names, N_ENDPOINTS);
+      } else if (n == 4 && arg_type == ARG_MODE) {
+        arg_value = find_name(arg, mode_names, N_MODE_NAMES);
+      }
+      // Deltas can be negative.  Voices are 128 programs in each of 9
+      // banks, like manual_volumes[].
+      int min_arg = arg_type == ARG_NUMBER ? -127 : 0;
+      int max_arg = 127;
+      if (action == KEY_ACTION_VOICE) {
+        min_arg = 0;
+        max_arg = 128*9 - 1;
+      }
+      ok = key >= 0 && key < 128 && action >= 0 &&
+        n == (arg_type == ARG_NONE ? 3 : 4) && arg_value >= min_arg &&
+        arg_value <= max_arg;
+      if (ok) {
+        rig->keys[key].action = action;
+        rig->keys[key].arg = arg_value;
+      }
+    } else if (strcmp(directive, "drum-key") == 0) {
+      int key = parse_key(first);
+      int kit = n == 3 ? find_name(second, kit_names, N_KIT_NAMES) : -1;
+      if (n == 3 && strcmp(second, "none") == 0) kit = NO_KIT;
+      ok = key >= 0 && key < 128 && (kit >= 0 || kit == NO_KIT) && n == 3;
+      if (ok) {
+        rig->drum_keys[key] = kit;
+      }
+    } else {
+      ok = false;
+    }
+
+    if (!ok) {
+      fprintf(stderr, "%s:%d: expected: port ROLE NAME, volume VOICE VOLUME, "
+              "key KEY ACTION [ARG], or drum-key KEY KIT\n", fname, line_n);
+    }
+  }
+  fclose(file);
+  return ok;
+}
+
+void print_key(FILE* file, int key) {
+  if (key >= FIRST_NAMED_KEY && key < FIRST_NAMED_KEY + N_KEY_NAMES) {
+    fprintf(file, "%s", key_names[key - FIRST_NAMED_KEY]);
+  } else {
+    fprintf(file, "%c", key);
+  }
+}
+
+// Write rig out as a config file.
+void print_rig(FILE* file, const struct Rig* rig) {
+  for (int i = 0; i < rig->n_port_names; i++) {
+    fprintf(file, "port %s %s\n", port_role_names[rig->port_names[i].role],
+            rig->port_names[i].name);
+  }
+  fprintf(file, "\n");
+  for (int voice = 0; voice < 128; voice++) {
+    if (rig->voice_volumes[voice] == DEFAULT_VOICE_VOLUME) continue;
+    fprintf(file, "volume %d %d\n", voice, rig->voice_volumes[voice]);
+  }
+  fprintf(file, "\n");
+  for (int key = 0; key < 128; key++) {
+    const struct KeyBinding* binding = &rig->keys[key];
+    if (binding->action == KEY_ACTION_NONE) continue;
+    fprintf(file, "key ");
+    print_key(file, key);
+    fprintf(file, " %s", key_action_names[binding->action]);
+    switch (key_action_args[binding->action]) {
+    case ARG_NUMBER:
+      fprintf(file, " %d", binding->arg);
+      break;
+    case ARG_ENDPOINT:
+      fprintf(file, " %s", endpoint_names[binding->arg]);
+      break;
+    case ARG_MODE:
+      fprintf(file, " %s", mode_names[binding->arg]);
+      break;
+    }
+    fprintf(file, "\n");
+  }
+  fprintf(file, "\n");
+  for (int key = 0; key < 128; key++) {
+    if (rig->drum_keys[key] == NO_KIT) continue;
+    fprintf(file, "drum-key ");
+    print_key(file, key);
+    fprintf(file, " %s\n", kit_names[rig->drum_keys[key]]);
+  }
+}
+
+#endif
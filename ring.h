@@ -0,0 +1,91 @@
+#ifndef JML_RING_H
+#define JML_RING_H
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+// Wait-free single-producer single-consumer ring of fixed-size records.  One
+// thread pushes and one other thread pops, and neither ever blocks: a push to
+// a full ring or a pop from an empty one just fails.
+
+#define CACHE_LINE_BYTES 64
+
+struct Ring {
+  // Only the producer writes these.
+  uint64_t head __attribute__((aligned(CACHE_LINE_BYTES)));
+  uint64_t n_full;  // pushes that failed because the ring was full
+  uint64_t max_depth;
+
+  // Only the consumer writes this.
+  uint64_t tail __attribute__((aligned(CACHE_LINE_BYTES)));
+
+  uint64_t capacity __attribute__((aligned(CACHE_LINE_BYTES)));
+  size_t record_size;
+  unsigned char* records;
+};
+
+// capacity must be a power of two.
+void ring_init(struct Ring* ring, uint64_t capacity, size_t record_size) {
+  ring->head = 0;
+  ring->n_full = 0;
+  ring->max_depth = 0;
+  ring->tail = 0;
+  ring->capacity = capacity;
+  ring->record_size = record_size;
+  ring->records = calloc(capacity, record_size);
+  if (ring->records == NULL) {
+    die("alloc ring");
+  }
+}
+
+bool ring_push(struct Ring* ring, const void* record) {
+  uint64_t head = ring->head;
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail == ring->capacity) {
+    ring->n_full++;
+    return false;
+  }
+
+  memcpy(ring->records + (head & (ring->capacity - 1)) * ring->record_size,
+         record, ring->record_size);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+  if (head + 1 - tail > ring->max_depth) {
+    ring->max_depth = head + 1 - tail;
+  }
+  return true;
+}
+
+bool ring_pop(struct Ring* ring, void* record) {
+  uint64_t tail = ring->tail;
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (tail == head) {
+    return false;
+  }
+
+  memcpy(record,
+         ring->records + (tail & (ring->capacity - 1)) * ring->record_size,
+         ring->record_size);
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Approximate when called from anywhere other than the consumer.
+uint64_t ring_depth(struct Ring* ring) {
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+    __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+void print_ring_stats(const char* name, struct Ring* ring) {
+  printf("%s: depth %" PRIu64 ", max depth %" PRIu64 " of %" PRIu64
+         ", %" PRIu64 " pushes found it full\n",
+         name, ring_depth(ring), ring->max_depth, ring->capacity,
+         ring->n_full);
+}
+
+#endif
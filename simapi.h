@@ -0,0 +1,108 @@
+#ifndef JML_SIM_API_H
+#define JML_SIM_API_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "common.h"
+#include "controllers.h"
+
+// The platform side of jammer-sim: a virtual clock that only moves when the
+// simulation says so, and a MIDI sink that writes everything the engine
+// sends to a log instead of to ALSA.
+
+uint64_t sim_ns = 0;
+
+uint64_t now() {
+  return sim_ns;
+}
+
+// As in linuxapi.h: when non-zero, send_midi() sends for this time instead of
+// right away.
+uint64_t send_at_ns = 0;
+
+// Only for timing output against input, which the sim doesn't do.
+int cause_source = SOURCE_NONE;
+uint64_t cause_ns = 0;
+
+FILE* sim_events = NULL;
+uint64_t n_sim_events = 0;
+
+// One line per message: when we sent it, what it was, and when it's for if
+// it was scheduled ahead.  With no log open messages are only counted, which
+// is what jammer-bench wants.
+void sim_event(const char* action, int channel, int note, int value) {
+  if (sim_events == NULL) {
+    n_sim_events++;
+    return;
+  }
+  fprintf(sim_events, "%" PRIu64 " %s %d %d %d", sim_ns, action, channel,
+          note, value);
+  if (send_at_ns != 0) {
+    fprintf(sim_events, " @%" PRIu64, send_at_ns);
+  }
+  fprintf(sim_events, "\n");
+  n_sim_events++;
+}
+
+// Held changes go out now, even when they're flushed ahead of something
+// scheduled for later.
+void emit_controller(int channel, int controller, int value) {
+  uint64_t at_ns = send_at_ns;
+  send_at_ns = 0;
+  sim_event("cc", channel, controller, value);
+  send_at_ns = at_ns;
+}
+
+void send_midi(int action, int note, int velocity, int endpoint) {
+  if (note < 0) note = 0;
+  if (note > 127) note = 127;
+
+  if (velocity < 0) velocity = 0;
+  if (velocity > 127) velocity = 127;
+
+  // Through the same controller cache as jammer, so we log what it sends.
+  if (hold_controller(action, endpoint, note, velocity)) return;
+
+  const char* friendly_action;
+  if (action == MIDI_CC) {
+    friendly_action = "cc";
+  } else if (action == MIDI_ON) {
+    friendly_action = "on";
+  } else if (action == MIDI_OFF) {
+    friendly_action = "off";
+  } else {
+    if (sim_events != NULL) {
+      fprintf(sim_events, "# unknown action %d\n", action);
+    }
+    return;
+  }
+  sim_event(friendly_action, endpoint, note, velocity);
+}
+
+void choose_voice(int channel, int bank, int voice) {
+  if (bank < 0) bank = 0;
+  if (bank > 127) bank = 127;
+  if (voice < 0) voice = 0;
+  if (voice > 127) voice = 127;
+
+  send_midi(MIDI_CC, CC_BANK_SELECT, bank, channel);
+  sim_event("program", channel, voice, 0);
+}
+
+// The sim is never real-time, so this is just pthread_create().
+pthread_t start_thread(void* (*run)(void*), bool realtime, char* what) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, run, NULL) != 0) {
+    die(what);
+  }
+  return thread;
+}
+
+void cancel_scheduled_midi() {
+  sim_event("cancel", 0, 0, 0);
+}
+
+#endif
@@ -0,0 +1,35 @@
+#!/bin/bash
+# Run each sims/*.script through jammer-sim and compare what it sends, and
+# then what it printed, with the matching .out file.  A "# flags: ..." line
+# in a script gives jammer-sim options for it.  With --update, write the
+# .out files instead, for when the engine is supposed to have changed.
+
+cd "$(dirname "$0")"
+UPDATE=false
+if [[ "$1" == "--update" ]]; then
+    UPDATE=true
+fi
+
+STDERR=$(mktemp)
+ACTUAL=$(mktemp)
+trap 'rm -f "$STDERR" "$ACTUAL"' EXIT
+
+FAILED=0
+for SCRIPT in *.script; do
+    EXPECTED="${SCRIPT%.script}.out"
+    FLAGS=$(sed -n 's/^# flags: //p' "$SCRIPT")
+    ../jammer-sim $FLAGS "$SCRIPT" > "$ACTUAL" 2> "$STDERR"
+    cat "$STDERR" >> "$ACTUAL"
+
+    if $UPDATE; then
+        cp "$ACTUAL" "$EXPECTED"
+        echo "updated $EXPECTED"
+    elif diff -u "$EXPECTED" "$ACTUAL" > /dev/null; then
+        echo "ok $SCRIPT"
+    else
+        echo "FAILED $SCRIPT:"
+        diff -u "$EXPECTED" "$ACTUAL" | head -n 40
+        FAILED=1
+    fi
+done
+exit $FAILED
@@ -0,0 +1,216 @@
+#ifndef JML_SNAPSHOT_H
+#define JML_SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// The engine's state (struct EngineState, in jammermidilib.h, so include
+// this after that) kept in a memory-mapped file, by default
+// /dev/shm/jammer-state, so when jammer crashes in the middle of a song and
+// systemd starts it again it can pick up where it was instead of starting
+// over.
+//
+// There are two copies, and we always write the one that isn't the latest,
+// so a crash part way through writing leaves the other one whole.  Each
+// copy's sequence number is odd while it's being written, and a reader only
+// takes a copy whose sequence number was even and the same before and after
+// reading it.  The writer never waits for anyone.
+
+#define SNAPSHOT_MAGIC 0x53534d4a  // "JMSS"
+#define SNAPSHOT_VERSION 2
+
+// Save at most this often.
+#define SNAPSHOT_INTERVAL_NS (50 * 1000000LL)
+
+// If we crash again this soon after resuming, the state we resumed from is
+// probably what's crashing us, so the next restart starts over instead.
+#define SNAPSHOT_CRASH_LOOP_NS (5 * NS_PER_SEC)
+
+// A restart after a crash takes a few seconds.  Anything older is from some
+// other time we played, and whatever song that was is over.
+#define SNAPSHOT_MAX_AGE_NS (30 * NS_PER_SEC)
+
+// /proc/sys/kernel/random/boot_id: 36 characters and a newline.
+#define SNAPSHOT_BOOT_ID_SIZE 40
+
+struct SnapshotCopy {
+  uint32_t sequence;  // 0 if never written
+  uint32_t unused;
+  uint64_t saved_ns;  // on the now() clock
+  struct EngineState state;
+};
+
+struct SnapshotFile {
+  uint32_t magic;
+  uint32_t version;
+  // sizeof(struct EngineState), which changes whenever the engine does.
+  uint64_t state_size;
+  uint64_t resumed_ns;  // the last time a jammer resumed from this file
+  // The now() clock starts over at boot, so its times only mean something
+  // to a jammer on the same boot as the one that saved them.
+  char boot_id[SNAPSHOT_BOOT_ID_SIZE];
+  uint32_t latest;      // which of copies[] was written last
+  uint32_t unused;
+  struct SnapshotCopy copies[2];
+};
+
+struct SnapshotFile* snapshot = NULL;
+uint64_t last_snapshot_ns = 0;
+uint64_t snapshot_n = 0;
+uint64_t snapshot_total_ns = 0;
+uint64_t snapshot_max_ns = 0;
+
+// Copy the latest whole state in file into state.  Returns false if there
+// isn't one.
+bool read_snapshot(struct SnapshotFile* file, struct EngineState* state,
+                   uint64_t* saved_ns) {
+  uint32_t latest = __atomic_load_n(&file->latest, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < 2; i++) {
+    struct SnapshotCopy* copy = &file->copies[(latest + i) % 2];
+    uint32_t before = __atomic_load_n(&copy->sequence, __ATOMIC_ACQUIRE);
+    if (before == 0 || before % 2 == 1) continue;
+    memcpy(state, &copy->state, sizeof(*state));
+    *saved_ns = copy->saved_ns;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&copy->sequence, __ATOMIC_RELAXED) == before) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Which boot this is, or "" if we can't tell.
+void read_boot_id(char boot_id[SNAPSHOT_BOOT_ID_SIZE]) {
+  memset(boot_id, 0, SNAPSHOT_BOOT_ID_SIZE);
+  FILE* file = fopen("/proc/sys/kernel/random/boot_id", "r");
+  if (file == NULL) return;
+  if (fgets(boot_id, SNAPSHOT_BOOT_ID_SIZE, file) == NULL) {
+    boot_id[0] = '\0';
+  }
+  fclose(file);
+}
+
+// Start file over, with nothing saved.
+void init_snapshot(struct SnapshotFile* file, const char* boot_id) {
+  // Touching every page now means saving never faults.
+  memset(file, 0, sizeof(struct SnapshotFile));
+  file->magic = SNAPSHOT_MAGIC;
+  file->version = SNAPSHOT_VERSION;
+  file->state_size = sizeof(struct EngineState);
+  memcpy(file->boot_id, boot_id, SNAPSHOT_BOOT_ID_SIZE);
+}
+
+// Map fname to save snapshots to.  If it has a state from a jammer that
+// crashed and resume_from isn't NULL, copy that into resume_from and return
+// true.  Like the stats file, if we can't map it we carry on without.  Call
+// before go_realtime(), so mlockall() covers it.
+bool open_snapshot(const char* fname, struct EngineState* resume_from) {
+  int fd = open(fname, O_RDWR | O_CREAT, 0644);
+  if (fd < 0 || ftruncate(fd, sizeof(struct SnapshotFile)) < 0) {
+    perror(fname);
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  void* mapped = mmap(NULL, sizeof(struct SnapshotFile),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    perror(fname);
+    return false;
+  }
+  snapshot = mapped;
+
+  uint64_t current_time = now();
+  char boot_id[SNAPSHOT_BOOT_ID_SIZE];
+  read_boot_id(boot_id);
+  uint64_t saved_ns = 0;
+  bool resuming = resume_from != NULL &&
+    snapshot->magic == SNAPSHOT_MAGIC &&
+    snapshot->version == SNAPSHOT_VERSION &&
+    snapshot->state_size == sizeof(struct EngineState) &&
+    read_snapshot(snapshot, resume_from, &saved_ns);
+  if (resuming &&
+      (boot_id[0] == '\0' ||
+       memcmp(snapshot->boot_id, boot_id, SNAPSHOT_BOOT_ID_SIZE) != 0)) {
+    printf("%s: can't tell it was saved since the last reboot, so starting "
+           "over\n", fname);
+    resuming = false;
+  } else if (resuming && (saved_ns > current_time ||
+                          current_time - saved_ns > SNAPSHOT_MAX_AGE_NS)) {
+    printf("%s: saved too long ago to be the same song, so starting over\n",
+           fname);
+    resuming = false;
+  } else if (resuming && snapshot->resumed_ns != 0 &&
+      saved_ns < snapshot->resumed_ns + SNAPSHOT_CRASH_LOOP_NS) {
+    printf("%s: stopped soon after resuming from it last time, so starting "
+           "over\n", fname);
+    resuming = false;
+  }
+
+  if (resuming) {
+    printf("resuming from %s, saved %.3fs ago\n", fname,
+           (current_time - saved_ns) / 1e9);
+    snapshot->resumed_ns = current_time;
+  } else {
+    init_snapshot(snapshot, boot_id);
+  }
+  return resuming;
+}
+
+// Engine thread only.  No syscalls or locks, just a copy into the mapping.
+void save_snapshot(uint64_t current_time) {
+  uint32_t next = 1 - snapshot->latest;
+  struct SnapshotCopy* copy = &snapshot->copies[next];
+  uint32_t sequence = copy->sequence;
+  __atomic_store_n(&copy->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  copy->saved_ns = current_time;
+  save_engine_state(&copy->state);
+  __atomic_store_n(&copy->sequence, sequence + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&snapshot->latest, next, __ATOMIC_RELEASE);
+}
+
+// Call once the engine is done with current_time.  We don't save if a
+// subbeat is due in the next tick, so a snapshot never holds one up.  The
+// breath and ducking ticks don't count: they're due every tick for as long
+// as anyone's playing, which is exactly when we want snapshots.
+void maybe_save_snapshot(uint64_t current_time) {
+  if (snapshot == NULL) return;
+  if (current_time - last_snapshot_ns < SNAPSHOT_INTERVAL_NS) return;
+  uint64_t next_subbeat = jml_next_subbeat_deadline();
+  if (next_subbeat != 0 && next_subbeat <= current_time + TICK_NS) return;
+
+  save_snapshot(current_time);
+  last_snapshot_ns = current_time;
+
+  uint64_t took = now() - current_time;
+  snapshot_n++;
+  snapshot_total_ns += took;
+  if (took > snapshot_max_ns) {
+    snapshot_max_ns = took;
+  }
+}
+
+// On a clean exit: nobody is in the middle of a song, so the next jammer
+// should start fresh.  Engine thread only, like save_snapshot().
+void forget_snapshot() {
+  if (snapshot == NULL) return;
+  for (int i = 0; i < 2; i++) {
+    __atomic_store_n(&snapshot->copies[i].sequence, 0, __ATOMIC_RELEASE);
+  }
+}
+
+void print_snapshot_stats() {
+  if (snapshot_n == 0) return;
+  printf("snapshots: %" PRIu64 " saved, mean %.3fms, max %.3fms\n",
+         snapshot_n, snapshot_total_ns / 1000000.0 / snapshot_n,
+         snapshot_max_ns / 1000000.0);
+}
+
+#endif
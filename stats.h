@@ -0,0 +1,116 @@
+#ifndef JML_STATS_H
+#define JML_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "common.h"
+#include "latency.h"
+
+// Counters for watching jammer from outside while it runs.  jammer keeps
+// these in a memory-mapped file, by default /dev/shm/jammer-stats, and
+// jammer-stress reads them to see how each load level went.  Nothing is
+// locked: each field has one writer, and readers should only look at how
+// they change.
+
+#define STATS_MAGIC 0x54534d4a  // "JMST"
+#define STATS_VERSION 2
+
+// A tick that takes longer than this is an overrun.
+#define TICK_BUDGET_NS 1000000
+
+struct JammerStats {
+  uint32_t magic;
+  uint32_t version;
+
+  // Written by whichever thread reads from ALSA.
+  uint64_t n_input_overruns;  // times ALSA said its input pool overflowed
+
+  // Written by the engine thread.
+  uint64_t n_inputs;          // input events handled
+  uint64_t n_ticks;
+  uint64_t n_tick_overruns;   // ticks that took longer than TICK_BUDGET_NS
+  uint64_t max_tick_ns;
+  uint64_t n_output_ring_full;  // with --threads, messages dropped
+  uint64_t n_beats_followed;  // hits the beat tracker followed
+  uint64_t beat_error_total_ns;  // and how far off its predictions were
+  uint64_t beat_error_max_ns;
+  uint64_t n_beat_relocks;    // hits it started over from instead
+
+  // Written by whichever thread calls output_record().
+  uint64_t n_sent;
+  uint64_t n_send_errors;     // messages ALSA wouldn't take, and so dropped
+  struct Histogram source_latency[N_SOURCES];
+  struct Histogram endpoint_latency[N_ENDPOINTS];
+};
+
+struct JammerStats local_stats = {STATS_MAGIC, STATS_VERSION};
+struct JammerStats* stats = &local_stats;
+
+// Move the stats into a file at fname so other programs can read them.  If
+// we can't we keep them to ourselves: this isn't worth stopping for.  Call
+// before starting any threads.
+void publish_stats(const char* fname) {
+  int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, sizeof(struct JammerStats)) < 0) {
+    perror(fname);
+    if (fd >= 0) close(fd);
+    return;
+  }
+  void* mapped = mmap(NULL, sizeof(struct JammerStats),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    perror(fname);
+    return;
+  }
+  memcpy(mapped, stats, sizeof(struct JammerStats));
+  stats = mapped;
+}
+
+// The reading side.  Returns NULL if fname isn't there or isn't ours.
+const struct JammerStats* map_stats(const char* fname) {
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0) return NULL;
+  void* mapped = mmap(NULL, sizeof(struct JammerStats), PROT_READ,
+                      MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) return NULL;
+  const struct JammerStats* mapped_stats = mapped;
+  if (mapped_stats->magic != STATS_MAGIC ||
+      mapped_stats->version != STATS_VERSION) {
+    munmap(mapped, sizeof(struct JammerStats));
+    return NULL;
+  }
+  return mapped_stats;
+}
+
+// Time one tick, which started at start_ns.
+void count_tick(uint64_t start_ns, uint64_t end_ns) {
+  uint64_t took = end_ns - start_ns;
+  stats->n_ticks++;
+  if (took > TICK_BUDGET_NS) {
+    stats->n_tick_overruns++;
+  }
+  if (took > stats->max_tick_ns) {
+    stats->max_tick_ns = took;
+  }
+}
+
+void print_load_stats() {
+  printf("load: %" PRIu64 " inputs, %" PRIu64 " input overruns, %" PRIu64
+         " ticks, %" PRIu64 " over %.1fms, longest %.3fms\n",
+         stats->n_inputs, stats->n_input_overruns, stats->n_ticks,
+         stats->n_tick_overruns, TICK_BUDGET_NS / 1000000.0,
+         stats->max_tick_ns / 1000000.0);
+  printf("load: %" PRIu64 " sent, %" PRIu64 " dropped by ALSA, %" PRIu64
+         " dropped with the output ring full\n",
+         stats->n_sent, stats->n_send_errors, stats->n_output_ring_full);
+}
+
+#endif
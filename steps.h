@@ -0,0 +1,153 @@
+#ifndef JML_STEPS_H
+#define JML_STEPS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+// Step patterns: rhythms for any endpoint, read from a file at startup
+// instead of built out of the rhythm keys.  Each line of the file is one
+// note:
+//
+//   endpoint subbeat note velocity length
+//
+// endpoint is a name from endpoint_names.  subbeat is where in the bar the
+// note starts, from 0 to 71.  note is semitones above the note we're
+// playing (active_note()), or with a "c" in front above the chord note
+// (active_chord()), so "c7" is the chord's fifth.  For the drum endpoint
+// it's the drum note itself, from 0 to 127.  velocity is 1 to 127, or "-" for what the
+// endpoint would normally use.  length is how many subbeats to hold the
+// note, from 1 to 72.  "#" starts a comment.
+//
+// We sort the steps by the subbeat they start on and the subbeat they end
+// on, so playing a subbeat only looks at the steps that start or end there
+// however many there are in all.
+
+#define STEPS_PER_BAR 72
+#define MAX_STEPS 1024
+#define STEP_DEFAULT_VELOCITY 0
+
+struct Step {
+  uint8_t endpoint;
+  uint8_t subbeat;
+  int8_t note;
+  bool from_chord;
+  uint8_t velocity;  // or STEP_DEFAULT_VELOCITY
+  uint8_t length;
+};
+
+struct Steps {
+  int n;
+  struct Step steps[MAX_STEPS];
+  // The steps starting on subbeat s are starts[first_start[s]] up to
+  // starts[first_start[s+1]], and the same for ends.
+  uint16_t first_start[STEPS_PER_BAR + 1];
+  uint16_t starts[MAX_STEPS];
+  uint16_t first_end[STEPS_PER_BAR + 1];
+  uint16_t ends[MAX_STEPS];
+  bool endpoints[N_ENDPOINTS];  // which endpoints have any steps
+};
+
+int step_end(const struct Step* step) {
+  return (step->subbeat + step->length) % STEPS_PER_BAR;
+}
+
+// Counting sort of the steps into order by key.
+void sort_steps(struct Steps* steps, bool by_end, uint16_t* first,
+                uint16_t* order) {
+  int counts[STEPS_PER_BAR + 1];
+  memset(counts, 0, sizeof(counts));
+  for (int i = 0; i < steps->n; i++) {
+    const struct Step* step = &steps->steps[i];
+    counts[(by_end ? step_end(step) : step->subbeat) + 1]++;
+  }
+  for (int s = 0; s < STEPS_PER_BAR; s++) {
+    counts[s + 1] += counts[s];
+  }
+  for (int s = 0; s <= STEPS_PER_BAR; s++) {
+    first[s] = counts[s];
+  }
+  for (int i = 0; i < steps->n; i++) {
+    const struct Step* step = &steps->steps[i];
+    order[counts[by_end ? step_end(step) : step->subbeat]++] = i;
+  }
+}
+
+int parse_endpoint(const char* name) {
+  for (int i = 0; i < N_ENDPOINTS; i++) {
+    if (strcmp(name, endpoint_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Read fname into steps, or exit if we can't.
+void load_steps(struct Steps* steps, const char* fname) {
+  FILE* file = fopen(fname, "r");
+  if (file == NULL) {
+    perror(fname);
+    exit(1);
+  }
+
+  memset(steps, 0, sizeof(*steps));
+  char line[256];
+  int line_n = 0;
+  while (fgets(line, sizeof(line), file)) {
+    line_n++;
+    char* hash = strchr(line, '#');
+    if (hash) *hash = '\0';
+
+    char endpoint_name[32], note[32], velocity[32];
+    int subbeat, length;
+    int n = sscanf(line, "%31s %d %31s %31s %d", endpoint_name, &subbeat,
+                   note, velocity, &length);
+    if (n <= 0) continue;  // blank or comment
+
+    struct Step step;
+    int endpoint = n == 5 ? parse_endpoint(endpoint_name) : -1;
+    step.from_chord = n == 5 && note[0] == 'c';
+    int note_value = n == 5 ? atoi(note + (step.from_chord ? 1 : 0)) : 0;
+    int velocity_value = n == 5 && strcmp(velocity, "-") == 0 ?
+      STEP_DEFAULT_VELOCITY : atoi(velocity);
+    if (n != 5 || endpoint < 0 ||
+        subbeat < 0 || subbeat >= STEPS_PER_BAR ||
+        note_value < -127 || note_value > 127 ||
+        (velocity_value == STEP_DEFAULT_VELOCITY &&
+         strcmp(velocity, "-") != 0) ||
+        velocity_value < 0 || velocity_value > 127 ||
+        length < 1 || length > STEPS_PER_BAR) {
+      fprintf(stderr, "%s:%d: expected: endpoint subbeat note velocity "
+              "length\n", fname, line_n);
+      exit(1);
+    }
+    // Drum notes aren't relative to anything, so they have to be real notes.
+    if (endpoint == ENDPOINT_DRUM && (step.from_chord || note_value < 0)) {
+      fprintf(stderr, "%s:%d: drum notes are from 0 to 127\n", fname,
+              line_n);
+      exit(1);
+    }
+    if (steps->n == MAX_STEPS) {
+      fprintf(stderr, "%s:%d: more than %d steps\n", fname, line_n,
+              MAX_STEPS);
+      exit(1);
+    }
+
+    step.endpoint = endpoint;
+    step.subbeat = subbeat;
+    step.note = note_value;
+    step.velocity = velocity_value;
+    step.length = length;
+    steps->steps[steps->n++] = step;
+    steps->endpoints[endpoint] = true;
+  }
+  fclose(file);
+
+  sort_steps(steps, /*by_end=*/false, steps->first_start, steps->starts);
+  sort_steps(steps, /*by_end=*/true, steps->first_end, steps->ends);
+}
+
+#endif
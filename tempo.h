@@ -0,0 +1,366 @@
+#ifndef JML_TEMPO_H
+#define JML_TEMPO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Incremental tempo estimation.  The brute force search (tempo_search(),
+// below) tries every tempo against every hit we remember, which is a lot
+// of work to do on each hit right when we need to send the downbeat.
+// Instead, each hit here remembers a few chains: runs of earlier hits evenly
+// spaced, at one period, ending at it.  A new hit only has to look back one
+// period's worth of hits, and for each see whether it extends one of that
+// hit's chains or starts a new one.  That's a bounded amount of work
+// however long we've been playing.
+//
+// As with the brute force search, we have a tempo once a hit has hits on
+// each of the four downbeats before it, with total error under a 1/32 note
+// per downbeat.  The period is the best fit to those four instead of the
+// nearest tenth of a bpm, and an extra hit doesn't break anything, since
+// nothing links through it.
+//
+// Tempos go from 40 (slow airs) to 240 (fast reels).  That's more than an
+// octave, so a steady pattern usually fits more than one: kick and snare
+// alternating fits a bar with both, and also a bar each.  We used to only
+// look from 70 to 140, which made that choice for us, so we still look
+// there first when starting fresh.  Once we have a tempo, the octave we
+// look in first is centered on it instead, so a reel that speeds up past
+// 140 stays a reel instead of dropping to 70.  When starting fresh, if
+// nothing fits there we take a slower tempo, but never a faster one: the
+// first few hits of a song always fit a faster tempo, because it needs
+// less history to show four downbeats.  Once we have a tempo we don't look
+// outside its octave at all, since with sloppy playing a slower tempo,
+// which allows more error, would often fit when the right one didn't.
+
+#define TEMPO_MIN_BPM 40
+#define TEMPO_MAX_BPM 240  // exclusive
+#define TEMPO_MIN_PERIOD_NS (60 * 1000000000LL / TEMPO_MAX_BPM)
+#define TEMPO_MAX_PERIOD_NS (60 * 1000000000LL / TEMPO_MIN_BPM)
+
+// Where we look first when we don't have a tempo: 70 to 140.
+#define TEMPO_DEFAULT_WINDOW_BPM 70
+// Keep looking around a tempo for this long after we last locked to it, two
+// bars at the slowest, so the next song starts fresh.
+#define TEMPO_WINDOW_NS (2 * TEMPO_MAX_PERIOD_NS)
+
+#define TEMPO_DOWNBEATS 4
+#define TEMPO_HITS 32   // how many recent hits we look back through
+#define TEMPO_CHAINS 8  // chains kept per hit
+// A hit extends a chain if it's within this fraction of a period of where the
+// chain says it should be.  That's the whole error budget, but a chain's
+// period drifts with its last few hits, so sloppy playing the brute force
+// search would accept can still miss.  Looser helps there (a fifth matches
+// the search) but then extra kicks link up and kick-snare patterns lock less
+// often, so this isn't the default until something fixes both.
+#define TEMPO_LINK_TOLERANCE 8
+
+struct TempoChain {
+  uint64_t period_ns;  // fit to the chain's most recent downbeats; 0 if unused
+  uint64_t error_ns;   // total distance of those downbeats from the fit
+  int length;          // hits in the chain, including the one it ends at
+  int n_downbeats;     // how many of downbeats_ns are filled in
+  // The hits before the one this ends at, most recent first.
+  uint64_t downbeats_ns[TEMPO_DOWNBEATS];
+};
+
+struct TempoHit {
+  uint64_t ns;
+  struct TempoChain chains[TEMPO_CHAINS];
+};
+
+struct TempoTracker {
+  struct TempoHit hits[TEMPO_HITS];
+  uint64_t n_hits;
+};
+
+void tempo_tracker_clear(struct TempoTracker* tracker) {
+  memset(tracker, 0, sizeof(*tracker));
+}
+
+// The period for a chain ending at t that puts its downbeats closest to t -
+// period, t - 2*period, ... in total, which is what estimate_tempo_helper()
+// searches for.  Downbeat k says the period is (t - downbeat) / k, and
+// missing by x there costs k*x, so that's the weighted median.
+void tempo_fit(struct TempoChain* chain, uint64_t t) {
+  uint64_t periods[TEMPO_DOWNBEATS];
+  int weights[TEMPO_DOWNBEATS];
+  int total_weight = 0;
+  for (int k = 1; k <= chain->n_downbeats; k++) {
+    // Insertion sort: there are at most four.
+    uint64_t period = (t - chain->downbeats_ns[k - 1]) / k;
+    int i = k - 1;
+    while (i > 0 && periods[i - 1] > period) {
+      periods[i] = periods[i - 1];
+      weights[i] = weights[i - 1];
+      i--;
+    }
+    periods[i] = period;
+    weights[i] = k;
+    total_weight += k;
+  }
+  int seen = 0;
+  for (int i = 0; i < chain->n_downbeats; i++) {
+    seen += weights[i];
+    if (2 * seen >= total_weight) {
+      chain->period_ns = periods[i];
+      break;
+    }
+  }
+
+  chain->error_ns = 0;
+  for (int k = 1; k <= chain->n_downbeats; k++) {
+    int64_t error = (int64_t) (t - k * chain->period_ns) -
+      (int64_t) chain->downbeats_ns[k - 1];
+    chain->error_ns += error < 0 ? -error : error;
+  }
+}
+
+// Whether a is a better chain to keep than b: longer, up to having all the
+// downbeats we need, and then closer to even.
+bool tempo_chain_better(const struct TempoChain* a,
+                        const struct TempoChain* b) {
+  if (b->period_ns == 0) return a->period_ns != 0;
+  if (a->period_ns == 0) return false;
+  int a_length = a->length < TEMPO_DOWNBEATS + 1 ? a->length :
+    TEMPO_DOWNBEATS + 1;
+  int b_length = b->length < TEMPO_DOWNBEATS + 1 ? b->length :
+    TEMPO_DOWNBEATS + 1;
+  if (a_length != b_length) return a_length > b_length;
+  // Compare error as a fraction of the period.
+  return a->error_ns * b->period_ns < b->error_ns * a->period_ns;
+}
+
+// Keep chain among chains if it's one of the best TEMPO_CHAINS.
+void tempo_keep_chain(struct TempoChain* chains,
+                      const struct TempoChain* chain) {
+  int worst = 0;
+  for (int i = 1; i < TEMPO_CHAINS; i++) {
+    if (tempo_chain_better(&chains[worst], &chains[i])) {
+      worst = i;
+    }
+  }
+  if (tempo_chain_better(chain, &chains[worst])) {
+    chains[worst] = *chain;
+  }
+}
+
+// Work out the chains ending at a hit at t, and from them the tempo in bars
+// per minute, or -1 if there isn't one yet.  We look from window_bpm up to
+// twice that, and then, if slower, at slower tempos.  If insert, remember
+// the hit for later hits to chain from.
+float tempo_tracker_hit(struct TempoTracker* tracker, uint64_t t,
+                        bool insert, float window_bpm, bool slower) {
+  struct TempoHit hit;
+  memset(&hit, 0, sizeof(hit));
+  hit.ns = t;
+
+  uint64_t n_back = tracker->n_hits < TEMPO_HITS ?
+    tracker->n_hits : TEMPO_HITS;
+  for (uint64_t back = 1; back <= n_back; back++) {
+    const struct TempoHit* prev =
+      &tracker->hits[(tracker->n_hits - back) % TEMPO_HITS];
+    if (prev->ns >= t) continue;
+    uint64_t gap = t - prev->ns;
+    if (gap < TEMPO_MIN_PERIOD_NS -
+        TEMPO_MIN_PERIOD_NS / TEMPO_LINK_TOLERANCE) {
+      continue;
+    }
+    if (gap > TEMPO_MAX_PERIOD_NS +
+        TEMPO_MAX_PERIOD_NS / TEMPO_LINK_TOLERANCE) {
+      break;  // and everything before it is even further back
+    }
+
+    // A new chain of just prev and this hit.
+    struct TempoChain chain;
+    memset(&chain, 0, sizeof(chain));
+    chain.length = 2;
+    chain.n_downbeats = 1;
+    chain.downbeats_ns[0] = prev->ns;
+    tempo_fit(&chain, t);
+    if (chain.period_ns >= TEMPO_MIN_PERIOD_NS &&
+        chain.period_ns <= TEMPO_MAX_PERIOD_NS) {
+      tempo_keep_chain(hit.chains, &chain);
+    }
+
+    // Or this hit continuing one of prev's chains.
+    for (int i = 0; i < TEMPO_CHAINS; i++) {
+      const struct TempoChain* prev_chain = &prev->chains[i];
+      if (prev_chain->period_ns == 0) continue;
+      uint64_t off = gap > prev_chain->period_ns ?
+        gap - prev_chain->period_ns : prev_chain->period_ns - gap;
+      if (off > prev_chain->period_ns / TEMPO_LINK_TOLERANCE) continue;
+      chain.length = prev_chain->length + 1;
+      chain.n_downbeats = prev_chain->n_downbeats < TEMPO_DOWNBEATS ?
+        prev_chain->n_downbeats + 1 : TEMPO_DOWNBEATS;
+      chain.downbeats_ns[0] = prev->ns;
+      for (int k = 1; k < chain.n_downbeats; k++) {
+        chain.downbeats_ns[k] = prev_chain->downbeats_ns[k - 1];
+      }
+      tempo_fit(&chain, t);
+      if (chain.period_ns >= TEMPO_MIN_PERIOD_NS &&
+          chain.period_ns <= TEMPO_MAX_PERIOD_NS) {
+        tempo_keep_chain(hit.chains, &chain);
+      }
+    }
+  }
+
+  if (insert) {
+    tracker->hits[tracker->n_hits % TEMPO_HITS] = hit;
+    tracker->n_hits++;
+  }
+
+  // Same test as tempo_search(): up to a 1/32 note of error on each
+  // downbeat.  On a tie go with the slower tempo, which is what the search
+  // would have found first.
+  uint64_t window_period_ns = 60 * 1000000000LL / window_bpm;
+  const struct TempoChain* best = NULL;
+  const struct TempoChain* best_slower = NULL;
+  for (int i = 0; i < TEMPO_CHAINS; i++) {
+    const struct TempoChain* chain = &hit.chains[i];
+    if (chain->period_ns == 0 || chain->n_downbeats < TEMPO_DOWNBEATS) {
+      continue;
+    }
+    if (chain->error_ns >= chain->period_ns * TEMPO_DOWNBEATS / 32) continue;
+    if (2 * chain->period_ns <= window_period_ns) continue;  // too fast
+
+    const struct TempoChain** which =
+      chain->period_ns <= window_period_ns ? &best : &best_slower;
+    if (*which == NULL || chain->error_ns < (*which)->error_ns ||
+        (chain->error_ns == (*which)->error_ns &&
+         chain->period_ns > (*which)->period_ns)) {
+      *which = chain;
+    }
+  }
+  if (best == NULL && slower) best = best_slower;
+  if (best == NULL) return -1;
+  return 60.0 * 1000000000LL / best->period_ns;
+}
+
+// The brute force alternative: try every tempo from TEMPO_MIN_BPM in steps
+// of a tenth, and see how close the nearest hit comes to each of its last
+// TEMPO_DOWNBEATS downbeats.  That's up to 2000 candidates, so we score four
+// at a time with GCC's vector extensions (one NEON register on the Pi),
+// against all the hits merged into one sorted timeline.  Since the
+// candidates go from slow to fast, the downbeats they're looking for only
+// get more recent, so for each downbeat we keep a window into the timeline
+// that only moves one way, and only a couple of hits are in it at a time.
+
+#define TEMPO_STEPS_PER_BPM 10
+#define TEMPO_N_CANDIDATES \
+  ((TEMPO_MAX_BPM - TEMPO_MIN_BPM) * TEMPO_STEPS_PER_BPM)
+#define TEMPO_LANES 4
+
+typedef float tempo_vec __attribute__((vector_size(TEMPO_LANES * 4)));
+typedef int32_t tempo_mask __attribute__((vector_size(TEMPO_LANES * 4)));
+
+// Filled in the first time we search.
+tempo_vec tempo_candidate_periods[TEMPO_N_CANDIDATES / TEMPO_LANES];
+bool tempo_candidates_ready = false;
+
+float tempo_candidate_bpm(int candidate) {
+  return TEMPO_MIN_BPM + (float) candidate / TEMPO_STEPS_PER_BPM;
+}
+
+void tempo_init_candidates() {
+  for (int candidate = 0; candidate < TEMPO_N_CANDIDATES; candidate++) {
+    tempo_candidate_periods[candidate / TEMPO_LANES][candidate % TEMPO_LANES] =
+      60.0 * 1000000000LL / tempo_candidate_bpm(candidate);
+  }
+  tempo_candidates_ready = true;
+}
+
+// Add a hit at ns to the timeline ago, which holds how long before t each of
+// n hits was, shortest first.  Returns the new n.  Zero is an empty slot.
+int tempo_add_hit(float* ago, int n, uint64_t t, uint64_t ns) {
+  if (ns == 0 || ns > t) return n;
+  // Insertion sort: there are only a few dozen.
+  float hit_ago = t - ns;
+  int i = n;
+  while (i > 0 && ago[i - 1] > hit_ago) {
+    ago[i] = ago[i - 1];
+    i--;
+  }
+  ago[i] = hit_ago;
+  return n + 1;
+}
+
+// Nothing to line up with counts as being off by a second.
+#define TEMPO_NO_HIT_NS 1e9f
+
+// Candidate c's error is error[c / TEMPO_LANES][c % TEMPO_LANES].  Returns
+// the best acceptable candidate in [start, end), or -1.
+int tempo_best_candidate(const tempo_vec* error, int start, int end) {
+  int best = -1;
+  for (int c = start; c < end; c++) {
+    float period = tempo_candidate_periods[c / TEMPO_LANES][c % TEMPO_LANES];
+    float candidate_error = error[c / TEMPO_LANES][c % TEMPO_LANES];
+    // Allow error of up to 1/32 note on each of the downbeats.
+    if (candidate_error >= period * TEMPO_DOWNBEATS / 32) continue;
+    // On a tie the slower tempo, which comes first, wins.
+    if (best < 0 ||
+        candidate_error < error[best / TEMPO_LANES][best % TEMPO_LANES]) {
+      best = c;
+    }
+  }
+  return best;
+}
+
+// The best tempo for a timeline from tempo_add_hit(), or -1 if nothing fits.
+// Like tempo_tracker_hit(), we look from window_bpm up to twice that, and
+// then, if slower, at slower tempos.
+float tempo_search(const float* ago, int n, float window_bpm, bool slower) {
+  if (!tempo_candidates_ready) {
+    tempo_init_candidates();
+  }
+  int window_start = (window_bpm - TEMPO_MIN_BPM) * TEMPO_STEPS_PER_BPM;
+  int window_end = window_start + window_bpm * TEMPO_STEPS_PER_BPM;
+  if (window_start < 0) window_start = 0;
+  if (window_end > TEMPO_N_CANDIDATES) window_end = TEMPO_N_CANDIDATES;
+  if (window_start >= window_end) return -1;
+
+  // For downbeat k, the hits that might be nearest to one of the current
+  // candidates' downbeats are ago[lo[k] - 1] through ago[hi[k]].
+  int lo[TEMPO_DOWNBEATS];
+  int hi[TEMPO_DOWNBEATS];
+  for (int k = 0; k < TEMPO_DOWNBEATS; k++) {
+    lo[k] = n;
+    hi[k] = n;
+  }
+
+  // Nothing faster than the window can win, so stop there.
+  tempo_vec error[TEMPO_N_CANDIDATES / TEMPO_LANES];
+  int n_vecs = (window_end + TEMPO_LANES - 1) / TEMPO_LANES;
+  for (int v = 0; v < n_vecs; v++) {
+    tempo_vec period = tempo_candidate_periods[v];
+    error[v] = period * 0;
+    for (int k = 0; k < TEMPO_DOWNBEATS; k++) {
+      tempo_vec target = period * (float) (k + 1);
+      float longest = target[0];
+      float shortest = target[TEMPO_LANES - 1];
+      while (hi[k] > 0 && ago[hi[k] - 1] > longest) hi[k]--;
+      while (lo[k] > 0 && ago[lo[k] - 1] >= shortest) lo[k]--;
+      int first = lo[k] > 0 ? lo[k] - 1 : 0;
+      int last = hi[k] < n ? hi[k] : n - 1;
+
+      tempo_vec nearest = period * 0 + TEMPO_NO_HIT_NS;
+      for (int i = first; i <= last; i++) {
+        tempo_vec off = target - ago[i];
+        off = (tempo_vec) ((tempo_mask) off & 0x7fffffff);  // abs
+        tempo_mask closer = off < nearest;
+        nearest = (tempo_vec) (((tempo_mask) off & closer) |
+                               ((tempo_mask) nearest & ~closer));
+      }
+      error[v] += nearest;
+    }
+  }
+
+  int best = tempo_best_candidate(error, window_start, window_end);
+  if (best < 0 && slower) {
+    best = tempo_best_candidate(error, 0, window_start);
+  }
+  if (best < 0) return -1;
+  return tempo_candidate_bpm(best);
+}
+
+#endif
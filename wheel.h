@@ -0,0 +1,304 @@
+#ifndef JML_WHEEL_H
+#define JML_WHEEL_H
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// Hierarchical timing wheel: callbacks to run at absolute times on the now()
+// clock.  Level 0 has 256 slots of 2^20ns (about 1ms) each, and each level
+// above has 256 slots each covering a whole turn of the level below.  An
+// event lives at the lowest level where its slot number agrees with the
+// current slot in all the higher bits, and when the current slot crosses into
+// a new level N slot we move that slot's events down.  Six levels is enough
+// to cover the whole 64-bit clock, so nothing ever needs clamping.
+//
+// All events come from a fixed pool, so scheduling never allocates.
+// Each slot's events are in the order they were scheduled, except that level
+// 0 slots are kept in time order: a new event goes in after any in its 1ms
+// slot that are due no later, looking from the back, so scheduling in order
+// stays O(1).  Then firing is O(1), since what's due is at the front, and
+// cancelling is O(1).  Running the
+// wheel skips over empty slots using per-level occupancy bitmaps instead of
+// visiting every 1ms slot.
+
+#define WHEEL_SLOT_BITS 20
+#define WHEEL_LEVEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_LEVELS 6
+#define WHEEL_INDEX_BITS 12
+#define WHEEL_CAPACITY (1 << WHEEL_INDEX_BITS)
+
+// Handle for an event that isn't scheduled.
+#define WHEEL_NONE (-1)
+
+#define WHEEL_FREE 0xff
+
+typedef void (*WheelCallback)(int arg, uint64_t current_time);
+
+struct WheelEvent {
+  uint64_t ns;
+  WheelCallback callback;
+  int arg;
+  int16_t prev;  // within the slot's list, or the free list
+  int16_t next;
+  uint16_t generation;  // bumped each time this event is freed
+  uint8_t level;  // or WHEEL_FREE
+  uint8_t index;
+};
+
+struct Wheel {
+  uint64_t now_slot;  // the slot we've run up to
+  int16_t heads[WHEEL_LEVELS][WHEEL_SLOTS];
+  int16_t tails[WHEEL_LEVELS][WHEEL_SLOTS];
+  uint64_t occupied[WHEEL_LEVELS][WHEEL_SLOTS / 64];
+  struct WheelEvent events[WHEEL_CAPACITY];
+  int16_t free_head;
+
+  int n_pending;
+  int max_pending;
+  uint64_t n_fired;
+  uint64_t n_full;  // events we couldn't schedule because the pool was empty
+};
+
+void wheel_init(struct Wheel* wheel) {
+  memset(wheel, 0, sizeof(*wheel));
+  for (int level = 0; level < WHEEL_LEVELS; level++) {
+    for (int index = 0; index < WHEEL_SLOTS; index++) {
+      wheel->heads[level][index] = -1;
+      wheel->tails[level][index] = -1;
+    }
+  }
+  for (int i = 0; i < WHEEL_CAPACITY; i++) {
+    wheel->events[i].level = WHEEL_FREE;
+    wheel->events[i].next = i + 1 < WHEEL_CAPACITY ? i + 1 : -1;
+  }
+  wheel->free_head = 0;
+}
+
+int wheel_shift(int level) {
+  return level * WHEEL_LEVEL_BITS;
+}
+
+void wheel_link(struct Wheel* wheel, int i, uint64_t slot) {
+  uint64_t differing = slot ^ wheel->now_slot;
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 &&
+         (differing >> wheel_shift(level + 1)) != 0) {
+    level++;
+  }
+  int index = (slot >> wheel_shift(level)) & (WHEEL_SLOTS - 1);
+
+  struct WheelEvent* event = &wheel->events[i];
+  event->level = level;
+  event->index = index;
+  int prev = wheel->tails[level][index];
+  while (level == 0 && prev != -1 && wheel->events[prev].ns > event->ns) {
+    prev = wheel->events[prev].prev;
+  }
+  event->prev = prev;
+  event->next = prev == -1 ?
+    wheel->heads[level][index] : wheel->events[prev].next;
+  if (event->prev != -1) {
+    wheel->events[event->prev].next = i;
+  } else {
+    wheel->heads[level][index] = i;
+  }
+  if (event->next != -1) {
+    wheel->events[event->next].prev = i;
+  } else {
+    wheel->tails[level][index] = i;
+  }
+  wheel->occupied[level][index / 64] |= 1ULL << (index % 64);
+}
+
+void wheel_unlink(struct Wheel* wheel, int i) {
+  struct WheelEvent* event = &wheel->events[i];
+  if (event->prev != -1) {
+    wheel->events[event->prev].next = event->next;
+  } else {
+    wheel->heads[event->level][event->index] = event->next;
+    if (event->next == -1) {
+      wheel->occupied[event->level][event->index / 64] &=
+        ~(1ULL << (event->index % 64));
+    }
+  }
+  if (event->next != -1) {
+    wheel->events[event->next].prev = event->prev;
+  } else {
+    wheel->tails[event->level][event->index] = event->prev;
+  }
+}
+
+void wheel_free(struct Wheel* wheel, int i) {
+  struct WheelEvent* event = &wheel->events[i];
+  event->level = WHEEL_FREE;
+  event->generation++;
+  event->next = wheel->free_head;
+  wheel->free_head = i;
+  wheel->n_pending--;
+}
+
+// Run callback(arg, current_time) at ns, or as soon as possible if ns has
+// already passed.  Returns a handle for wheel_cancel(), or WHEEL_NONE if we're
+// out of events.
+int wheel_schedule(struct Wheel* wheel, uint64_t ns, WheelCallback callback,
+                   int arg) {
+  int i = wheel->free_head;
+  if (i == -1) {
+    wheel->n_full++;
+    return WHEEL_NONE;
+  }
+  struct WheelEvent* event = &wheel->events[i];
+  wheel->free_head = event->next;
+
+  event->ns = ns;
+  event->callback = callback;
+  event->arg = arg;
+
+  uint64_t slot = ns >> WHEEL_SLOT_BITS;
+  if (slot < wheel->now_slot) {
+    slot = wheel->now_slot;
+  }
+  wheel_link(wheel, i, slot);
+
+  wheel->n_pending++;
+  if (wheel->n_pending > wheel->max_pending) {
+    wheel->max_pending = wheel->n_pending;
+  }
+  return i | (event->generation << WHEEL_INDEX_BITS);
+}
+
+bool wheel_scheduled(struct Wheel* wheel, int handle) {
+  if (handle == WHEEL_NONE) return false;
+  struct WheelEvent* event =
+    &wheel->events[handle & (WHEEL_CAPACITY - 1)];
+  return event->level != WHEEL_FREE &&
+    event->generation == (uint16_t) (handle >> WHEEL_INDEX_BITS);
+}
+
+// When handle's event is due, or 0 if it isn't scheduled.
+uint64_t wheel_event_ns(struct Wheel* wheel, int handle) {
+  if (!wheel_scheduled(wheel, handle)) return 0;
+  return wheel->events[handle & (WHEEL_CAPACITY - 1)].ns;
+}
+
+// Returns whether there was anything to cancel: handles for events that
+// have already run (or been cancelled) are fine to pass.
+bool wheel_cancel(struct Wheel* wheel, int handle) {
+  if (!wheel_scheduled(wheel, handle)) return false;
+  int i = handle & (WHEEL_CAPACITY - 1);
+  wheel_unlink(wheel, i);
+  wheel_free(wheel, i);
+  return true;
+}
+
+// Lowest occupied slot index at level that is >= from, or -1.
+int wheel_lowest_occupied(struct Wheel* wheel, int level, int from) {
+  for (int word = from / 64; word < WHEEL_SLOTS / 64; word++) {
+    uint64_t bits = wheel->occupied[level][word];
+    if (word == from / 64) {
+      bits &= ~0ULL << (from % 64);
+    }
+    if (bits) {
+      return word * 64 + __builtin_ctzll(bits);
+    }
+  }
+  return -1;
+}
+
+// The first slot after now_slot that holds events or where events need to
+// move down a level, or 0 if there aren't any.
+uint64_t wheel_next_stop(struct Wheel* wheel) {
+  for (int level = 0; level < WHEEL_LEVELS; level++) {
+    int shift = wheel_shift(level);
+    int current = (wheel->now_slot >> shift) & (WHEEL_SLOTS - 1);
+    int index = wheel_lowest_occupied(wheel, level, current + 1);
+    if (index != -1) {
+      uint64_t turn = wheel->now_slot >> (shift + WHEEL_LEVEL_BITS);
+      return ((turn << WHEEL_LEVEL_BITS) | index) << shift;
+    }
+  }
+  return 0;
+}
+
+// We've just arrived at now_slot: move down the events from any slot that
+// starts here.  Higher levels first, since they can feed lower ones.
+void wheel_cascade(struct Wheel* wheel) {
+  for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+    int shift = wheel_shift(level);
+    if (wheel->now_slot & ((1ULL << shift) - 1)) continue;
+
+    int index = (wheel->now_slot >> shift) & (WHEEL_SLOTS - 1);
+    int i = wheel->heads[level][index];
+    wheel->heads[level][index] = -1;
+    wheel->tails[level][index] = -1;
+    wheel->occupied[level][index / 64] &= ~(1ULL << (index % 64));
+    while (i != -1) {
+      int next = wheel->events[i].next;
+      wheel_link(wheel, i, wheel->events[i].ns >> WHEEL_SLOT_BITS);
+      i = next;
+    }
+  }
+}
+
+// Run everything in the current slot that's due by current_time, earliest
+// first.  Callbacks may schedule or cancel anything, including more events
+// for this slot.
+void wheel_fire_due(struct Wheel* wheel, uint64_t current_time) {
+  int index = wheel->now_slot & (WHEEL_SLOTS - 1);
+  while (true) {
+    int due = wheel->heads[0][index];
+    if (due == -1 || wheel->events[due].ns > current_time) return;
+
+    WheelCallback callback = wheel->events[due].callback;
+    int arg = wheel->events[due].arg;
+    wheel_unlink(wheel, due);
+    wheel_free(wheel, due);
+    wheel->n_fired++;
+    callback(arg, current_time);
+  }
+}
+
+// Run everything due by current_time, in order.
+void wheel_run(struct Wheel* wheel, uint64_t current_time) {
+  uint64_t target_slot = current_time >> WHEEL_SLOT_BITS;
+  while (true) {
+    wheel_fire_due(wheel, current_time);
+    if (wheel->now_slot >= target_slot) return;
+
+    // Anything between here and the next stop is empty, so skip it.
+    uint64_t next_slot = wheel_next_stop(wheel);
+    if (next_slot == 0 || next_slot > target_slot) {
+      next_slot = target_slot;
+    }
+    wheel->now_slot = next_slot;
+    wheel_cascade(wheel);
+  }
+}
+
+// When wheel_run() next has something to do, or 0 if nothing is scheduled.
+// This can be early, when the earliest events are still on a higher level
+// and just need moving down.
+uint64_t wheel_next_deadline(struct Wheel* wheel) {
+  int current = wheel->now_slot & (WHEEL_SLOTS - 1);
+  int index = wheel_lowest_occupied(wheel, 0, current);
+  if (index != -1) {
+    uint64_t deadline = wheel->events[wheel->heads[0][index]].ns;
+    // Never 0, since that means nothing is scheduled.
+    return deadline == 0 ? 1 : deadline;
+  }
+
+  return wheel_next_stop(wheel) << WHEEL_SLOT_BITS;
+}
+
+void print_wheel_stats(const char* name, struct Wheel* wheel) {
+  printf("%s: %" PRIu64 " events run, %d pending, max %d pending, "
+         "%" PRIu64 " dropped because it was full\n",
+         name, wheel->n_fired, wheel->n_pending, wheel->max_pending,
+         wheel->n_full);
+}
+
+#endif